@@ -27,8 +27,21 @@
 
 namespace fsqueeze {
 
+/*
+ * The scalar type in which feature values and model sums are stored. With
+ * FSQUEEZE_FLOAT_STORAGE, they are stored in single precision to halve
+ * their memory use and bandwidth. Sums over contexts or events are always
+ * accumulated in double precision.
+ */
+#ifdef FSQUEEZE_FLOAT_STORAGE
+typedef float StorageScalar;
+#else
+typedef double StorageScalar;
+#endif
+
 typedef Eigen::VectorXd EventProbs;
-typedef Eigen::DynamicSparseMatrix<double, Eigen::RowMajor> FeatureValues;
+typedef Eigen::VectorXd EventCounts;
+typedef Eigen::DynamicSparseMatrix<StorageScalar, Eigen::RowMajor> FeatureValues;
 
 class Context {
 public:
@@ -37,7 +50,27 @@ public:
 	 */
 	Context(double prob, EventProbs const &eventProbs,
 		FeatureValues const &featureValues)
-	: d_prob(prob), d_eventProbs(eventProbs), d_featureValues(featureValues) {}
+	: d_prob(prob), d_eventProbs(eventProbs),
+		d_eventCounts(EventCounts::Ones(eventProbs.size())),
+		d_featureValues(featureValues) {}
+	
+	/**
+	 * Construct a context, taking over the storage of the event vector and
+	 * the feature values.
+	 */
+	Context(double prob, EventProbs &&eventProbs, FeatureValues &&featureValues);
+	
+	Context(Context const &other) = default;
+	
+	/**
+	 * Move a context. The storage of the other context is taken over, and
+	 * the other context is left empty.
+	 */
+	Context(Context &&other) noexcept;
+	
+	Context &operator=(Context const &other) = default;
+	
+	Context &operator=(Context &&other) noexcept;
 	
 	/**
 	 * Return the context probability.
@@ -60,6 +93,27 @@ public:
 	 */
 	void eventProbs(EventProbs const &eventProbs);
 	
+	/**
+	 * Use a new event vector, taking over its storage.
+	 */
+	void eventProbs(EventProbs &&eventProbs);
+	
+	/**
+	 * Divide the event probabilities by sum, in place.
+	 */
+	void normalizeEventProbs(double sum);
+	
+	/**
+	 * Get the number of times that each event occurs in the context. An
+	 * event that occurs n times contributes n * exp(sum) to Z(x).
+	 */
+	EventCounts const &eventCounts() const;
+	
+	/**
+	 * Use new event counts, taking over their storage.
+	 */
+	void eventCounts(EventCounts &&eventCounts);
+	
 	/**
 	 * Get the feature values.
 	 */
@@ -69,12 +123,46 @@ public:
 	 * Set feature values.
 	 */
 	void featureValues(FeatureValues const &featureValues);
+	
+	/**
+	 * Set feature values, taking over their storage.
+	 */
+	void featureValues(FeatureValues &&featureValues);
 private:
 	double d_prob;
 	EventProbs d_eventProbs;
+	EventCounts d_eventCounts;
 	FeatureValues d_featureValues;
 };
 
+// The Eigen types are swapped rather than moved, since the sparse matrix
+// type has no move constructor.
+inline Context::Context(double prob, EventProbs &&eventProbs,
+	FeatureValues &&featureValues)
+: d_prob(prob), d_eventCounts(EventCounts::Ones(eventProbs.size()))
+{
+	d_eventProbs.swap(eventProbs);
+	d_featureValues.swap(featureValues);
+}
+
+inline Context::Context(Context &&other) noexcept
+: d_prob(other.d_prob)
+{
+	d_eventProbs.swap(other.d_eventProbs);
+	d_eventCounts.swap(other.d_eventCounts);
+	d_featureValues.swap(other.d_featureValues);
+}
+
+inline Context &Context::operator=(Context &&other) noexcept
+{
+	d_prob = other.d_prob;
+	d_eventProbs.swap(other.d_eventProbs);
+	d_eventCounts.swap(other.d_eventCounts);
+	d_featureValues.swap(other.d_featureValues);
+	
+	return *this;
+}
+
 inline double Context::prob() const
 {
 	return d_prob;
@@ -95,6 +183,27 @@ inline void Context::eventProbs(EventProbs const &eventProbs)
 	d_eventProbs = eventProbs;
 }
 
+inline void Context::eventProbs(EventProbs &&eventProbs)
+{
+	d_eventProbs.swap(eventProbs);
+}
+
+inline void Context::normalizeEventProbs(double sum)
+{
+	for (int i = 0; i < d_eventProbs.size(); ++i)
+		d_eventProbs[i] /= sum;
+}
+
+inline EventCounts const &Context::eventCounts() const
+{
+	return d_eventCounts;
+}
+
+inline void Context::eventCounts(EventCounts &&eventCounts)
+{
+	d_eventCounts.swap(eventCounts);
+}
+
 inline FeatureValues const &Context::featureValues() const
 {
 	return d_featureValues;
@@ -105,7 +214,12 @@ inline void Context::featureValues(FeatureValues const &featureValues)
 	d_featureValues = featureValues;
 }
 
+inline void Context::featureValues(FeatureValues &&featureValues)
+{
+	d_featureValues.swap(featureValues);
+}
+
 
 }
 
-#endif // CONTEXT_HH
\ No newline at end of file
+#endif // CONTEXT_HH
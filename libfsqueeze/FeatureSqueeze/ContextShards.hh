@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+/*
+ * Out-of-core storage of contexts. A shard file holds the contexts of a
+ * data set in shards of consecutive contexts, followed by the occurrence
+ * lists of all features and the (small) per-context and per-feature data.
+ * The file is mapped into memory, and the selection algorithms visit the
+ * shards in order through a ShardCursor. Only the shard that is being
+ * processed is decoded, the next shard is read ahead, and the pages of
+ * the previous shard are released.
+ *
+ * Shard files are written in the byte order and precision of the build
+ * that writes them, and are not portable between machines.
+ */
+
+#ifndef CONTEXT_SHARDS_HH
+#define CONTEXT_SHARDS_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "Context.hh"
+#include "DataSet.hh"
+#include "ValueDictionary.hh"
+#include "maxent.hh"
+
+namespace fsqueeze {
+
+/*
+ * A shard is closed when it holds at least SHARD_BYTES bytes and a multiple
+ * of REDUCTION_BLOCK_SIZE contexts. Deterministic reductions over the
+ * shards then use the same blocks as over a data set in memory.
+ */
+size_t const SHARD_BYTES = 4 << 20;
+
+/**
+ * The contexts of a data set in a shard file, mapped read-only into
+ * memory.
+ */
+class ContextShards
+{
+public:
+	/**
+	 * Map a shard file. Throws a runtime_error if the file cannot be
+	 * mapped, or was not written by a build with the same storage
+	 * precision.
+	 */
+	ContextShards(std::string const &path);
+
+	/**
+	 * Map the shard file that is open as fd. The descriptor can be closed
+	 * afterwards.
+	 */
+	ContextShards(int fd, std::string const &name);
+
+	~ContextShards();
+
+	ContextShards(ContextShards const &other) = delete;
+
+	ContextShards &operator=(ContextShards const &other) = delete;
+
+	/**
+	 * Return the probabilities of all contexts, indexed by context.
+	 */
+	double const *contextProbs() const;
+
+	/**
+	 * Return the expected values of the features.
+	 */
+	Eigen::VectorXd expFeatureValues() const;
+
+	/**
+	 * Return the identifiers of the dynamic features in the data.
+	 */
+	FeatureIds featureIds() const;
+
+	size_t nContexts() const;
+
+	size_t nEvents() const;
+
+	int nFeatures() const;
+
+	size_t nFeatureIds() const;
+
+	size_t nNonZeros() const;
+
+	size_t nShards() const;
+
+	/**
+	 * Return the occurrences of all features, ordered by feature.
+	 */
+	FeatureOccurrence const *occurrences() const;
+
+	/**
+	 * Return the index of the first occurrence of each feature, followed
+	 * by the number of occurrences.
+	 */
+	uint64_t const *occurrenceOffsets() const;
+
+	/**
+	 * Ask the operating system to read a shard ahead.
+	 */
+	void prefetch(size_t shard) const;
+
+	/**
+	 * Decode the contexts of a shard.
+	 */
+	void readShard(size_t shard, ContextVector *contexts) const;
+
+	/**
+	 * Release the pages of a shard, after it was processed.
+	 */
+	void release(size_t shard) const;
+
+	/**
+	 * Return the index of the first context of a shard.
+	 */
+	size_t shardBegin(size_t shard) const;
+
+	/**
+	 * Return the number of events of a shard.
+	 */
+	size_t shardEvents(size_t shard) const;
+
+	/**
+	 * Return the number of non-zero feature values of a shard.
+	 */
+	size_t shardNonZeros(size_t shard) const;
+
+	/**
+	 * Return the distinct non-zero feature values.
+	 */
+	ValueDictionary valueDictionary() const;
+private:
+	void advise(size_t shard, int advice) const;
+	void map(int fd, std::string const &name);
+
+	char *d_data;
+	size_t d_size;
+};
+
+/**
+ * Writes a shard file. Contexts are added in order, and should already be
+ * normalized and use internal feature numbers.
+ */
+class ContextShardWriter
+{
+public:
+	ContextShardWriter(std::string const &path, int nFeatures);
+
+	ContextShardWriter(ContextShardWriter const &other) = delete;
+
+	ContextShardWriter &operator=(ContextShardWriter const &other) = delete;
+
+	void add(Context const &context);
+
+	/**
+	 * Write the per-feature data and the occurrence lists of the features.
+	 * The occurrence lists are collected in passes over the shards, where
+	 * each pass collects the occurrences of as many features as fit in
+	 * bufferSize bytes.
+	 */
+	void finish(FeatureIds const &featureIds, size_t nFeatureIds,
+		Eigen::VectorXd const &expFeatureValues,
+		ValueDictionary const &dictionary, size_t bufferSize);
+private:
+	void openShard();
+	void pad();
+
+	template <typename T>
+	void write(T const *data, size_t n);
+
+	void writeOccurrences(std::vector<uint64_t> const &offsets,
+		uint64_t shardsEnd, ValueDictionary const &dictionary,
+		size_t bufferSize);
+
+	std::string d_path;
+	std::ofstream d_out;
+	int d_nFeatures;
+	size_t d_nEvents;
+	size_t d_nNonZeros;
+	uint64_t d_offset;
+
+	// File offset, first context, events and non-zero values per shard.
+	// The last shard is the shard that contexts are added to.
+	std::vector<uint64_t> d_shardOffsets;
+	std::vector<uint64_t> d_shardBegins;
+	std::vector<uint64_t> d_shardEvents;
+	std::vector<uint64_t> d_shardNonZeros;
+
+	std::vector<double> d_contextProbs;
+
+	// Non-zero values per feature.
+	std::vector<uint64_t> d_featureCounts;
+};
+
+/**
+ * A shard file in shared memory: a named POSIX shared memory segment, or a
+ * file on a memory file system such as hugetlbfs. The shard file is
+ * published once, and every process that selects on it maps it read-only,
+ * without parsing or copying the data set.
+ *
+ * Attached processes hold a shared lock on the segment, its publisher
+ * holds an exclusive lock until the segment is complete. The process that
+ * detaches last removes the segment. A segment that a failed publisher
+ * left incomplete is removed by the next process that attaches. A complete
+ * segment of processes that were all killed stays until it is removed by
+ * hand, e.g. /dev/shm/<name> for a POSIX shared memory name.
+ *
+ * The segment records the path, size and modification time of the data
+ * file that it was published from, and processes only attach to a segment
+ * of the same data file.
+ */
+class SharedShards
+{
+public:
+	/**
+	 * Attach to a shared shard file of the data file at dataPath. Names
+	 * with a slash after the first character are paths, other names are
+	 * POSIX shared memory names. If the segment does not exist yet, it is
+	 * created, and should be filled with publish(). Throws a runtime_error
+	 * if the segment was published from another data file, or if the data
+	 * file changed since.
+	 */
+	SharedShards(std::string const &name, std::string const &dataPath);
+
+	/**
+	 * Detach, removing the segment if no other process is attached.
+	 */
+	~SharedShards();
+
+	SharedShards(SharedShards const &other) = delete;
+
+	SharedShards &operator=(SharedShards const &other) = delete;
+
+	/**
+	 * Open the data set in the segment.
+	 */
+	DataSet dataSet() const;
+
+	std::string const &name() const;
+
+	/**
+	 * Copy a shard file of the data file into a segment that was created
+	 * by this process.
+	 */
+	void publish(std::string const &shardPath);
+
+	/**
+	 * Return true if the segment holds a shard file.
+	 */
+	bool published() const;
+private:
+	bool sameSegment() const;
+
+	std::string d_name;
+	std::string d_dataPath;
+	int d_fd;
+	bool d_published;
+};
+
+inline std::string const &SharedShards::name() const
+{
+	return d_name;
+}
+
+inline bool SharedShards::published() const
+{
+	return d_published;
+}
+
+/**
+ * Return true if the file at path starts like a shard file.
+ */
+bool isShardFile(std::string const &path);
+
+/**
+ * Visits the contexts of a data set shard by shard:
+ *
+ *   for (ShardCursor shard(dataSet); shard.next(); )
+ *     for (size_t i = 0; i < shard.contexts().size(); ++i)
+ *       // Context shard.offset() + i of the data set.
+ *
+ * A data set in memory consists of one shard, which is not copied.
+ */
+class ShardCursor
+{
+public:
+	ShardCursor(DataSet const &dataSet);
+
+	~ShardCursor();
+
+	ShardCursor(ShardCursor const &other) = delete;
+
+	ShardCursor &operator=(ShardCursor const &other) = delete;
+
+	/**
+	 * Return the contexts of the current shard.
+	 */
+	ContextVector const &contexts() const;
+
+	/**
+	 * Move to the next shard. Returns false if there are no more shards.
+	 */
+	bool next();
+
+	/**
+	 * Return the running count of non-zero feature values of the contexts
+	 * of the current shard (see countNonZeros).
+	 */
+	NonZeroOffsets const &nonZeroOffsets() const;
+
+	/**
+	 * Return the index of the first context of the current shard in the
+	 * data set.
+	 */
+	size_t offset() const;
+private:
+	DataSet const *d_dataSet;
+	size_t d_shard;
+	size_t d_offset;
+	ContextVector const *d_contexts;
+	ContextVector d_buffer;
+	NonZeroOffsets d_nonZeroOffsets;
+};
+
+inline ContextVector const &ShardCursor::contexts() const
+{
+	return *d_contexts;
+}
+
+inline NonZeroOffsets const &ShardCursor::nonZeroOffsets() const
+{
+	return d_dataSet->outOfCore() ? d_nonZeroOffsets :
+		d_dataSet->contextNonZeros();
+}
+
+inline size_t ShardCursor::offset() const
+{
+	return d_offset;
+}
+
+}
+
+#endif // CONTEXT_SHARDS_HH
@@ -24,28 +24,46 @@
 #ifndef DATASET_HH
 #define DATASET_HH
 
+#include <cstdint>
 #include <istream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
-#include <tr1/unordered_map>
-#include <tr1/unordered_set>
-
 #include <Eigen/Core>
 
 #include "Context.hh"
+#include "ValueDictionary.hh"
+#include "hugepages.hh"
+#include "memory.hh"
 
 namespace fsqueeze {
 
-typedef std::vector<Context> ContextVector;
-typedef std::tr1::unordered_map<size_t,
-	std::vector<std::pair<double, double> > > DsFeatureMap;
+class ContextShards;
+
+typedef std::vector<Context, HugePageAllocator<Context> > ContextVector;
 typedef Eigen::VectorXi FeatureChangeFreqs;
+typedef std::vector<size_t> FeatureIds;
+typedef std::vector<uint64_t> NonZeroOffsets;
+typedef std::unordered_map<size_t, size_t> FeatureIdMap;
 
 /**
  * This class represents datasets to be used for feature selection. Datasets
  * can be read from a stream using one of the static members (currently only
  * readTADMDataSet).
+ *
+ * Dynamic features are numbered 0..nFeatures() - 1 internally, in the order
+ * of their identifiers in the data. Use featureId() to translate an internal
+ * feature number to the identifier in the data, and internalFeature() for
+ * the reverse.
+ *
+ * The contexts of an out-of-core data set stay in a shard file (see
+ * ContextShards), only the per-context probabilities and the per-feature
+ * data are kept in memory. Contexts should be visited with a ShardCursor,
+ * which works for both kinds of data sets.
  */
 class DataSet
 {
@@ -57,14 +75,44 @@ public:
 	 */
 	DataSet(ContextVector const &contexts);
 	
+	/**
+	 * Construct a dataset from a context vector, taking over the contexts.
+	 */
+	DataSet(ContextVector &&contexts);
+	
 	DataSet(DataSet const &other);
 	
+	DataSet(DataSet &&other) noexcept;
+	
 	DataSet &operator=(DataSet const &other);
+	
+	DataSet &operator=(DataSet &&other) noexcept;
 
 	/**
-	 * Get contexts.
+	 * Get contexts. The contexts of an out-of-core data set are not in
+	 * memory, so this vector is empty.
 	 */
 	ContextVector const &contexts() const;
+
+	/**
+	 * Return the running count of non-zero feature values of the contexts
+	 * in memory (see countNonZeros).
+	 */
+	NonZeroOffsets const &contextNonZeros() const;
+	
+	/**
+	 * Return the probability of a context.
+	 */
+	double contextProb(size_t context) const;
+	
+	/**
+	 * Write a TADM-style data set to a shard file, without keeping its
+	 * contexts in memory. The stream is read twice, so it should be
+	 * seekable. The occurrence lists of the features are collected in
+	 * passes that use up to bufferSize bytes.
+	 */
+	static void convertTADMDataSet(std::istream &iss,
+		std::string const &shardPath, size_t bufferSize);
 	
 	FeatureChangeFreqs dynamicFeatureFreqs() const;
 	
@@ -74,25 +122,104 @@ public:
 	Eigen::VectorXd const &expFeatureValues() const;
 	
 	/**
-	 * Get dataset features.
+	 * Fold events with identical feature values within a context into one
+	 * event, and identical contexts into one context. The probabilities of
+	 * folded events and contexts are summed, and folded events are counted
+	 * in Z(x), so the maximum entropy model does not change.
 	 */
-	DsFeatureMap const &features() const;
+	void foldDuplicates();
 	
 	/**
-	 * Return the number of features.
+	 * Return the identifier in the data of an internal feature number.
+	 */
+	size_t featureId(size_t feature) const;
+	
+	/**
+	 * Return the internal feature number of an identifier in the data, or
+	 * -1 if the feature is static or does not occur in the data.
+	 */
+	int internalFeature(size_t featureId) const;
+	
+	/**
+	 * Estimate the number of bytes used by the structures of the dataset.
+	 */
+	MemoryUsage memoryUsage() const;
+	
+	/**
+	 * Return the number of contexts.
+	 */
+	size_t nContexts() const;
+	
+	/**
+	 * Return the number of (dynamic) features.
 	 */
 	int nFeatures() const;
+	
+	/**
+	 * Return the largest feature identifier in the data plus one.
+	 */
+	size_t nFeatureIds() const;
+
+	/**
+	 * Return the distinct non-zero feature values, or an empty dictionary
+	 * if the data set has more than ValueDictionary::MAX_SIZE of them.
+	 */
+	ValueDictionary const &valueDictionary() const;
+
+	/**
+	 * Open an out-of-core data set in a shard file.
+	 */
+	static DataSet openShardedDataSet(std::string const &shardPath);
+
+	/**
+	 * Open an out-of-core data set in a shard file that is open as fd,
+	 * such as a shared memory segment (see SharedShards).
+	 */
+	static DataSet openShardedDataSet(int fd, std::string const &name);
+
+	/**
+	 * Return true if the contexts are kept in a shard file.
+	 */
+	bool outOfCore() const;
+
+	/**
+	 * Reallocate the contexts from the threads that start with them in the
+	 * scheduled parallel loops (see ContextScheduler). On NUMA systems,
+	 * this places the data of a context on the node of the thread that
+	 * uses it.
+	 */
+	void placeContexts();
 
 	/**
 	 * Read a TADM-style dataset from an input stream.
 	 */
 	static DataSet readTADMDataSet(std::istream &iss);
+
+	/**
+	 * Read the shards firstShard..lastShard - 1 of a shard file into
+	 * memory. The contexts are numbered from the first context of
+	 * firstShard, the features and their expected values are those of the
+	 * whole data set. Used by the workers of a multi-process selection.
+	 */
+	static DataSet readShards(std::string const &shardPath, size_t firstShard,
+		size_t lastShard);
+
+	/**
+	 * Return the shard file of an out-of-core data set, or null.
+	 */
+	ContextShards const *shards() const;
 private:
+	DataSet(std::shared_ptr<ContextShards const> const &shards);
 	void copy(DataSet const &other);
-	void buildFeatureMap();
+	void swap(DataSet &other);
+	static void addDynamicFeatures(Context const &context,
+		std::unordered_set<size_t> *changing);
 	double contextSum() const;
 	void countFeatures();
-	std::tr1::unordered_set<size_t> dynamicFeatures() const;
+	static void foldEvents(Context *context);
+	std::unordered_set<size_t> dynamicFeatures() const;
+	static void numberFeatures(FeatureIdMap const &featureIdMap,
+		int nFeatures, Context *context);
 	void normalize();
 	void normalizeContexts(double ctxSum);
 	void normalizeEvents(double ctxSum);
@@ -100,12 +227,21 @@ private:
 		readEvent(std::string const &eventLine);
 	static Context readContext(std::istream &iss);
 	void removeStaticFeatures();
+	MemoryUsage shardedMemoryUsage() const;
 	void sumContexts();
+	void buildValueDictionary();
 	
 	ContextVector d_contexts;
-	DsFeatureMap d_features;
+	NonZeroOffsets d_contextNonZeros;
+	FeatureIds d_featureIds;
+	FeatureIdMap d_featureIdMap;
 	int d_nFeatures;
+	size_t d_nFeatureIds;
 	Eigen::VectorXd d_expFeatureValues;
+	ValueDictionary d_valueDictionary;
+	std::shared_ptr<ContextShards const> d_shards;
+	size_t d_nContexts;
+	double const *d_contextProbs;
 };
 
 template <typename T>
@@ -128,14 +264,36 @@ inline ContextVector const &DataSet::contexts() const
 	return d_contexts;
 }
 
+inline NonZeroOffsets const &DataSet::contextNonZeros() const
+{
+	return d_contextNonZeros;
+}
+
+inline double DataSet::contextProb(size_t context) const
+{
+	return d_contextProbs != 0 ? d_contextProbs[context] :
+		d_contexts[context].prob();
+}
+
 inline Eigen::VectorXd const &DataSet::expFeatureValues() const
 {
 	return d_expFeatureValues;
 }
 
-inline DsFeatureMap const &DataSet::features() const
+inline size_t DataSet::featureId(size_t feature) const
+{
+	return d_featureIds[feature];
+}
+
+inline int DataSet::internalFeature(size_t featureId) const
+{
+	FeatureIdMap::const_iterator iter = d_featureIdMap.find(featureId);
+	return iter == d_featureIdMap.end() ? -1 : static_cast<int>(iter->second);
+}
+
+inline size_t DataSet::nContexts() const
 {
-	return d_features;
+	return d_shards.get() != 0 ? d_nContexts : d_contexts.size();
 }
 
 inline int DataSet::nFeatures() const
@@ -143,6 +301,26 @@ inline int DataSet::nFeatures() const
 	return d_nFeatures;
 }
 
+inline size_t DataSet::nFeatureIds() const
+{
+	return d_nFeatureIds;
+}
+
+inline bool DataSet::outOfCore() const
+{
+	return d_shards.get() != 0;
+}
+
+inline ContextShards const *DataSet::shards() const
+{
+	return d_shards.get();
+}
+
+inline ValueDictionary const &DataSet::valueDictionary() const
+{
+	return d_valueDictionary;
+}
+
 template <typename T>
 void SumProb<T>::operator()(T const &v)
 {
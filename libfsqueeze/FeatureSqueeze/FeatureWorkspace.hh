@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+#ifndef FEATURE_WORKSPACE_HH
+#define FEATURE_WORKSPACE_HH
+
+#include <cstddef>
+#include <vector>
+
+#include "DataSet.hh"
+#include "maxent.hh"
+
+namespace fsqueeze {
+
+/**
+ * Workspace for estimating the weight of a single candidate feature. The
+ * workspace keeps the exp(alpha * f) factors of the occurrences of the
+ * feature for its current weight, so that the gradient, gain and model
+ * update for a weight share one evaluation of each exponential. If the
+ * data set has a value dictionary, the factors are kept per value rather
+ * than per occurrence.
+ */
+class FeatureWorkspace {
+public:
+	/**
+	 * Construct a workspace for a feature with weight zero, from the
+	 * occurrences [begin, end) of the feature.
+	 */
+	FeatureWorkspace(DataSet const &dataSet, FeatureOccurrence const *begin,
+		FeatureOccurrence const *end, size_t feature);
+	
+	/**
+	 * Return the current weight.
+	 */
+	double alpha() const;
+	
+	/**
+	 * Set the weight, and calculate the factors for the new weight.
+	 */
+	void alpha(double alpha);
+	
+	/**
+	 * Return the feature.
+	 */
+	size_t feature() const;
+	
+	/**
+	 * Calculate the gain of the model after adding the feature with the
+	 * current weight.
+	 */
+	double gain(Sums const &sums, Zs const &zs, bool deterministic) const;
+	
+	/**
+	 * Subtract the contributions of the contexts to G' and G'' for the
+	 * current weight. The contributions of contexts are summed in context
+	 * order, or per reduction block if deterministic is true, regardless
+	 * of the number of threads.
+	 */
+	void gradient(Sums const &sums, Zs const &zs, double *gp, double *gpp,
+		bool deterministic) const;
+	
+	/**
+	 * Add the feature with the current weight to the model.
+	 */
+	void adjustModel(Sums *sums, Zs *zs) const;
+private:
+	typedef FeatureOccurrence const *OccurrenceIter;
+	
+	/**
+	 * The occurrences in the k-th context in which the feature occurs.
+	 */
+	OccurrenceIter contextBegin(size_t k) const;
+	OccurrenceIter contextEnd(size_t k) const;
+	
+	/**
+	 * Subtract the values of the contexts in which the feature occurs from
+	 * sum, in context order or per reduction block (see gradient).
+	 */
+	void subtractContextValues(std::vector<double> const &values,
+		bool deterministic, double *sum) const;
+	
+	/**
+	 * Z(x) of the context of the occurrences [begin, end) for the current
+	 * weight, where factors(k) is the factor of the k-th occurrence.
+	 */
+	template <typename Factors>
+	double newZ(Factors const &factors, OccurrenceIter begin,
+		OccurrenceIter end, Sum const &ctxSums, double z) const;
+	
+	template <typename Factors>
+	double gain(Factors const &factors, Sums const &sums, Zs const &zs,
+		bool deterministic) const;
+	
+	template <typename Factors>
+	void gradient(Factors const &factors, Sums const &sums, Zs const &zs,
+		double *gp, double *gpp, bool deterministic) const;
+	
+	template <typename Factors>
+	void adjustModel(Factors const &factors, Sums *sums, Zs *zs) const;
+	
+	/**
+	 * log(Z'(x) / Z(x)) of the context of the occurrences [begin, end) for
+	 * the current weight, from shifted log-sums (see shiftedLogZRatio in
+	 * maxent.hh). Used when the factors take the sums out of range.
+	 */
+	double shiftedLogZRatio(OccurrenceIter begin, OccurrenceIter end,
+		Sum const &ctxSums, double z, Eigen::VectorXd *probs) const;
+	
+	/**
+	 * The model expectation of the feature and its variance in the context
+	 * of the occurrences [begin, end), from shifted log-sums.
+	 */
+	void shiftedMoments(OccurrenceIter begin, OccurrenceIter end,
+		Sum const &ctxSums, double z, double *p_fx, double *gppSum) const;
+	
+	DataSet const *d_dataSet;
+	FeatureOccurrence const *d_begin;
+	FeatureOccurrence const *d_end;
+	size_t d_feature;
+	double d_alpha;
+	
+	// The index of the first occurrence in each context in which the
+	// feature occurs, followed by the number of occurrences. These are the
+	// running costs of the contexts for ContextScheduler.
+	NonZeroOffsets d_contextOffsets;
+	
+	// Factors per occurrence, used without a value dictionary.
+	std::vector<double> d_factors;
+	
+	// Factors per value of the dictionary.
+	std::vector<double> d_valueFactors;
+};
+
+inline double FeatureWorkspace::alpha() const
+{
+	return d_alpha;
+}
+
+inline size_t FeatureWorkspace::feature() const
+{
+	return d_feature;
+}
+
+inline FeatureWorkspace::OccurrenceIter FeatureWorkspace::contextBegin(
+	size_t k) const
+{
+	return d_begin + d_contextOffsets[k];
+}
+
+inline FeatureWorkspace::OccurrenceIter FeatureWorkspace::contextEnd(
+	size_t k) const
+{
+	return d_begin + d_contextOffsets[k + 1];
+}
+
+}
+
+#endif // FEATURE_WORKSPACE_HH
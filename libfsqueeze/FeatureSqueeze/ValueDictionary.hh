@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+#ifndef VALUE_DICTIONARY_HH
+#define VALUE_DICTIONARY_HH
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace fsqueeze {
+
+/**
+ * The distinct non-zero feature values of a data set. Features usually
+ * take only a handful of values, such as 1.0 for indicator features or
+ * small counts. The kernels then compute exp(alpha * f) once per value of
+ * the dictionary, rather than once per occurrence of a feature. Data sets
+ * with more than MAX_SIZE distinct values have an empty dictionary.
+ *
+ * Kernels that read feature values from the sparse feature matrices only
+ * use the dictionary for indicator features, since looking up the index
+ * of an arbitrary value is not cheaper than exp(). Feature workspaces look
+ * up the value index of every occurrence once, and then use the factors of
+ * all values.
+ */
+class ValueDictionary
+{
+public:
+	static size_t const MAX_SIZE = 16;
+
+	/**
+	 * Add a value. If the dictionary would grow beyond MAX_SIZE values,
+	 * it is cleared and false is returned.
+	 */
+	bool add(double value);
+
+	void clear();
+
+	bool empty() const;
+
+	/**
+	 * Return the index of a value, or -1 if it is not in the dictionary.
+	 */
+	int index(double value) const;
+
+	/**
+	 * Return true if all values are 1.0.
+	 */
+	bool indicator() const;
+
+	size_t size() const;
+
+	double operator[](size_t index) const;
+
+	/**
+	 * Store exp(alpha * v) for every value v of the dictionary in factors.
+	 */
+	void factors(double alpha, double *factors) const;
+private:
+	std::vector<double> d_values;
+};
+
+/**
+ * Computes exp(alpha * f) for every occurrence.
+ */
+class ExpFactor
+{
+public:
+	ExpFactor(double alpha) : d_alpha(alpha) {}
+	double operator()(double fVal) const;
+private:
+	double d_alpha;
+};
+
+/**
+ * exp(alpha * f) of indicator features, where f is always 1.0.
+ */
+class IndicatorFactor
+{
+public:
+	IndicatorFactor(double const *factors) : d_factor(*factors) {}
+	double operator()(double) const;
+private:
+	double d_factor;
+};
+
+inline bool ValueDictionary::add(double value)
+{
+	if (index(value) != -1)
+		return true;
+
+	if (d_values.size() == MAX_SIZE)
+	{
+		clear();
+		return false;
+	}
+
+	d_values.push_back(value);
+	return true;
+}
+
+inline void ValueDictionary::clear()
+{
+	std::vector<double>().swap(d_values);
+}
+
+inline bool ValueDictionary::empty() const
+{
+	return d_values.empty();
+}
+
+inline int ValueDictionary::index(double value) const
+{
+	for (size_t i = 0; i < d_values.size(); ++i)
+		if (d_values[i] == value)
+			return static_cast<int>(i);
+
+	return -1;
+}
+
+inline bool ValueDictionary::indicator() const
+{
+	return d_values.size() == 1 && d_values[0] == 1.0;
+}
+
+inline size_t ValueDictionary::size() const
+{
+	return d_values.size();
+}
+
+inline double ValueDictionary::operator[](size_t index) const
+{
+	return d_values[index];
+}
+
+inline void ValueDictionary::factors(double alpha, double *factors) const
+{
+	for (size_t i = 0; i < d_values.size(); ++i)
+		factors[i] = std::exp(alpha * d_values[i]);
+}
+
+inline double ExpFactor::operator()(double fVal) const
+{
+	return std::exp(d_alpha * fVal);
+}
+
+inline double IndicatorFactor::operator()(double) const
+{
+	return d_factor;
+}
+
+}
+
+#endif // VALUE_DICTIONARY_HH
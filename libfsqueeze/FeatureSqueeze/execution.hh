@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+/*
+ * Execution configuration: the number of threads used by the parallel
+ * loops, pinning of threads to CPUs, placement of data on NUMA nodes, and
+ * the use of huge pages.
+ */
+
+#ifndef FSQUEEZE_EXECUTION_HH
+#define FSQUEEZE_EXECUTION_HH
+
+#include <cstddef>
+#include <string>
+
+#include "DataSet.hh"
+#include "hugepages.hh"
+
+namespace fsqueeze {
+
+enum NumaPlacement {
+	/*
+	 * Use the default memory policy of the operating system.
+	 */
+	NUMA_DEFAULT,
+
+	/*
+	 * Interleave pages over all NUMA nodes.
+	 */
+	NUMA_INTERLEAVE,
+
+	/*
+	 * Let each thread allocate the contexts that it processes, so that
+	 * they are placed on the NUMA node of that thread.
+	 */
+	NUMA_PARTITION
+};
+
+struct ExecutionConfig {
+	ExecutionConfig() : nThreads(0), pinThreads(false),
+		numaPlacement(NUMA_DEFAULT), hugePages(HUGE_PAGES_TRANSPARENT) {}
+	size_t nThreads;
+	bool pinThreads;
+	NumaPlacement numaPlacement;
+	HugePagePolicy hugePages;
+};
+
+/**
+ * Apply an execution configuration. This should be done before reading
+ * a data set, since the memory and huge page policies only apply to
+ * allocations that are made after calling this function.
+ *
+ * @config The configuration to apply, a thread count of zero leaves the
+ *  default of the OpenMP runtime intact.
+ */
+void applyExecutionConfig(ExecutionConfig const &config);
+
+/**
+ * Return the number of threads that parallel loops will use.
+ */
+int executionThreads();
+
+/**
+ * Place a data set according to an execution configuration. With
+ * partitioned placement, context data is copied by the threads that
+ * start with it in the scheduled selection loops.
+ */
+void placeDataSet(ExecutionConfig const &config, DataSet *dataSet);
+
+/**
+ * Parse the name of a NUMA placement policy ('default', 'interleave', or
+ * 'partition').
+ */
+NumaPlacement parseNumaPlacement(std::string const &placement);
+
+}
+
+#endif // FSQUEEZE_EXECUTION_HH
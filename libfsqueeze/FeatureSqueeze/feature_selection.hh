@@ -20,18 +20,21 @@
 #ifndef FEATURE_SELECTION_HH
 #define FEATURE_SELECTION_HH
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
-#include <tr1/unordered_map>
-
 #include <Eigen/Core>
 
 #include "DataSet.hh"
 #include "Logger.hh"
+#include "maxent.hh"
+#include "memory.hh"
 #include "selection.hh"
 
 namespace std {
@@ -48,19 +51,75 @@ namespace fsqueeze {
 typedef Eigen::VectorXd R_f;
 typedef Eigen::VectorXd Gp;
 typedef Eigen::VectorXd Gpp;
-typedef std::tr1::unordered_map<size_t, double> GainDeltas;
+typedef std::unordered_map<size_t, double> GainDeltas;
 
 struct SelectionParameters {
-  SelectionParameters() : alphaThreshold(1e-10), gainThreshold(1e-20),
+  SelectionParameters() :
+    alphaThreshold(std::max(1e-10, MIN_ALPHA_THRESHOLD)), gainThreshold(1e-20),
     nFeatures(std::numeric_limits<size_t>::max()),
     detectOverlap(false), fullOptimizationCycles(0),
-    fullOptimizationExpBase(0.0) {}
+    fullOptimizationExpBase(0.0), deterministic(false), batchSize(1),
+    batchOverlap(0.0), pruneGains(false), speculativeBatch(1),
+    featureParallel(false) {}
   double alphaThreshold;
   double gainThreshold;
   size_t nFeatures;
   bool detectOverlap;
   size_t fullOptimizationCycles;
   double fullOptimizationExpBase;
+
+  /*
+   * Reduce gradients and gains in a fixed order, so that the selection
+   * does not vary between runs and thread counts.
+   */
+  bool deterministic;
+
+  /*
+   * Features that may not be selected.
+   */
+  std::vector<size_t> excludedFeatures;
+
+  /*
+   * Features that are added to the model before selection starts, in
+   * the given order.
+   */
+  std::vector<size_t> forcedFeatures;
+
+  /*
+   * Maximum number of features that the full selection algorithm adds
+   * per stage.
+   */
+  size_t batchSize;
+
+  /*
+   * Maximum fraction of the contexts of a feature that may be shared with
+   * features added earlier in the same stage.
+   */
+  double batchOverlap;
+
+  /*
+   * Only estimate the weights of candidates that could be among the best
+   * features of a full selection stage according to an upper bound on
+   * their gains.
+   */
+  bool pruneGains;
+
+  /*
+   * Maximum number of candidates that the fast selection algorithm
+   * recalculates concurrently. The selection does not depend on this
+   * number.
+   */
+  size_t speculativeBatch;
+
+  /*
+   * Calculate G', G'' and the gains of the candidates of full selection
+   * stages per feature from its occurrences, rather than per context.
+   * Every thread owns a range of features, so no updates have to be
+   * synchronized. The sums of a feature are over its contexts in order,
+   * so the selection does not vary between thread counts, but it can
+   * differ in the last digits from a deterministic selection.
+   */
+  bool featureParallel;
 };
 
 /**
@@ -91,6 +150,174 @@ SelectedFeatureAlphas fastFeatureSelection(DataSet const &ds, Logger logger,
 SelectedFeatureAlphas featureSelection(DataSet const &ds, Logger logger,
     SelectionParameters const &param);
 
+/**
+ * Partial G' and G'' of the features that are active in a block of
+ * contexts.
+ */
+typedef std::unordered_map<size_t, std::pair<double, double> > BlockGradients;
+
+/**
+ * The model of a full selection, with the sums over the contexts of a data
+ * set that a selection stage needs. The stages only access the contexts
+ * through a model, so that the contexts can be divided over processes.
+ * The sums of the parts of a data set can be added up; deterministic
+ * models add them per block of REDUCTION_BLOCK_SIZE contexts, in block
+ * order.
+ *
+ * Gain bounds, batches and L-BFGS optimization need the contexts
+ * themselves. Models that do not hold the contexts throw a runtime_error
+ * when they are used.
+ */
+class SelectionModel
+{
+public:
+  virtual ~SelectionModel();
+
+  /**
+   * Assign the weight alpha to a feature, whose weight was zero.
+   */
+  virtual void adjust(size_t feature, double alpha) = 0;
+
+  /**
+   * The model expectation of each feature.
+   */
+  virtual ExpectedValues expModelFeatureValues(bool deterministic) = 0;
+
+  /**
+   * Start a selection stage for the current model, and return the
+   * features that are active in at least one context and not excluded.
+   */
+  virtual FeatureSet startStage(FeatureSet const &excludedFeatures) = 0;
+
+  /**
+   * Subtract the contributions of the contexts to G' and G'' of the
+   * unconverged features of the current stage from gp and gpp.
+   */
+  virtual void gradients(FeatureSet const &unconvergedFeatures,
+    FeatureWeights const &alphas, bool deterministic, Gp *gp, Gpp *gpp) = 0;
+
+  /**
+   * Calculate the gains of the given features of the current stage, or of
+   * all features if features is null.
+   */
+  virtual OrderedGains gains(FeatureWeights const &alphas,
+    FeatureSet const *features, bool deterministic) = 0;
+
+  /**
+   * Calculate an upper bound on the gain of each active feature of the
+   * current stage (see gainBounds in maxent.hh).
+   */
+  virtual OrderedGains gainBounds(ExpectedValues const &expModelValues);
+
+  /**
+   * Add the next-best features of the current stage, after the best
+   * feature was added (see SelectionParameters::batchSize).
+   */
+  virtual void addBatch(SelectionParameters const &param,
+    OrderedGains const &gains, FeatureWeights const &alphas,
+    FeatureSet *selectedFeatures, SelectedFeatureAlphas *selectedFeatureAlphas);
+
+  /**
+   * Optimize the weights of the selected features with L-BFGS, and
+   * recalculate the model.
+   */
+  virtual void optimize(FeatureSet const &selectedFeatures,
+    SelectedFeatureAlphas const &selectedFeatureAlphas);
+};
+
+/**
+ * The model of a data set in the memory of this process, or out-of-core.
+ */
+class DataSetModel : public SelectionModel
+{
+public:
+  /**
+   * Construct the uniform model of a data set. If occurrences is not null,
+   * G', G'' and the gains are calculated per feature from its occurrences
+   * (see SelectionParameters::featureParallel).
+   */
+  DataSetModel(DataSet const &dataSet,
+    FeatureOccurrences const *occurrences = 0);
+
+  DataSetModel(DataSetModel const &other) = delete;
+
+  DataSetModel &operator=(DataSetModel const &other) = delete;
+
+  void adjust(size_t feature, double alpha);
+  ExpectedValues expModelFeatureValues(bool deterministic);
+  FeatureSet startStage(FeatureSet const &excludedFeatures);
+  void gradients(FeatureSet const &unconvergedFeatures,
+    FeatureWeights const &alphas, bool deterministic, Gp *gp, Gpp *gpp);
+  OrderedGains gains(FeatureWeights const &alphas, FeatureSet const *features,
+    bool deterministic);
+  OrderedGains gainBounds(ExpectedValues const &expModelValues);
+  void addBatch(SelectionParameters const &param, OrderedGains const &gains,
+    FeatureWeights const &alphas, FeatureSet *selectedFeatures,
+    SelectedFeatureAlphas *selectedFeatureAlphas);
+  void optimize(FeatureSet const &selectedFeatures,
+    SelectedFeatureAlphas const &selectedFeatureAlphas);
+
+  /**
+   * The sums and normalizers of the model.
+   */
+  Sums *sums();
+  Zs *zs();
+private:
+  DataSet const *d_dataSet;
+  FeatureOccurrences const *d_occurrences;
+  Sums d_sums;
+  Zs d_zs;
+  FeatureSet d_stageFeatures;
+  std::unique_ptr<ContextActiveFeatures> d_activeFeatures;
+};
+
+/**
+ * Select features with the full selection algorithm, for the contexts of
+ * a model. The data set provides the empirical expectations and feature
+ * identifiers.
+ */
+SelectedFeatureAlphas featureSelection(DataSet const &ds, SelectionModel *model,
+    Logger logger, SelectionParameters const &param);
+
+/*
+ * The reductions of a full selection stage, for models that distribute
+ * the contexts over processes.
+ */
+
+/**
+ * Calculate the contributions of the contexts of every block of
+ * REDUCTION_BLOCK_SIZE contexts to G' and G'' of the unconverged features.
+ * The contributions are negated, like in updateGradients.
+ */
+std::vector<BlockGradients> blockGradients(DataSet const &dataSet,
+    FeatureSet const &unconvergedFeatures,
+    ContextActiveFeatures const &contextActiveFeatures,
+    Sums const &sums, Zs const &zs, FeatureWeights const &alphas);
+
+/**
+ * Subtract the contributions of the contexts of a data set to G' and G''
+ * of the unconverged features from gp and gpp. G' starts at the empirical
+ * expectation of a feature, G'' at zero.
+ */
+void updateGradients(DataSet const &dataSet,
+    FeatureSet const &unconvergedFeatures,
+    ContextActiveFeatures const &contextActiveFeatures,
+    Sums const &sums, Zs const &zs, FeatureWeights const &alphas,
+    Gp *gp, Gpp *gpp, bool deterministic);
+
+/**
+ * Estimate the number of bytes of the state of a feature selection, in
+ * addition to the dataset. The estimate is an upper bound for the
+ * structures that scale with the dataset, such as the model sums and the
+ * features that are active in each context.
+ *
+ * @ds The dataset to mine for features
+ * @param Selection parameters
+ * @fast Estimate for the fast selection algorithm
+ */
+MemoryUsage selectionMemoryUsage(DataSet const &ds,
+    SelectionParameters const &param, bool fast);
+
 }
 
 #endif // FEATURE_SELECTION_HH
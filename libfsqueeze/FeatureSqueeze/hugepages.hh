@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+/*
+ * Allocation of large flat buffers on huge pages. The selection loops
+ * index vectors of nFeatures or nContexts elements at random while they
+ * stream through the context data, so with 4KB pages most of these
+ * accesses miss the TLB.
+ */
+
+#ifndef FSQUEEZE_HUGEPAGES_HH
+#define FSQUEEZE_HUGEPAGES_HH
+
+#include <cstddef>
+#include <new>
+#include <string>
+
+namespace fsqueeze {
+
+/*
+ * Size of a (PMD-level) huge page. Buffers of at least this size are
+ * mapped separately, aligned to this size.
+ */
+size_t const HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+enum HugePagePolicy {
+	/*
+	 * Map large buffers with normal pages.
+	 */
+	HUGE_PAGES_NONE,
+
+	/*
+	 * Ask for transparent huge pages (madvise) in large buffers.
+	 */
+	HUGE_PAGES_TRANSPARENT,
+
+	/*
+	 * Map large buffers from the hugetlb pool, falling back to transparent
+	 * huge pages when the pool is exhausted.
+	 */
+	HUGE_PAGES_HUGETLB
+};
+
+struct HugePageUsage {
+	HugePageUsage() : hugetlbBytes(0), transparentBytes(0),
+		peakHugetlbBytes(0), peakTransparentBytes(0), anonHugeBytes(0),
+		sharedHugeBytes(0), hugetlbMappedBytes(0) {}
+
+	/*
+	 * Buffers of the allocator that are currently mapped from the hugetlb
+	 * pool, or advised for transparent huge pages, and their maxima.
+	 */
+	size_t hugetlbBytes;
+	size_t transparentBytes;
+	size_t peakHugetlbBytes;
+	size_t peakTransparentBytes;
+
+	/*
+	 * Memory of the process that the kernel has currently mapped with huge
+	 * pages: anonymous transparent huge pages, huge pages of shared memory
+	 * and files, and hugetlb pages. Zero if the kernel does not report it.
+	 */
+	size_t anonHugeBytes;
+	size_t sharedHugeBytes;
+	size_t hugetlbMappedBytes;
+};
+
+/**
+ * Set the huge page policy for buffers that are allocated after this call.
+ * The default policy is HUGE_PAGES_TRANSPARENT.
+ */
+void setHugePagePolicy(HugePagePolicy policy);
+
+/**
+ * Return the current huge page policy.
+ */
+HugePagePolicy hugePagePolicy();
+
+/**
+ * Parse the name of a huge page policy ('none', 'transparent', or
+ * 'hugetlb').
+ */
+HugePagePolicy parseHugePagePolicy(std::string const &policy);
+
+/**
+ * Allocate a buffer. Buffers of at least HUGE_PAGE_SIZE bytes are mapped
+ * separately according to the huge page policy, smaller buffers come from
+ * the heap. Throws std::bad_alloc if the buffer cannot be allocated.
+ */
+void *allocateHugePages(size_t bytes);
+
+/**
+ * Free a buffer of the given size that was allocated with
+ * allocateHugePages.
+ */
+void deallocateHugePages(void *data, size_t bytes);
+
+/**
+ * Ask for transparent huge pages in the huge-page-aligned part of an
+ * existing mapping or heap buffer, unless the policy is HUGE_PAGES_NONE.
+ * Only pages that are touched after this call are affected, and the
+ * advice is ignored if the kernel does not support it.
+ */
+void adviseHugePages(void const *data, size_t bytes);
+
+/**
+ * Return the huge page usage of the allocator and the process.
+ */
+HugePageUsage hugePageUsage();
+
+/**
+ * Allocator for standard containers that uses allocateHugePages.
+ */
+template <typename T>
+class HugePageAllocator
+{
+public:
+	typedef T value_type;
+
+	HugePageAllocator() {}
+	template <typename U>
+	HugePageAllocator(HugePageAllocator<U> const &) {}
+
+	T *allocate(size_t n);
+	void deallocate(T *data, size_t n);
+};
+
+template <typename T>
+inline T *HugePageAllocator<T>::allocate(size_t n)
+{
+	if (n > static_cast<size_t>(-1) / sizeof(T))
+		throw std::bad_alloc();
+
+	return static_cast<T *>(allocateHugePages(n * sizeof(T)));
+}
+
+template <typename T>
+inline void HugePageAllocator<T>::deallocate(T *data, size_t n)
+{
+	deallocateHugePages(data, n * sizeof(T));
+}
+
+template <typename T, typename U>
+inline bool operator==(HugePageAllocator<T> const &, HugePageAllocator<U> const &)
+{
+	return true;
+}
+
+template <typename T, typename U>
+inline bool operator!=(HugePageAllocator<T> const &, HugePageAllocator<U> const &)
+{
+	return false;
+}
+
+/**
+ * Return a zero vector of the given size, of which the storage is advised
+ * for huge pages before it is touched. Eigen vectors take their storage
+ * from the heap, so they cannot use HugePageAllocator.
+ */
+template <typename Vector>
+Vector hugePageZero(size_t size)
+{
+	Vector vec(size);
+	adviseHugePages(vec.data(), size * sizeof(typename Vector::Scalar));
+	vec.setZero();
+	return vec;
+}
+
+/**
+ * Return a copy of a vector, of which the storage is advised for huge
+ * pages before it is touched.
+ */
+template <typename Vector>
+Vector hugePageCopy(Vector const &other)
+{
+	Vector vec(other.size());
+	adviseHugePages(vec.data(),
+		other.size() * sizeof(typename Vector::Scalar));
+	vec = other;
+	return vec;
+}
+
+}
+
+#endif // FSQUEEZE_HUGEPAGES_HH
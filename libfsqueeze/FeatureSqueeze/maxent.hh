@@ -20,28 +20,53 @@
 #ifndef FSQUEEZE_MAXENT_HH
 #define FSQUEEZE_MAXENT_HH
 
+#include <cstdint>
+#include <limits>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
-#include <tr1/unordered_set>
-#include <tr1/unordered_map>
-
 #include <Eigen/Core>
 
 #include "DataSet.hh"
+#include "ValueDictionary.hh"
+#include "hugepages.hh"
+#include "reduction.hh"
 #include "selection.hh"
 #include "util.hh"
 
 namespace fsqueeze
 {
 
+class ShardCursor;
+
 typedef Eigen::VectorXd FeatureWeights;
 typedef Eigen::VectorXd ExpectedValues;
-typedef Eigen::VectorXd Sum;
-typedef std::vector<Sum> Sums;
+typedef Eigen::Matrix<StorageScalar, Eigen::Dynamic, 1> SumVector;
+typedef Eigen::Map<SumVector> Sum;
 typedef Eigen::VectorXd Zs;
-typedef std::tr1::unordered_set<size_t> FeatureSet;
+typedef std::unordered_set<size_t> FeatureSet;
+
+/*
+ * Largest number of events of a context for which the per-context kernels
+ * keep their temporaries on the stack.
+ */
+int const SMALL_CONTEXT_SIZE = 16;
+
+/*
+ * Per-event temporaries of a context with at most MaxEvents events. The
+ * storage is allocated on the stack, unless MaxEvents is Eigen::Dynamic.
+ */
+template <typename Scalar, int MaxEvents>
+using EventVector = Eigen::Matrix<Scalar, Eigen::Dynamic, 1, Eigen::ColMajor,
+	MaxEvents, 1>;
+
+/*
+ * exp(alpha) of indicator features, indexed by feature.
+ */
+typedef std::vector<double, HugePageAllocator<double> > IndicatorFactors;
 
 /*
  * Function object for gain-based orderering (highest gain first).
@@ -49,17 +74,215 @@ typedef std::tr1::unordered_set<size_t> FeatureSet;
 typedef PairReverseLess<double> GainLess;
 
 typedef std::set<std::pair<size_t, double>, GainLess> OrderedGains;
-typedef std::tr1::unordered_map<size_t, double> GainMap;
+typedef std::unordered_map<size_t, double> GainMap;
+
+/*
+ * The sums of the events of a context are only defined up to a common
+ * factor, since p(y|x) = sum(y) / Z(x). The sums of a context are rescaled
+ * when Z(x) leaves [MIN_Z, MAX_Z], so that they can neither overflow nor
+ * underflow. Rescaling uses powers of two, which does not change p(y|x).
+ * The bounds are tighter when sums are stored in single precision.
+ */
+#ifdef FSQUEEZE_FLOAT_STORAGE
+double const MIN_Z = 2.3283064365386963e-10; // 2^-32
+double const MAX_Z = 4294967296.0; // 2^32
+#else
+double const MIN_Z = 8.636168555094445e-78; // 2^-256
+double const MAX_Z = 1.157920892373162e+77; // 2^256
+#endif
+
+/*
+ * Largest |alpha * f| for which the sums of a context are updated by
+ * multiplication. Larger updates are applied in the log domain.
+ */
+#ifdef FSQUEEZE_FLOAT_STORAGE
+double const MAX_LOG_FACTOR = 32.0;
+#else
+double const MAX_LOG_FACTOR = 128.0;
+#endif
+
+/*
+ * Largest log-sum that is exponentiated without shifting the log-sums of
+ * a context (2^64 or 2^512).
+ */
+#ifdef FSQUEEZE_FLOAT_STORAGE
+double const MAX_LOG_SUM = 44.0;
+#else
+double const MAX_LOG_SUM = 354.0;
+#endif
+
+/*
+ * Smallest change of a feature weight that is distinguishable from the
+ * rounding error of the model sums. Weights are considered to be converged
+ * below this threshold, even if a smaller threshold is requested.
+ */
+#ifdef FSQUEEZE_FLOAT_STORAGE
+double const MIN_ALPHA_THRESHOLD = 1e-6;
+#else
+double const MIN_ALPHA_THRESHOLD = 0.0;
+#endif
+
+/*
+ * Smallest G' of a feature, relative to its empirical expectation, that is
+ * distinguishable from the rounding error of the model sums. Weights with
+ * a smaller G' are converged. Without this bound, the weight of a feature
+ * that separates the events of contexts grows with every Newton step.
+ */
+#ifdef FSQUEEZE_FLOAT_STORAGE
+double const MIN_RELATIVE_GRADIENT = 1e-6;
+#else
+double const MIN_RELATIVE_GRADIENT = 1e-13;
+#endif
+
+/*
+ * Event indices with alpha * f values.
+ */
+typedef std::vector<std::pair<size_t, double> > LogFactors;
+
+/*
+ * A non-zero value of a feature in an event of a context. If the data set
+ * has a value dictionary, valueIndex is the index of the value in the
+ * dictionary.
+ */
+struct FeatureOccurrence
+{
+	size_t context;
+	StorageScalar value;
+	unsigned int event;
+	unsigned char valueIndex;
+};
+
+/*
+ * The occurrences of all features, ordered by feature, context and event.
+ * The occurrences of an out-of-core data set are read from its shard file.
+ */
+class FeatureOccurrences
+{
+public:
+	/*
+	 * Construct the occurrence lists of all features in a data set.
+	 */
+	FeatureOccurrences(DataSet const &dataSet);
+
+	FeatureOccurrences(FeatureOccurrences const &other) = delete;
+
+	FeatureOccurrences &operator=(FeatureOccurrences const &other) = delete;
+
+	/*
+	 * The first occurrence of a feature.
+	 */
+	FeatureOccurrence const *begin(size_t feature) const;
+
+	/*
+	 * One past the last occurrence of a feature.
+	 */
+	FeatureOccurrence const *end(size_t feature) const;
+private:
+	std::vector<FeatureOccurrence, HugePageAllocator<FeatureOccurrence> >
+		d_occurrences;
+	std::vector<uint64_t, HugePageAllocator<uint64_t> > d_offsets;
+	FeatureOccurrence const *d_data;
+	uint64_t const *d_dataOffsets;
+};
+
+/*
+ * The unnormalized event probabilities of the model, per context. The sums
+ * of all contexts are stored consecutively in one buffer, which is placed
+ * on huge pages like other large buffers (see allocateHugePages), rather
+ * than in a small heap allocation per context.
+ */
+class Sums
+{
+public:
+	Sums();
+
+	/*
+	 * Allocate storage for nEvents event sums. The storage is not touched,
+	 * so that the pages of a context's sums are placed by the thread that
+	 * first writes them.
+	 */
+	explicit Sums(size_t nEvents);
+
+	Sums(Sums const &other);
+
+	Sums(Sums &&other) noexcept;
+
+	~Sums();
+
+	Sums &operator=(Sums const &other);
+
+	Sums &operator=(Sums &&other) noexcept;
+
+	/*
+	 * Map the sums of the next context, which has nEvents events, to the
+	 * storage after the sums of the previous context. Throws a logic_error
+	 * if the storage is exhausted.
+	 */
+	void addContext(size_t nEvents);
+
+	Sum &operator[](size_t context);
+
+	Sum const &operator[](size_t context) const;
+
+	size_t size() const;
+private:
+	void swap(Sums &other);
+
+	StorageScalar *d_data;
+	size_t d_capacity;
+	size_t d_nEvents;
+	std::vector<Sum> d_sums;
+};
+
+/*
+ * The candidate features that are active in each context: features that
+ * are not excluded, with a non-zero value in an event that has a non-zero
+ * probability. The active features of a data set in memory are determined
+ * once, for the model at construction. The active features of an
+ * out-of-core shard are determined when the shard is visited, for the
+ * model at that time, so that they are not kept in memory.
+ */
+class ContextActiveFeatures
+{
+public:
+	ContextActiveFeatures(DataSet const &dataSet,
+		FeatureSet const &excludedFeatures, Sums const &sums, Zs const &zs);
+
+	/*
+	 * The active features of all contexts. Only available for data sets
+	 * in memory.
+	 */
+	std::vector<FeatureSet> const &contexts() const;
+
+	DataSet const &dataSet() const;
+
+	/*
+	 * The active features of the contexts of the current shard of a
+	 * cursor, indexed by the context within the shard. The active features
+	 * of an out-of-core shard are stored in buffer.
+	 */
+	std::vector<FeatureSet> const &shard(ShardCursor const &cursor,
+		std::vector<FeatureSet> *buffer) const;
+private:
+	void determine(ContextVector const &contexts, size_t offset,
+		NonZeroOffsets const &nonZeros, std::vector<FeatureSet> *active) const;
+
+	DataSet const *d_dataSet;
+	FeatureSet d_excludedFeatures;
+	Sums const *d_sums;
+	Zs const *d_zs;
+	std::vector<FeatureSet> d_contexts;
+};
 
 struct makeSumVector
 {
-	Sum operator()(Context const &context) const;
+	SumVector operator()(Context const &context) const;
 };
 
 /*
  * Find features that are active in at least one context.
  */
-FeatureSet activeFeatures(std::vector<FeatureSet> const &contextActiveFeatures);
+FeatureSet activeFeatures(ContextActiveFeatures const &contextActiveFeatures);
 
 /**
  * Adjust a model's sums and zs by assigning the weight alpha to feature. Here
@@ -71,38 +294,132 @@ void adjustModel(DataSet const &dataSet, size_t feature, double alpha,
 void adjustModelFull(DataSet const &dataSet, FeatureSet const &featureSet,
 	Eigen::VectorXd const &lambdas, Sums *sums, Zs *zs);
 
+/**
+ * Multiply the sums of events of a context by exp(alpha * f), in the log
+ * domain. The sums are shifted, such that the largest sum is one.
+ */
+void adjustContextLog(LogFactors const &logFactors, Sum *ctxSums, double *z);
+
+/**
+ * Restore the range of the sums of a context after an update that changed
+ * Z(x) from oldZ to z. Z(x) is recomputed if it shrunk so much that the
+ * rounding errors of the incremental update could dominate.
+ */
+void normalizeContext(double oldZ, Sum *ctxSums, double *z);
+
+/**
+ * Returns true if Z(x) = newZ of a trial weight, as updated incrementally
+ * from z by zf, can be used by the gain and gradient kernels: the updated
+ * sums of events fit in the storage type, and newZ did not shrink to the
+ * rounding error of the update (see normalizeContext).
+ */
+inline bool regularZ(double newZ, double z)
+{
+	return newZ > z * 1e-8 &&
+		newZ <= std::numeric_limits<StorageScalar>::max();
+}
+
+/**
+ * Collect the log factors alpha * f of the events of a context in which a
+ * feature has a non-zero value.
+ */
+void featureLogFactors(FeatureValues const &featureValues, size_t feature,
+	double alpha, LogFactors *logFactors);
+
+/**
+ * Calculate log(Z'(x) / Z(x)) of a context whose sums of events would be
+ * multiplied by exp(alpha * f), in the log domain. The log-sums are shifted
+ * like in adjustContextLog, so that trial weights for which exp(alpha * f)
+ * overflows give finite gains. If probs is not null, it receives p(y|x)
+ * for the multiplied sums.
+ */
+double shiftedLogZRatio(LogFactors const &logFactors, Sum const &ctxSums,
+	double z, Eigen::VectorXd *probs);
+
 /*
  * Calculate the gain of a model after changing a feature weight from zero
- * to non-zero.
+ * to non-zero. If deterministic is true, the gain is reduced in a fixed
+ * order, so that it does not depend on the number of threads.
  */
 double calcGain(DataSet const &dataSet, Sums const &sums, Zs const &zs,
-	size_t feature, double alpha);
+	size_t feature, double alpha, bool deterministic = false);
 
 /*
  * Calculate the model gains after changing for a set of features and their
- * weights.
+ * weights. If deterministic is true, the gains are reduced per block of
+ * REDUCTION_BLOCK_SIZE contexts (see blockGainSums).
  */
 OrderedGains calcGains(DataSet const &dataSet,
-	std::vector<FeatureSet> const &contextActiveFeatures,
+	ContextActiveFeatures const &contextActiveFeatures,
 	Sums const &sums, Zs const &zs,
-	FeatureWeights const &alphas);
+	FeatureWeights const &alphas, bool deterministic = false);
+
+/*
+ * Calculate the model gains for the given subset of the features.
+ */
+OrderedGains calcGains(DataSet const &dataSet,
+	ContextActiveFeatures const &contextActiveFeatures,
+	Sums const &sums, Zs const &zs,
+	FeatureWeights const &alphas, FeatureSet const &features,
+	bool deterministic = false);
+
+/*
+ * Sum the gains of the active features over the contexts of a data set,
+ * without the alpha * E~[f] term of the gain. The sums of the data sets
+ * of the workers of a multi-process selection add up to the sums of the
+ * whole data set.
+ */
+GainMap gainSums(DataSet const &dataSet,
+	ContextActiveFeatures const &contextActiveFeatures,
+	Sums const &sums, Zs const &zs,
+	FeatureWeights const &alphas, bool deterministic = false);
+
+/*
+ * Sum the gains of the given subset of the features.
+ */
+GainMap gainSums(DataSet const &dataSet,
+	ContextActiveFeatures const &contextActiveFeatures,
+	Sums const &sums, Zs const &zs,
+	FeatureWeights const &alphas, FeatureSet const &features,
+	bool deterministic = false);
 
 /*
- * Determine active features per context.
+ * Sum the gains of the active features like gainSums, per block of
+ * REDUCTION_BLOCK_SIZE contexts. If features is not null, only the given
+ * features are summed.
  */
-std::vector<FeatureSet> contextActiveFeatures(DataSet const &dataSet,
-	FeatureSet const &excludedFeatures, Sums const &sums, Zs const &zs);
+std::vector<BlockVectorSums> blockGainSums(DataSet const &dataSet,
+	ContextActiveFeatures const &contextActiveFeatures,
+	Sums const &sums, Zs const &zs,
+	FeatureWeights const &alphas, FeatureSet const *features);
+
+/*
+ * Calculate an upper bound on the gain of each active feature, for any
+ * weight. The bound is cheaper to compute than the weight itself.
+ */
+OrderedGains gainBounds(DataSet const &dataSet,
+	ContextActiveFeatures const &contextActiveFeatures,
+	ExpectedValues const &expModelValues, Sums const &sums, Zs const &zs);
 
 /**
  * Calculate the expected value of each feature in a data set.
  */
-ExpectedValues expFeatureValues(DsFeatureMap const &features, int nFeatures);
+ExpectedValues expFeatureValues(ContextVector const &contexts, int nFeatures);
 
 /**
  * Calculate the expected value of each feature according to the model represented
- * by zs and sums.
+ * by zs and sums. If deterministic is true, the contributions are reduced
+ * per block of REDUCTION_BLOCK_SIZE contexts, independent of the number of
+ * threads. Otherwise, they are summed in context order.
  */
 ExpectedValues expModelFeatureValues(DataSet const &dataSet,
+	Sums const &sums, Zs const &zs, bool deterministic = false);
+
+/**
+ * Calculate the contributions of every block of REDUCTION_BLOCK_SIZE
+ * contexts to the model expectations, as reduced by expModelFeatureValues.
+ */
+std::vector<BlockVectorSums> expModelBlockSums(DataSet const &dataSet,
 	Sums const &sums, Zs const &zs);
 
 /**
@@ -134,9 +451,115 @@ inline double p_yx(double sum, double z)
 double zf(FeatureValues const &featureValues, Sum const &ctxSums, double z,
 	size_t feature, double alpha);
 
-inline Sum makeSumVector::operator()(Context const &context) const
+/*
+ * Calculate an updated Z(x) value, where factor(f) gives exp(alpha * f).
+ */
+template <typename Factor>
+double zf(FeatureValues const &featureValues, Sum const &ctxSums, double z,
+	size_t feature, Factor const &factor);
+
+/*
+ * Calculate an updated Z(x) value. If the feature is an indicator feature,
+ * factor points to exp(alpha), otherwise it is null.
+ */
+double zf(FeatureValues const &featureValues, Sum const &ctxSums, double z,
+	size_t feature, double alpha, double const *factor);
+
+/*
+ * Calculate log(Z'(x) / Z(x)) after changing the weight of a feature from
+ * zero to alpha. If the feature is an indicator feature, factor points to
+ * exp(alpha), otherwise it is null.
+ */
+double logZRatio(FeatureValues const &featureValues, Sum const &ctxSums,
+	double z, size_t feature, double alpha, double const *factor);
+
+/*
+ * Calculate exp(alpha) for the given features, if the features of the data
+ * set are indicators. Otherwise, the vector is empty.
+ */
+IndicatorFactors indicatorFactors(DataSet const &dataSet,
+	FeatureWeights const &alphas, FeatureSet const &features);
+
+/*
+ * Calculate exp(alpha) for all features, if the features of the data set
+ * are indicators. Otherwise, the vector is empty.
+ */
+IndicatorFactors indicatorFactors(DataSet const &dataSet,
+	FeatureWeights const &alphas);
+
+/*
+ * Return a pointer to exp(alpha) of a feature, or null if the factors are
+ * empty.
+ */
+double const *indicatorFactor(IndicatorFactors const &factors, size_t feature);
+
+template <typename Factor>
+double zf(FeatureValues const &featureValues, Sum const &ctxSums, double z,
+	size_t feature, Factor const &factor)
+{
+	for (int i = 0; i < featureValues.outerSize(); ++i)
+	{
+		double fVal = featureValues.coeff(i, feature);
+		if (fVal != 0.0)
+			z = z - ctxSums[i] + ctxSums[i] * factor(fVal);
+	}
+	
+	return z;
+}
+
+inline double zf(FeatureValues const &featureValues, Sum const &ctxSums,
+	double z, size_t feature, double alpha, double const *factor)
+{
+	if (factor != 0)
+		return zf(featureValues, ctxSums, z, feature, IndicatorFactor(factor));
+	else
+		return zf(featureValues, ctxSums, z, feature, ExpFactor(alpha));
+}
+
+inline FeatureOccurrence const *FeatureOccurrences::begin(size_t feature) const
+{
+	return d_data + d_dataOffsets[feature];
+}
+
+inline FeatureOccurrence const *FeatureOccurrences::end(size_t feature) const
+{
+	return d_data + d_dataOffsets[feature + 1];
+}
+
+inline std::vector<FeatureSet> const &ContextActiveFeatures::contexts() const
+{
+	return d_contexts;
+}
+
+inline DataSet const &ContextActiveFeatures::dataSet() const
+{
+	return *d_dataSet;
+}
+
+inline double const *indicatorFactor(IndicatorFactors const &factors,
+	size_t feature)
+{
+	return factors.empty() ? 0 : &factors[feature];
+}
+
+inline Sum &Sums::operator[](size_t context)
+{
+	return d_sums[context];
+}
+
+inline Sum const &Sums::operator[](size_t context) const
+{
+	return d_sums[context];
+}
+
+inline size_t Sums::size() const
+{
+	return d_sums.size();
+}
+
+inline SumVector makeSumVector::operator()(Context const &context) const
 {
-	return Sum::Ones(context.eventProbs().size());
+	return context.eventCounts().cast<StorageScalar>();
 }
 
 }
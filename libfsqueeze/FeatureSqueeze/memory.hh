@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+
+/*
+ * Accounting of the memory that data structures use.
+ */
+
+#ifndef FSQUEEZE_MEMORY_HH
+#define FSQUEEZE_MEMORY_HH
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fsqueeze {
+
+/*
+ * Bytes used per structure, in the order in which structures are added.
+ */
+typedef std::vector<std::pair<std::string, size_t> > MemoryUsage;
+
+/*
+ * Estimated bytes per element of node-based containers, including the
+ * allocator overhead and, for hash tables, the bucket pointer.
+ */
+size_t const HASH_NODE_BYTES = 5 * sizeof(void *);
+size_t const TREE_NODE_BYTES = 8 * sizeof(void *);
+
+/*
+ * Estimated bytes of the storage header of a row of a sparse matrix.
+ */
+size_t const SPARSE_ROW_BYTES = 4 * sizeof(void *);
+
+/**
+ * Add bytes to the structure with the given name.
+ */
+void addMemory(MemoryUsage *usage, std::string const &name, size_t bytes);
+
+/**
+ * Add the structures of other, multiplied by factor, to usage.
+ */
+void addMemoryUsage(MemoryUsage *usage, MemoryUsage const &other,
+	size_t factor = 1);
+
+/**
+ * Return the total number of bytes.
+ */
+size_t memoryTotal(MemoryUsage const &usage);
+
+inline void addMemory(MemoryUsage *usage, std::string const &name,
+	size_t bytes)
+{
+	for (MemoryUsage::iterator iter = usage->begin(); iter != usage->end();
+			++iter)
+		if (iter->first == name)
+		{
+			iter->second += bytes;
+			return;
+		}
+	
+	usage->push_back(std::make_pair(name, bytes));
+}
+
+inline void addMemoryUsage(MemoryUsage *usage, MemoryUsage const &other,
+	size_t factor)
+{
+	for (MemoryUsage::const_iterator iter = other.begin(); iter != other.end();
+			++iter)
+		addMemory(usage, iter->first, iter->second * factor);
+}
+
+inline size_t memoryTotal(MemoryUsage const &usage)
+{
+	size_t total = 0;
+	for (MemoryUsage::const_iterator iter = usage.begin(); iter != usage.end();
+			++iter)
+		total += iter->second;
+	
+	return total;
+}
+
+}
+
+#endif // FSQUEEZE_MEMORY_HH
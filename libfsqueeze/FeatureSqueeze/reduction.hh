@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+/*
+ * Reproducible parallel reductions. Contexts are divided in blocks of a
+ * fixed size. Each block is reduced sequentially, and the partial results
+ * of blocks are combined in block order. Since the partitioning does not
+ * depend on the number of threads, the result of a reduction is the same
+ * for every run and every thread count.
+ */
+
+#ifndef FSQUEEZE_REDUCTION_HH
+#define FSQUEEZE_REDUCTION_HH
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace fsqueeze {
+
+size_t const REDUCTION_BLOCK_SIZE = 64;
+
+/**
+ * The number of reduction blocks for n elements.
+ */
+inline size_t reductionBlocks(size_t n)
+{
+	return (n + REDUCTION_BLOCK_SIZE - 1) / REDUCTION_BLOCK_SIZE;
+}
+
+/**
+ * The first element of a reduction block.
+ */
+inline size_t reductionBlockBegin(size_t block)
+{
+	return block * REDUCTION_BLOCK_SIZE;
+}
+
+/**
+ * One past the last element of a reduction block.
+ */
+inline size_t reductionBlockEnd(size_t block, size_t n)
+{
+	size_t end = (block + 1) * REDUCTION_BLOCK_SIZE;
+	return end < n ? end : n;
+}
+
+/**
+ * Sum the partial results of blocks in block order.
+ */
+inline double sumBlocks(std::vector<double> const &blockSums)
+{
+	double sum = 0.0;
+	for (std::vector<double>::const_iterator iter = blockSums.begin();
+			iter != blockSums.end(); ++iter)
+		sum += *iter;
+	
+	return sum;
+}
+
+/**
+ * The partial sums of a block for a vector that is indexed by feature.
+ * Only the indices that the block contributes to are stored.
+ */
+typedef std::vector<std::pair<size_t, double> > BlockVectorSums;
+
+/**
+ * Accumulates the contributions of the contexts of a block to a vector.
+ * The contributions to an index are added in the order in which they were
+ * made, so the partial sums of a block do not depend on the thread that
+ * reduces it. Every thread uses its own accumulator.
+ */
+class BlockAccumulator
+{
+public:
+	/**
+	 * Construct an accumulator for a vector of size n.
+	 */
+	BlockAccumulator(size_t n);
+
+	/**
+	 * Add value to the element index.
+	 */
+	void add(size_t index, double value);
+
+	/**
+	 * Drop the partial sums of the current block, start a new block, and
+	 * grow the accumulator to a vector of at least size n.
+	 */
+	void reset(size_t n);
+
+	/**
+	 * Move the partial sums of the current block to sums, and start a new
+	 * block.
+	 */
+	void finish(BlockVectorSums *sums);
+private:
+	// The block that last added to an index, from 1.
+	size_t d_block;
+	std::vector<size_t> d_blocks;
+	std::vector<double> d_sums;
+	std::vector<size_t> d_indices;
+};
+
+inline BlockAccumulator::BlockAccumulator(size_t n)
+	: d_block(1), d_blocks(n, 0), d_sums(n, 0.0)
+{
+}
+
+inline void BlockAccumulator::add(size_t index, double value)
+{
+	if (d_blocks[index] != d_block)
+	{
+		d_blocks[index] = d_block;
+		d_indices.push_back(index);
+	}
+
+	d_sums[index] += value;
+}
+
+inline void BlockAccumulator::reset(size_t n)
+{
+	for (std::vector<size_t>::const_iterator iter = d_indices.begin();
+			iter != d_indices.end(); ++iter)
+		d_sums[*iter] = 0.0;
+
+	d_indices.clear();
+	++d_block;
+
+	if (d_sums.size() < n)
+	{
+		d_blocks.resize(n, 0);
+		d_sums.resize(n, 0.0);
+	}
+}
+
+inline void BlockAccumulator::finish(BlockVectorSums *sums)
+{
+	sums->clear();
+	sums->reserve(d_indices.size());
+	for (std::vector<size_t>::const_iterator iter = d_indices.begin();
+			iter != d_indices.end(); ++iter)
+	{
+		sums->push_back(std::make_pair(*iter, d_sums[*iter]));
+		d_sums[*iter] = 0.0;
+	}
+
+	d_indices.clear();
+	++d_block;
+}
+
+/**
+ * Return the accumulator of the calling thread, reset for a vector of size
+ * n. The accumulator is kept between calls, so that the reductions of
+ * every selection step do not allocate two vectors over all features per
+ * thread.
+ */
+inline BlockAccumulator &threadBlockAccumulator(size_t n)
+{
+	static thread_local BlockAccumulator accumulator(0);
+	accumulator.reset(n);
+	return accumulator;
+}
+
+/**
+ * Add the partial sums of a block to a vector. Blocks should be added in
+ * block order.
+ */
+template <typename Vector>
+void addBlockSums(BlockVectorSums const &sums, Vector *vec)
+{
+	for (BlockVectorSums::const_iterator iter = sums.begin();
+			iter != sums.end(); ++iter)
+		(*vec)[iter->first] += iter->second;
+}
+
+}
+
+#endif // FSQUEEZE_REDUCTION_HH
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+/*
+ * Scheduling of parallel loops over contexts. Context sizes vary by orders
+ * of magnitude, so dividing a loop by context index can leave most threads
+ * waiting for the one that got the largest contexts. Instead, the contexts
+ * of a shard are divided into chunks with about the same number of non-zero
+ * feature values. Every thread starts with a contiguous range of chunks,
+ * which it processes front to back. A thread that finishes its range steals
+ * chunks from the back of the ranges of other threads.
+ *
+ * Scheduled loops look like this:
+ *
+ *   ContextScheduler scheduler(shard);
+ *   #pragma omp parallel
+ *   {
+ *     ContextRange range;
+ *     while (scheduler.next(&range))
+ *       for (size_t k = range.begin; k < range.end; ++k)
+ *         // Context k of the shard.
+ *   }
+ */
+
+#ifndef FSQUEEZE_SCHEDULER_HH
+#define FSQUEEZE_SCHEDULER_HH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "DataSet.hh"
+
+namespace fsqueeze {
+
+class ShardCursor;
+
+/*
+ * Chunks per thread. More chunks give stealing threads more to take, at
+ * the cost of more scheduling.
+ */
+size_t const CHUNKS_PER_THREAD = 8;
+
+struct ContextRange {
+	size_t begin;
+	size_t end;
+};
+
+/**
+ * The time in seconds that each thread spent on scheduled chunks, indexed
+ * by thread number. Every job keeps its own busy times, so that concurrent
+ * jobs do not mix their times (see BusyTimesScope).
+ */
+class BusyTimes
+{
+public:
+	/**
+	 * Add the busy time of a thread.
+	 */
+	void add(size_t thread, double busy);
+
+	/**
+	 * Return the busy times of all threads.
+	 */
+	std::vector<double> times() const;
+private:
+	mutable std::mutex d_mutex;
+	std::vector<double> d_times;
+};
+
+/**
+ * Collect the busy times of the schedulers that the calling thread
+ * constructs in busyTimes, until the scope ends. Schedulers that are
+ * constructed outside of any scope do not record their busy times.
+ */
+class BusyTimesScope
+{
+public:
+	explicit BusyTimesScope(BusyTimes *busyTimes);
+
+	~BusyTimesScope();
+
+	BusyTimesScope(BusyTimesScope const &other) = delete;
+
+	BusyTimesScope &operator=(BusyTimesScope const &other) = delete;
+private:
+	BusyTimes *d_previous;
+};
+
+/**
+ * Return the busy times of the innermost scope of the calling thread, or
+ * a null pointer outside of any scope.
+ */
+BusyTimes *currentBusyTimes();
+
+/**
+ * Set offsets to the running count of non-zero feature values of the
+ * contexts: offsets[k] is the number of non-zeros in contexts 0..k-1, and
+ * offsets[contexts.size()] the total.
+ */
+void countNonZeros(ContextVector const &contexts, NonZeroOffsets *offsets);
+
+class ContextScheduler
+{
+public:
+	/**
+	 * Schedule the contexts of the current shard of a cursor. Chunks
+	 * consist of whole blocks of granularity contexts, loops with
+	 * reproducible reductions should use REDUCTION_BLOCK_SIZE.
+	 */
+	ContextScheduler(ShardCursor const &shard, size_t granularity = 1);
+
+	/**
+	 * Schedule contexts with the given running non-zero counts (see
+	 * countNonZeros). Other items can be scheduled by their running
+	 * costs in the same way, such as features by their occurrences.
+	 */
+	ContextScheduler(NonZeroOffsets const &offsets, size_t granularity = 1);
+
+	/**
+	 * Add the busy times of the threads to the busy times of the scope
+	 * in which the scheduler was constructed.
+	 */
+	~ContextScheduler();
+
+	ContextScheduler(ContextScheduler const &other) = delete;
+
+	ContextScheduler &operator=(ContextScheduler const &other) = delete;
+
+	/**
+	 * Get the next range of contexts for the calling thread, from within
+	 * a parallel region. Returns false when no contexts are left.
+	 */
+	bool next(ContextRange *range);
+private:
+	// Chunks [begin, end) of a thread, packed as begin | end << 32, so that
+	// the owner and thieves can take chunks with a single compare-and-swap.
+	// Padded to a cache line, since every thread updates its own state.
+	struct ThreadState {
+		ThreadState() : chunks(0), busy(0.0), start(-1.0) {}
+		std::atomic<uint64_t> chunks;
+		double busy;
+		double start;
+		char padding[64 - sizeof(std::atomic<uint64_t>) - 2 * sizeof(double)];
+	};
+
+	void partition(NonZeroOffsets const &offsets, size_t granularity);
+	bool take(size_t thread, size_t *chunk);
+	bool steal(size_t thread, size_t *chunk);
+
+	std::vector<size_t> d_chunkBegins;
+	size_t d_nThreads;
+	std::unique_ptr<ThreadState[]> d_threads;
+	BusyTimes *d_busyTimes;
+};
+
+}
+
+#endif // FSQUEEZE_SCHEDULER_HH
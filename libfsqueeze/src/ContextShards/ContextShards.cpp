@@ -0,0 +1,924 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+#include "ContextShards.ih"
+
+// Layout of a shard file:
+//
+// - A ShardFileHeader.
+// - The context records of all shards, in context order.
+// - The shard index: a ShardEntry per shard, and an entry that marks the
+//   end of the last shard.
+// - The probability of each context (double).
+// - The identifier of each feature (uint64_t).
+// - The expected value of each feature (double).
+// - The offset of the occurrence list of each feature, followed by the
+//   total number of occurrences (uint64_t).
+// - The occurrence lists (FeatureOccurrence), ordered by feature.
+//
+// All sections and records start at a multiple of eight bytes.
+
+namespace {
+
+char const SHARD_MAGIC[8] = {'F', 'S', 'Q', 'S', 'H', 'A', 'R', 'D'};
+uint32_t const SHARD_VERSION = 1;
+
+struct ShardFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t scalarSize;
+	uint64_t nContexts;
+	uint64_t nEvents;
+	uint64_t nNonZeros;
+	uint64_t nFeatures;
+	uint64_t nFeatureIds;
+	uint64_t nShards;
+	uint64_t dictionarySize;
+	double dictionary[ValueDictionary::MAX_SIZE];
+
+	// File offsets of the sections.
+	uint64_t shardIndex;
+	uint64_t contextProbs;
+	uint64_t featureIds;
+	uint64_t expFeatureValues;
+	uint64_t occurrenceOffsets;
+	uint64_t occurrences;
+	uint64_t size;
+};
+
+struct ShardEntry
+{
+	uint64_t offset;
+	uint64_t begin;
+	uint64_t nEvents;
+	uint64_t nNonZeros;
+};
+
+// A context record starts with this header, followed by the event
+// probabilities and counts (double), the non-zero feature values
+// (StorageScalar), the number of values of each event (uint32_t) and the
+// feature of each value (int32_t).
+struct ContextRecord
+{
+	uint32_t nEvents;
+	uint32_t nNonZeros;
+	double prob;
+};
+
+inline size_t align8(size_t n)
+{
+	return (n + 7) & ~static_cast<size_t>(7);
+}
+
+// The arrays of a context record.
+class RecordView
+{
+public:
+	RecordView(char const *record);
+	ContextRecord const *header;
+	double const *eventProbs;
+	double const *eventCounts;
+	StorageScalar const *values;
+	uint32_t const *eventSizes;
+	int32_t const *features;
+	size_t size;
+};
+
+RecordView::RecordView(char const *record)
+	: header(reinterpret_cast<ContextRecord const *>(record))
+{
+	size_t nEvents = header->nEvents;
+	size_t nNonZeros = header->nNonZeros;
+
+	char const *data = record + sizeof(ContextRecord);
+	eventProbs = reinterpret_cast<double const *>(data);
+	data += nEvents * sizeof(double);
+	eventCounts = reinterpret_cast<double const *>(data);
+	data += nEvents * sizeof(double);
+	values = reinterpret_cast<StorageScalar const *>(data);
+	data += nNonZeros * sizeof(StorageScalar);
+	eventSizes = reinterpret_cast<uint32_t const *>(data);
+	data += nEvents * sizeof(uint32_t);
+	features = reinterpret_cast<int32_t const *>(data);
+	data += nNonZeros * sizeof(int32_t);
+
+	size = align8(data - record);
+}
+
+ShardFileHeader const &fileHeader(char const *data)
+{
+	return *reinterpret_cast<ShardFileHeader const *>(data);
+}
+
+ShardEntry const *shardIndex(char const *data)
+{
+	return reinterpret_cast<ShardEntry const *>(data +
+		fileHeader(data).shardIndex);
+}
+
+Context readContext(char const *data, int nFeatures)
+{
+	RecordView record(data);
+	size_t nEvents = record.header->nEvents;
+
+	EventProbs eventProbs(nEvents);
+	EventCounts eventCounts(nEvents);
+	FeatureValues featureVals(nEvents, nFeatures);
+	featureVals.reserve(record.header->nNonZeros);
+
+	// The features of an event are stored in increasing order, so every
+	// insertion appends to the event.
+	size_t k = 0;
+	for (size_t j = 0; j < nEvents; ++j)
+	{
+		eventProbs[j] = record.eventProbs[j];
+		eventCounts[j] = record.eventCounts[j];
+
+		for (size_t l = 0; l < record.eventSizes[j]; ++l, ++k)
+			featureVals.insert(j, record.features[k]) = record.values[k];
+	}
+
+	Context context(record.header->prob, std::move(eventProbs),
+		std::move(featureVals));
+	context.eventCounts(std::move(eventCounts));
+
+	return context;
+}
+
+}
+
+ContextShards::ContextShards(string const &path) : d_data(0), d_size(0)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw runtime_error("Could not open shard file: " + path);
+
+	try {
+		map(fd, path);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	close(fd);
+}
+
+ContextShards::ContextShards(int fd, string const &name)
+	: d_data(0), d_size(0)
+{
+	map(fd, name);
+}
+
+ContextShards::~ContextShards()
+{
+	munmap(d_data, d_size);
+}
+
+void ContextShards::advise(size_t shard, int advice) const
+{
+	ShardEntry const *index = shardIndex(d_data);
+
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t begin = index[shard].offset / pageSize * pageSize;
+	size_t end = index[shard + 1].offset;
+
+	madvise(d_data + begin, end - begin, advice);
+}
+
+// A shard file can be longer than its contents, since files on hugetlbfs
+// are a multiple of the huge page size.
+void ContextShards::map(int fd, string const &name)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+			static_cast<size_t>(st.st_size) < sizeof(ShardFileHeader))
+		throw runtime_error("Not a shard file: " + name);
+
+	d_size = st.st_size;
+	void *data = mmap(0, d_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		throw runtime_error("Could not map shard file: " + name);
+
+	// Shared memory segments get huge pages if the kernel allows it.
+	adviseHugePages(data, d_size);
+	d_data = static_cast<char *>(data);
+
+	ShardFileHeader const &header = fileHeader(d_data);
+	string error;
+	if (memcmp(header.magic, SHARD_MAGIC, sizeof(SHARD_MAGIC)) != 0 ||
+			header.version != SHARD_VERSION)
+		error = "Not a shard file: ";
+	else if (header.size > d_size)
+		error = "Incomplete shard file: ";
+	else if (header.scalarSize != sizeof(StorageScalar))
+		error = "Shard file was written with a different storage precision: ";
+
+	if (!error.empty())
+	{
+		munmap(d_data, d_size);
+		throw runtime_error(error + name);
+	}
+
+	// The shards are read sequentially, so the kernel can read ahead
+	// aggressively and drop pages that were read.
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t shardsEnd = header.shardIndex / pageSize * pageSize;
+	if (shardsEnd != 0)
+		madvise(d_data, shardsEnd, MADV_SEQUENTIAL);
+}
+
+double const *ContextShards::contextProbs() const
+{
+	return reinterpret_cast<double const *>(d_data +
+		fileHeader(d_data).contextProbs);
+}
+
+VectorXd ContextShards::expFeatureValues() const
+{
+	ShardFileHeader const &header = fileHeader(d_data);
+	double const *values = reinterpret_cast<double const *>(d_data +
+		header.expFeatureValues);
+
+	VectorXd expVals(header.nFeatures);
+	adviseHugePages(expVals.data(), header.nFeatures * sizeof(double));
+	for (size_t f = 0; f < header.nFeatures; ++f)
+		expVals[f] = values[f];
+
+	return expVals;
+}
+
+FeatureIds ContextShards::featureIds() const
+{
+	ShardFileHeader const &header = fileHeader(d_data);
+	uint64_t const *ids = reinterpret_cast<uint64_t const *>(d_data +
+		header.featureIds);
+
+	return FeatureIds(ids, ids + header.nFeatures);
+}
+
+size_t ContextShards::nContexts() const
+{
+	return fileHeader(d_data).nContexts;
+}
+
+size_t ContextShards::nEvents() const
+{
+	return fileHeader(d_data).nEvents;
+}
+
+int ContextShards::nFeatures() const
+{
+	return fileHeader(d_data).nFeatures;
+}
+
+size_t ContextShards::nFeatureIds() const
+{
+	return fileHeader(d_data).nFeatureIds;
+}
+
+size_t ContextShards::nNonZeros() const
+{
+	return fileHeader(d_data).nNonZeros;
+}
+
+size_t ContextShards::nShards() const
+{
+	return fileHeader(d_data).nShards;
+}
+
+FeatureOccurrence const *ContextShards::occurrences() const
+{
+	return reinterpret_cast<FeatureOccurrence const *>(d_data +
+		fileHeader(d_data).occurrences);
+}
+
+uint64_t const *ContextShards::occurrenceOffsets() const
+{
+	return reinterpret_cast<uint64_t const *>(d_data +
+		fileHeader(d_data).occurrenceOffsets);
+}
+
+void ContextShards::prefetch(size_t shard) const
+{
+	advise(shard, MADV_WILLNEED);
+}
+
+void ContextShards::readShard(size_t shard, ContextVector *contexts) const
+{
+	ShardEntry const *index = shardIndex(d_data);
+	size_t nContexts = index[shard + 1].begin - index[shard].begin;
+	int nFeatures = fileHeader(d_data).nFeatures;
+
+	// Find the records, so that they can be decoded in parallel.
+	vector<char const *> records(nContexts);
+	char const *record = d_data + index[shard].offset;
+	for (size_t i = 0; i < nContexts; ++i)
+	{
+		records[i] = record;
+		record += RecordView(record).size;
+	}
+
+	contexts->assign(nContexts, Context(0.0, EventProbs(), FeatureValues()));
+
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < static_cast<int>(nContexts); ++i)
+		(*contexts)[i] = readContext(records[i], nFeatures);
+}
+
+void ContextShards::release(size_t shard) const
+{
+	advise(shard, MADV_DONTNEED);
+}
+
+size_t ContextShards::shardBegin(size_t shard) const
+{
+	return shardIndex(d_data)[shard].begin;
+}
+
+size_t ContextShards::shardEvents(size_t shard) const
+{
+	return shardIndex(d_data)[shard].nEvents;
+}
+
+size_t ContextShards::shardNonZeros(size_t shard) const
+{
+	return shardIndex(d_data)[shard].nNonZeros;
+}
+
+ValueDictionary ContextShards::valueDictionary() const
+{
+	ShardFileHeader const &header = fileHeader(d_data);
+
+	ValueDictionary dictionary;
+	for (size_t i = 0; i < header.dictionarySize; ++i)
+		dictionary.add(header.dictionary[i]);
+
+	return dictionary;
+}
+
+ContextShardWriter::ContextShardWriter(string const &path, int nFeatures)
+	: d_path(path), d_out(path.c_str(), ios::binary | ios::trunc),
+	d_nFeatures(nFeatures), d_nEvents(0), d_nNonZeros(0), d_offset(0),
+	d_featureCounts(nFeatures)
+{
+	if (!d_out)
+		throw runtime_error("Could not open shard file for writing: " + path);
+
+	// The header is written when the file is finished.
+	ShardFileHeader header;
+	memset(&header, 0, sizeof(header));
+	write(&header, 1);
+}
+
+void ContextShardWriter::add(Context const &context)
+{
+	size_t nContexts = d_contextProbs.size();
+	if (d_shardOffsets.size() == 0 ||
+			(d_offset - d_shardOffsets.back() >= SHARD_BYTES &&
+			(nContexts - d_shardBegins.back()) % REDUCTION_BLOCK_SIZE == 0))
+		openShard();
+
+	FeatureValues const &featureVals = context.featureValues();
+	size_t nEvents = featureVals.outerSize();
+
+	vector<StorageScalar> values;
+	vector<uint32_t> eventSizes(nEvents);
+	vector<int32_t> features;
+	for (size_t j = 0; j < nEvents; ++j)
+		for (FeatureValues::InnerIterator fIter(featureVals, j); fIter; ++fIter)
+		{
+			values.push_back(fIter.value());
+			features.push_back(fIter.index());
+			++eventSizes[j];
+
+			if (fIter.value() != 0.0)
+				++d_featureCounts[fIter.index()];
+		}
+
+	ContextRecord record = {static_cast<uint32_t>(nEvents),
+		static_cast<uint32_t>(values.size()), context.prob()};
+	write(&record, 1);
+	write(context.eventProbs().data(), nEvents);
+	write(context.eventCounts().data(), nEvents);
+	write(values.data(), values.size());
+	write(eventSizes.data(), nEvents);
+	write(features.data(), features.size());
+	pad();
+
+	d_contextProbs.push_back(context.prob());
+	d_shardEvents.back() += nEvents;
+	d_shardNonZeros.back() += values.size();
+	d_nEvents += nEvents;
+	d_nNonZeros += values.size();
+}
+
+void ContextShardWriter::finish(FeatureIds const &featureIds,
+	size_t nFeatureIds, VectorXd const &expFeatureValues,
+	ValueDictionary const &dictionary, size_t bufferSize)
+{
+	ShardFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SHARD_MAGIC, sizeof(SHARD_MAGIC));
+	header.version = SHARD_VERSION;
+	header.scalarSize = sizeof(StorageScalar);
+	header.nContexts = d_contextProbs.size();
+	header.nEvents = d_nEvents;
+	header.nNonZeros = d_nNonZeros;
+	header.nFeatures = d_nFeatures;
+	header.nFeatureIds = nFeatureIds;
+	header.nShards = d_shardOffsets.size();
+	header.dictionarySize = dictionary.size();
+	for (size_t i = 0; i < dictionary.size(); ++i)
+		header.dictionary[i] = dictionary[i];
+
+	header.shardIndex = d_offset;
+	for (size_t s = 0; s < d_shardOffsets.size(); ++s)
+	{
+		ShardEntry entry = {d_shardOffsets[s], d_shardBegins[s],
+			d_shardEvents[s], d_shardNonZeros[s]};
+		write(&entry, 1);
+	}
+	ShardEntry end = {header.shardIndex, header.nContexts, 0, 0};
+	write(&end, 1);
+
+	header.contextProbs = d_offset;
+	write(d_contextProbs.data(), d_contextProbs.size());
+
+	header.featureIds = d_offset;
+	vector<uint64_t> ids(featureIds.begin(), featureIds.end());
+	write(ids.data(), ids.size());
+
+	header.expFeatureValues = d_offset;
+	write(expFeatureValues.data(), expFeatureValues.size());
+
+	vector<uint64_t> offsets(d_nFeatures + 1);
+	for (int f = 0; f < d_nFeatures; ++f)
+		offsets[f + 1] = offsets[f] + d_featureCounts[f];
+
+	header.occurrenceOffsets = d_offset;
+	write(offsets.data(), offsets.size());
+
+	header.occurrences = d_offset;
+	writeOccurrences(offsets, header.shardIndex, dictionary, bufferSize);
+
+	header.size = d_offset;
+	d_out.seekp(0);
+	d_out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+	d_out.close();
+
+	if (!d_out)
+		throw runtime_error("Could not write shard file: " + d_path);
+}
+
+void ContextShardWriter::openShard()
+{
+	d_shardOffsets.push_back(d_offset);
+	d_shardBegins.push_back(d_contextProbs.size());
+	d_shardEvents.push_back(0);
+	d_shardNonZeros.push_back(0);
+}
+
+void ContextShardWriter::pad()
+{
+	static char const zeros[8] = {0};
+	write(zeros, align8(d_offset) - d_offset);
+}
+
+template <typename T>
+void ContextShardWriter::write(T const *data, size_t n)
+{
+	d_out.write(reinterpret_cast<char const *>(data), n * sizeof(T));
+	if (!d_out)
+		throw runtime_error("Could not write shard file: " + d_path);
+
+	d_offset += n * sizeof(T);
+}
+
+// The occurrence lists are the transpose of the shards. Every pass reads
+// the shards sequentially, and collects the occurrences of the features
+// that fit in the buffer. The buffer is then appended to the file, so the
+// file is only read and written sequentially.
+void ContextShardWriter::writeOccurrences(vector<uint64_t> const &offsets,
+	uint64_t shardsEnd, ValueDictionary const &dictionary, size_t bufferSize)
+{
+	d_out.flush();
+
+	ifstream in(d_path.c_str(), ios::binary);
+	if (!in)
+		throw runtime_error("Could not read shard file: " + d_path);
+
+	size_t bufferOccurrences = max(bufferSize / sizeof(FeatureOccurrence),
+		static_cast<size_t>(1));
+
+	vector<char> shard;
+	vector<FeatureOccurrence> buffer;
+	vector<uint64_t> next;
+	size_t first = 0;
+	while (first < static_cast<size_t>(d_nFeatures))
+	{
+		// A feature with more occurrences than fit in the buffer gets a
+		// pass of its own.
+		size_t last = first + 1;
+		while (last < static_cast<size_t>(d_nFeatures) &&
+				offsets[last + 1] - offsets[first] <= bufferOccurrences)
+			++last;
+
+		buffer.resize(offsets[last] - offsets[first]);
+		next.assign(offsets.begin() + first, offsets.begin() + last);
+
+		for (size_t s = 0; s < d_shardOffsets.size(); ++s)
+		{
+			uint64_t end = s + 1 < d_shardOffsets.size() ?
+				d_shardOffsets[s + 1] : shardsEnd;
+			shard.resize(end - d_shardOffsets[s]);
+
+			in.seekg(d_shardOffsets[s]);
+			if (!in.read(shard.data(), shard.size()))
+				throw runtime_error("Could not read shard file: " + d_path);
+
+			size_t context = d_shardBegins[s];
+			for (char const *data = shard.data(); data != shard.data() + shard.size();
+				++context)
+			{
+				RecordView record(data);
+
+				size_t k = 0;
+				for (size_t j = 0; j < record.header->nEvents; ++j)
+					for (size_t l = 0; l < record.eventSizes[j]; ++l, ++k)
+					{
+						size_t f = record.features[k];
+						StorageScalar value = record.values[k];
+						if (f < first || f >= last || value == 0.0)
+							continue;
+
+						unsigned char valueIndex = dictionary.empty() ? 0 :
+							static_cast<unsigned char>(dictionary.index(value));
+						FeatureOccurrence occurrence = {context, value,
+							static_cast<unsigned int>(j), valueIndex};
+						buffer[next[f - first]++ - offsets[first]] = occurrence;
+					}
+
+				data += record.size;
+			}
+		}
+
+		write(buffer.data(), buffer.size());
+
+		first = last;
+	}
+}
+
+namespace {
+
+// Attempts to attach to a segment before giving up, when it stays
+// incomplete, and the delay between attempts in microseconds.
+size_t const MAX_ATTACH_ATTEMPTS = 1000;
+useconds_t const ATTACH_RETRY_DELAY = 10000;
+
+// The data file that a segment was published from. It follows the shard
+// file in the segment, at the next multiple of 8 bytes.
+struct SegmentSource
+{
+	uint64_t size;
+	uint64_t mtime;
+	char path[PATH_MAX];
+};
+
+size_t segmentSourceOffset(size_t shardFileSize)
+{
+	return (shardFileSize + 7) / 8 * 8;
+}
+
+// The identity of a data file: its canonical path, size and modification
+// time in nanoseconds.
+SegmentSource dataFileSource(string const &dataPath)
+{
+	SegmentSource source;
+	memset(&source, 0, sizeof(source));
+
+	struct stat st;
+	if (realpath(dataPath.c_str(), source.path) == 0 ||
+			stat(source.path, &st) != 0)
+		throw runtime_error("Could not find data file " + dataPath + ": " +
+			strerror(errno));
+
+	source.size = st.st_size;
+	source.mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 +
+		st.st_mtim.tv_nsec;
+
+	return source;
+}
+
+bool sameSource(SegmentSource const &source, SegmentSource const &other)
+{
+	return source.size == other.size && source.mtime == other.mtime &&
+		strcmp(source.path, other.path) == 0;
+}
+
+bool isSegmentPath(string const &name)
+{
+	return name.find('/', 1) != string::npos;
+}
+
+int openSegment(string const &name, int flags)
+{
+	if (isSegmentPath(name))
+		return open(name.c_str(), flags, 0644);
+
+	return shm_open(name.c_str(), flags, 0644);
+}
+
+void unlinkSegment(string const &name)
+{
+	if (isSegmentPath(name))
+		unlink(name.c_str());
+	else
+		shm_unlink(name.c_str());
+}
+
+bool lockSegment(int fd, int operation)
+{
+	while (flock(fd, operation) != 0)
+		if (errno != EINTR)
+			return false;
+
+	return true;
+}
+
+// The publisher writes the magic number last, so a segment that starts
+// with it is complete.
+bool segmentComplete(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+			static_cast<size_t>(st.st_size) < sizeof(ShardFileHeader))
+		return false;
+
+	void *data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		return false;
+
+	bool complete = memcmp(fileHeader(static_cast<char const *>(data)).magic,
+		SHARD_MAGIC, sizeof(SHARD_MAGIC)) == 0;
+	munmap(data, st.st_size);
+
+	return complete;
+}
+
+// Throw if a complete segment was not published from the data file.
+void checkSegmentSource(int fd, string const &name, string const &dataPath)
+{
+	SegmentSource expected = dataFileSource(dataPath);
+
+	struct stat st;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0)
+		data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		throw runtime_error("Could not map shared data set " + name + ": " +
+			strerror(errno));
+
+	char const *segment = static_cast<char const *>(data);
+	size_t offset = segmentSourceOffset(fileHeader(segment).size);
+	bool same = offset + sizeof(SegmentSource) <=
+			static_cast<size_t>(st.st_size) &&
+		sameSource(*reinterpret_cast<SegmentSource const *>(segment + offset),
+			expected);
+	munmap(data, st.st_size);
+
+	if (!same)
+		throw runtime_error("Shared data set " + name + " was published from "
+			"another data file, or " + dataPath + " changed since");
+}
+
+}
+
+SharedShards::SharedShards(string const &name, string const &dataPath)
+	: d_name(name), d_dataPath(dataPath), d_fd(-1), d_published(false)
+{
+	for (size_t attempt = 0; attempt < MAX_ATTACH_ATTEMPTS; ++attempt)
+	{
+		d_fd = openSegment(name, O_RDWR | O_CREAT | O_EXCL);
+		if (d_fd != -1)
+		{
+			if (!lockSegment(d_fd, LOCK_EX))
+			{
+				int err = errno;
+				unlinkSegment(name);
+				close(d_fd);
+				throw runtime_error("Could not lock shared data set " + name +
+					": " + strerror(err));
+			}
+
+			return;
+		}
+
+		if (errno != EEXIST)
+			throw runtime_error("Could not create shared data set " + name + ": " +
+				strerror(errno));
+
+		d_fd = openSegment(name, O_RDONLY);
+		if (d_fd == -1)
+		{
+			// Removed after the attempt to create it.
+			if (errno == ENOENT)
+				continue;
+
+			throw runtime_error("Could not open shared data set " + name + ": " +
+				strerror(errno));
+		}
+
+		if (lockSegment(d_fd, LOCK_SH) && segmentComplete(d_fd))
+		{
+			try {
+				checkSegmentSource(d_fd, name, dataPath);
+			} catch (...) {
+				close(d_fd);
+				throw;
+			}
+
+			d_published = true;
+			return;
+		}
+
+		// Nobody else holds a segment that a failed publisher left behind.
+		if (flock(d_fd, LOCK_EX | LOCK_NB) == 0 && sameSegment())
+			unlinkSegment(name);
+
+		close(d_fd);
+		d_fd = -1;
+		usleep(ATTACH_RETRY_DELAY);
+	}
+
+	throw runtime_error("Shared data set stays incomplete: " + name);
+}
+
+// Other processes only get a lock on a segment that is not published
+// when its publisher failed.
+SharedShards::~SharedShards()
+{
+	if ((!d_published || flock(d_fd, LOCK_EX | LOCK_NB) == 0) && sameSegment())
+		unlinkSegment(d_name);
+
+	close(d_fd);
+}
+
+DataSet SharedShards::dataSet() const
+{
+	if (!d_published)
+		throw runtime_error("Shared data set was not published: " + d_name);
+
+	return DataSet::openShardedDataSet(d_fd, d_name);
+}
+
+// The segment size is rounded up to the block size of its file system,
+// since files on hugetlbfs consist of whole huge pages.
+void SharedShards::publish(string const &shardPath)
+{
+	if (d_published)
+		throw runtime_error("Shared data set was already published: " + d_name);
+
+	SegmentSource source = dataFileSource(d_dataPath);
+
+	int fd = open(shardPath.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw runtime_error("Could not open shard file: " + shardPath);
+
+	struct stat st;
+	void *src = MAP_FAILED;
+	if (fstat(fd, &st) == 0 &&
+			static_cast<size_t>(st.st_size) >= sizeof(ShardFileHeader))
+		src = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (src == MAP_FAILED)
+		throw runtime_error("Could not map shard file: " + shardPath);
+
+	size_t size = st.st_size;
+	char const *srcData = static_cast<char const *>(src);
+	if (memcmp(fileHeader(srcData).magic, SHARD_MAGIC,
+			sizeof(SHARD_MAGIC)) != 0 || fileHeader(srcData).size > size)
+	{
+		munmap(src, size);
+		throw runtime_error("Not a shard file: " + shardPath);
+	}
+
+	// The data file follows the contents of the shard file, which can be
+	// shorter than the file.
+	size_t shardSize = fileHeader(srcData).size;
+	size_t sourceOffset = segmentSourceOffset(shardSize);
+	size_t segmentSize = sourceOffset + sizeof(SegmentSource);
+	struct statvfs vfs;
+	if (fstatvfs(d_fd, &vfs) == 0 && vfs.f_bsize != 0)
+		segmentSize = (segmentSize + vfs.f_bsize - 1) / vfs.f_bsize *
+			vfs.f_bsize;
+
+	void *dst = MAP_FAILED;
+	if (ftruncate(d_fd, segmentSize) == 0)
+		dst = mmap(0, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, d_fd, 0);
+
+	if (dst == MAP_FAILED)
+	{
+		int err = errno;
+		munmap(src, size);
+		throw runtime_error("Could not allocate shared data set " + d_name +
+			": " + strerror(err));
+	}
+
+	adviseHugePages(dst, segmentSize);
+
+	char *dstData = static_cast<char *>(dst);
+	memcpy(dstData + sizeof(SHARD_MAGIC), srcData + sizeof(SHARD_MAGIC),
+		shardSize - sizeof(SHARD_MAGIC));
+	memcpy(dstData + sourceOffset, &source, sizeof(source));
+	memcpy(dstData, srcData, sizeof(SHARD_MAGIC));
+
+	munmap(dst, segmentSize);
+	munmap(src, size);
+
+	lockSegment(d_fd, LOCK_SH);
+	d_published = true;
+}
+
+bool SharedShards::sameSegment() const
+{
+	int fd = openSegment(d_name, O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	struct stat st;
+	struct stat own;
+	bool same = fstat(fd, &st) == 0 && fstat(d_fd, &own) == 0 &&
+		st.st_dev == own.st_dev && st.st_ino == own.st_ino;
+	close(fd);
+
+	return same;
+}
+
+bool fsqueeze::isShardFile(string const &path)
+{
+	ifstream in(path.c_str(), ios::binary);
+
+	char magic[sizeof(SHARD_MAGIC)];
+	return in.read(magic, sizeof(magic)) &&
+		memcmp(magic, SHARD_MAGIC, sizeof(SHARD_MAGIC)) == 0;
+}
+
+ShardCursor::ShardCursor(DataSet const &dataSet)
+	: d_dataSet(&dataSet), d_shard(0), d_offset(0), d_contexts(0)
+{
+	if (dataSet.outOfCore() && dataSet.shards()->nShards() != 0)
+		dataSet.shards()->prefetch(0);
+}
+
+ShardCursor::~ShardCursor()
+{
+	if (d_dataSet->outOfCore() && d_shard != 0)
+		d_dataSet->shards()->release(d_shard - 1);
+}
+
+bool ShardCursor::next()
+{
+	if (!d_dataSet->outOfCore())
+	{
+		if (d_contexts != 0)
+			return false;
+
+		d_contexts = &d_dataSet->contexts();
+		return true;
+	}
+
+	ContextShards const *shards = d_dataSet->shards();
+	if (d_shard == shards->nShards())
+		return false;
+
+	if (d_shard != 0)
+		shards->release(d_shard - 1);
+	if (d_shard + 1 < shards->nShards())
+		shards->prefetch(d_shard + 1);
+
+	shards->readShard(d_shard, &d_buffer);
+	countNonZeros(d_buffer, &d_nonZeroOffsets);
+	d_contexts = &d_buffer;
+	d_offset = shards->shardBegin(d_shard);
+	++d_shard;
+
+	return true;
+}
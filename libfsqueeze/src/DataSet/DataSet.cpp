@@ -28,14 +28,24 @@ string const ERR_INCORRECT_EVENT =
 	string("Incorrect event line: ");
 
 DataSet::DataSet(ContextVector const &contexts)
-	: d_contexts(contexts), d_nFeatures(0)
+	: DataSet(ContextVector(contexts))
 {
+}
+
+DataSet::DataSet(ContextVector &&contexts)
+	: d_contexts(std::move(contexts)), d_nFeatures(0), d_nFeatureIds(0),
+	d_nContexts(0), d_contextProbs(0)
+{
+	// The passes over the contexts are scheduled by the non-zero counts of
+	// the contexts, which change when static features are removed.
+	countNonZeros(d_contexts, &d_contextNonZeros);
 	countFeatures();
 	removeStaticFeatures();
+	countNonZeros(d_contexts, &d_contextNonZeros);
 	normalize();
-	buildFeatureMap();
+	buildValueDictionary();
 
-	d_expFeatureValues = fsqueeze::expFeatureValues(d_features, d_nFeatures);
+	d_expFeatureValues = fsqueeze::expFeatureValues(d_contexts, d_nFeatures);
 }
 
 DataSet::DataSet(DataSet const &other)
@@ -43,6 +53,23 @@ DataSet::DataSet(DataSet const &other)
 	copy(other);
 }
 
+DataSet::DataSet(shared_ptr<ContextShards const> const &shards)
+	: d_nFeatures(shards->nFeatures()), d_nFeatureIds(shards->nFeatureIds()),
+	d_expFeatureValues(shards->expFeatureValues()),
+	d_valueDictionary(shards->valueDictionary()), d_shards(shards),
+	d_nContexts(shards->nContexts()), d_contextProbs(shards->contextProbs())
+{
+	d_featureIds = shards->featureIds();
+	for (size_t i = 0; i < d_featureIds.size(); ++i)
+		d_featureIdMap[d_featureIds[i]] = i;
+}
+
+DataSet::DataSet(DataSet &&other) noexcept
+	: d_nFeatures(0), d_nFeatureIds(0), d_nContexts(0), d_contextProbs(0)
+{
+	swap(other);
+}
+
 DataSet &DataSet::operator=(DataSet const &other)
 {
 	if (this != &other)
@@ -51,43 +78,263 @@ DataSet &DataSet::operator=(DataSet const &other)
 	return *this;
 }
 
+DataSet &DataSet::operator=(DataSet &&other) noexcept
+{
+	swap(other);
+	
+	return *this;
+}
+
 void DataSet::copy(DataSet const &other)
 {
 	d_contexts = other.d_contexts;
+	d_contextNonZeros = other.d_contextNonZeros;
+	d_featureIds = other.d_featureIds;
+	d_featureIdMap = other.d_featureIdMap;
 	d_nFeatures = other.d_nFeatures;
+	d_nFeatureIds = other.d_nFeatureIds;
 	d_expFeatureValues = other.d_expFeatureValues;
-	buildFeatureMap();
+	d_valueDictionary = other.d_valueDictionary;
+	d_shards = other.d_shards;
+	d_nContexts = other.d_nContexts;
+	d_contextProbs = other.d_contextProbs;
 }
 
-// Build a map of features, where the feature identifiers are keys and Event/Feature
-// instance pairs values. Useful for calculating expected feature values.
-void DataSet::buildFeatureMap()
+void DataSet::swap(DataSet &other)
 {
-	d_features.clear();
+	d_contexts.swap(other.d_contexts);
+	d_contextNonZeros.swap(other.d_contextNonZeros);
+	d_featureIds.swap(other.d_featureIds);
+	d_featureIdMap.swap(other.d_featureIdMap);
+	std::swap(d_nFeatures, other.d_nFeatures);
+	std::swap(d_nFeatureIds, other.d_nFeatureIds);
+	d_expFeatureValues.swap(other.d_expFeatureValues);
+	std::swap(d_valueDictionary, other.d_valueDictionary);
+	d_shards.swap(other.d_shards);
+	std::swap(d_nContexts, other.d_nContexts);
+	std::swap(d_contextProbs, other.d_contextProbs);
+}
 
-	for (ContextVector::const_iterator ctxIter = d_contexts.begin();
-			ctxIter != d_contexts.end(); ++ctxIter)
-		for (int i = 0; i < ctxIter->eventProbs().size(); ++i)
-			for (FeatureValues::InnerIterator fIter(ctxIter->featureValues(), i);
-					fIter; ++fIter)
-				d_features[fIter.index()].push_back(make_pair(ctxIter->eventProbs().coeff(i),
-					fIter.value()));
+// Events and contexts are folded by their feature values. A key lists the
+// feature/value pairs of an event, or the counts and feature/value pairs
+// of the events of a context.
+typedef vector<double> FoldKey;
+
+struct FoldKeyHash
+{
+	size_t operator()(FoldKey const &key) const;
+};
+
+size_t FoldKeyHash::operator()(FoldKey const &key) const
+{
+	hash<double> hashDouble;
+	size_t seed = key.size();
+	for (FoldKey::const_iterator iter = key.begin(); iter != key.end(); ++iter)
+		seed ^= hashDouble(*iter) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+	
+	return seed;
+}
+
+void appendEventKey(FeatureValues const &featureVals, int event, FoldKey *key)
+{
+	for (FeatureValues::InnerIterator fIter(featureVals, event); fIter; ++fIter)
+	{
+		key->push_back(fIter.index());
+		key->push_back(fIter.value());
+	}
+}
+
+// Add the features that do not retain the same value within a context.
+void DataSet::addDynamicFeatures(Context const &context,
+	unordered_set<size_t> *changing)
+{
+	FeatureValues const &fVals = context.featureValues();
+	
+	// Find all (non-proven) features for the current context.
+	unordered_set<size_t> ctxFs;
+	for (int i = 0; i < fVals.outerSize(); ++i)
+		for (FeatureValues::InnerIterator fIter(fVals, i); fIter; ++fIter)
+			if (changing->find(fIter.index()) == changing->end())
+				ctxFs.insert(fIter.index());
+	
+	// Find all feature values
+	unordered_map<size_t, unordered_set<double> > ctxFVals;
+	for (int i = 0; i < fVals.outerSize(); ++i)
+		for (unordered_set<size_t>::const_iterator fIter = ctxFs.begin();
+			fIter != ctxFs.end(); ++fIter)
+		{
+			double coeff = fVals.coeff(i, *fIter);
+			ctxFVals[*fIter].insert(coeff);
+		}
+	
+	for (unordered_map<size_t, unordered_set<double> >::const_iterator iter = ctxFVals.begin();
+			iter != ctxFVals.end(); ++iter)
+		if (iter->second.size() > 1)
+			changing->insert(iter->first);
+}
+
+// Add the non-zero values of a context to a dictionary. Returns false if
+// the dictionary is full.
+bool addContextValues(Context const &context, ValueDictionary *dictionary)
+{
+	FeatureValues const &vals = context.featureValues();
+	
+	for (int i = 0; i < vals.outerSize(); ++i)
+		for (FeatureValues::InnerIterator fIter(vals, i); fIter; ++fIter)
+			if (fIter.value() != 0.0 && !dictionary->add(fIter.value()))
+				return false;
+	
+	return true;
+}
+
+// Every block of contexts collects its values in order of appearance, and
+// the blocks are merged in order. The values are then numbered as in a
+// single pass over the contexts, like convertTADMDataSet does.
+void DataSet::buildValueDictionary()
+{
+	d_valueDictionary.clear();
+	
+	vector<ValueDictionary> blockValues(reductionBlocks(d_contexts.size()));
+	vector<char> blockFull(blockValues.size(), 0);
+	
+	ContextScheduler scheduler(d_contextNonZeros, REDUCTION_BLOCK_SIZE);
+	#pragma omp parallel
+	{
+		ContextRange range;
+		while (scheduler.next(&range))
+			for (size_t b = range.begin / REDUCTION_BLOCK_SIZE;
+					b < reductionBlocks(range.end); ++b)
+				for (size_t i = reductionBlockBegin(b);
+						i < reductionBlockEnd(b, d_contexts.size()) && !blockFull[b]; ++i)
+					if (!addContextValues(d_contexts[i], &blockValues[b]))
+						blockFull[b] = 1;
+	}
+	
+	for (size_t b = 0; b < blockValues.size(); ++b)
+	{
+		if (blockFull[b])
+		{
+			d_valueDictionary.clear();
+			return;
+		}
+		
+		for (size_t v = 0; v < blockValues[b].size(); ++v)
+			if (!d_valueDictionary.add(blockValues[b][v]))
+				return;
+	}
 }
 
 void DataSet::countFeatures()
 {
-	for (ContextVector::const_iterator ctxIter = d_contexts.begin();
+	ContextScheduler scheduler(d_contextNonZeros);
+	#pragma omp parallel
+	{
+		size_t nFeatureIds = 0;
+		ContextRange range;
+		while (scheduler.next(&range))
+			for (size_t k = range.begin; k < range.end; ++k)
+			{
+				FeatureValues const &vals = d_contexts[k].featureValues();
+				
+				for (int i = 0; i < vals.outerSize(); ++i)
+					for (FeatureValues::InnerIterator fIter(vals, i); fIter; ++fIter)
+						if (static_cast<size_t>(fIter.index()) >= nFeatureIds)
+							nFeatureIds = fIter.index() + 1;
+			}
+		
+		#pragma omp critical
+		d_nFeatureIds = max(d_nFeatureIds, nFeatureIds);
+	}
+}
+
+void DataSet::foldEvents(Context *context)
+{
+	FeatureValues const &featureVals = context->featureValues();
+	EventProbs const &eventProbs = context->eventProbs();
+	EventCounts const &eventCounts = context->eventCounts();
+	
+	// Map each event to the first event with the same feature values.
+	unordered_map<FoldKey, size_t, FoldKeyHash> firstEvents;
+	vector<size_t> folded(featureVals.outerSize());
+	size_t nFolded = 0;
+	for (int i = 0; i < featureVals.outerSize(); ++i)
+	{
+		FoldKey key;
+		appendEventKey(featureVals, i, &key);
+		
+		pair<unordered_map<FoldKey, size_t, FoldKeyHash>::iterator, bool> r =
+			firstEvents.insert(make_pair(key, nFolded));
+		folded[i] = r.first->second;
+		if (r.second)
+			++nFolded;
+	}
+	
+	if (nFolded == static_cast<size_t>(featureVals.outerSize()))
+		return;
+	
+	EventProbs foldedProbs(EventProbs::Zero(nFolded));
+	EventCounts foldedCounts(EventCounts::Zero(nFolded));
+	FeatureValues foldedVals(nFolded, featureVals.cols());
+	for (int i = 0; i < featureVals.outerSize(); ++i)
+	{
+		size_t j = folded[i];
+		if (foldedCounts[j] == 0.0)
+			for (FeatureValues::InnerIterator fIter(featureVals, i); fIter; ++fIter)
+				foldedVals.coeffRef(j, fIter.index()) = fIter.value();
+		
+		foldedProbs[j] += eventProbs[i];
+		foldedCounts[j] += eventCounts[i];
+	}
+	
+	context->eventProbs(std::move(foldedProbs));
+	context->eventCounts(std::move(foldedCounts));
+	context->featureValues(std::move(foldedVals));
+}
+
+void DataSet::foldDuplicates()
+{
+	if (outOfCore())
+		throw runtime_error("Duplicates cannot be folded in an out-of-core data set");
+
+	ContextVector folded;
+	unordered_map<FoldKey, size_t, FoldKeyHash> firstContexts;
+	
+	for (ContextVector::iterator ctxIter = d_contexts.begin();
 			ctxIter != d_contexts.end(); ++ctxIter)
 	{
-		FeatureValues const &vals = ctxIter->featureValues();
+		foldEvents(&*ctxIter);
 		
-		for (int i = 0; i < vals.outerSize(); ++i)
-			for (FeatureValues::InnerIterator fIter(vals, i); fIter; ++fIter)
-				if (fIter.index() > d_nFeatures)
-					d_nFeatures = fIter.index();
+		FeatureValues const &featureVals = ctxIter->featureValues();
+		FoldKey key;
+		for (int i = 0; i < featureVals.outerSize(); ++i)
+		{
+			FoldKey eventKey;
+			appendEventKey(featureVals, i, &eventKey);
+			
+			key.push_back(ctxIter->eventCounts()[i]);
+			key.push_back(eventKey.size());
+			key.insert(key.end(), eventKey.begin(), eventKey.end());
+		}
+		
+		pair<unordered_map<FoldKey, size_t, FoldKeyHash>::iterator, bool> r =
+			firstContexts.insert(make_pair(key, folded.size()));
+		if (r.second)
+		{
+			folded.push_back(std::move(*ctxIter));
+			continue;
+		}
+		
+		// The model gives identical contexts the same p(y|x), so they can be
+		// folded by summing their probabilities.
+		Context &first = folded[r.first->second];
+		first.prob(first.prob() + ctxIter->prob());
+		first.eventProbs(EventProbs(first.eventProbs() + ctxIter->eventProbs()));
 	}
 	
-	++d_nFeatures;
+	d_contexts.swap(folded);
+	
+	countNonZeros(d_contexts, &d_contextNonZeros);
+	d_expFeatureValues = fsqueeze::expFeatureValues(d_contexts, d_nFeatures);
 }
 
 FeatureChangeFreqs DataSet::dynamicFeatureFreqs() const
@@ -130,37 +377,76 @@ unordered_set<size_t> DataSet::dynamicFeatures() const
 {
 	unordered_set<size_t> changing;
 	
-	for (ContextVector::const_iterator ctxIter = d_contexts.begin();
-		ctxIter != d_contexts.end(); ++ctxIter)
+	// Every thread finds the dynamic features of its own contexts.
+	ContextScheduler scheduler(d_contextNonZeros);
+	#pragma omp parallel
 	{
-		FeatureValues const &fVals = ctxIter->featureValues();
-		
-		// Find all (non-proven) features for the current context.
-		unordered_set<size_t> ctxFs;
-		for (int i = 0; i < fVals.outerSize(); ++i)
-			for (FeatureValues::InnerIterator fIter(fVals, i); fIter; ++fIter)
-				if (changing.find(fIter.index()) == changing.end())
-					ctxFs.insert(fIter.index());
+		unordered_set<size_t> threadChanging;
+		ContextRange range;
+		while (scheduler.next(&range))
+			for (size_t i = range.begin; i < range.end; ++i)
+				addDynamicFeatures(d_contexts[i], &threadChanging);
 		
-		// Find all feature values
-		unordered_map<size_t, unordered_set<double> > ctxFVals;
-		for (int i = 0; i < fVals.outerSize(); ++i)
-			for (unordered_set<size_t>::const_iterator fIter = ctxFs.begin();
-				fIter != ctxFs.end(); ++fIter)
-			{
-				double coeff = fVals.coeff(i, *fIter);
-				ctxFVals[*fIter].insert(coeff);
-			}
-		
-		for (unordered_map<size_t, unordered_set<double> >::const_iterator iter = ctxFVals.begin();
-				iter != ctxFVals.end(); ++iter)
-			if (iter->second.size() > 1)
-				changing.insert(iter->first);
+		#pragma omp critical
+		changing.insert(threadChanging.begin(), threadChanging.end());
 	}
 	
 	return changing;
 }
 
+MemoryUsage DataSet::memoryUsage() const
+{
+	if (outOfCore())
+		return shardedMemoryUsage();
+
+	size_t nEvents = 0;
+	size_t nNonZeros = 0;
+	for (ContextVector::const_iterator ctxIter = d_contexts.begin();
+			ctxIter != d_contexts.end(); ++ctxIter)
+	{
+		nEvents += ctxIter->eventProbs().size();
+		nNonZeros += ctxIter->featureValues().nonZeros();
+	}
+	
+	MemoryUsage usage;
+	addMemory(&usage, "contexts", d_contexts.capacity() * sizeof(Context) +
+		d_contextNonZeros.capacity() * sizeof(uint64_t));
+	addMemory(&usage, "feature values", nEvents * SPARSE_ROW_BYTES +
+		nNonZeros * (sizeof(StorageScalar) + sizeof(int)));
+	addMemory(&usage, "event probabilities and counts",
+		2 * nEvents * sizeof(double));
+	addMemory(&usage, "feature identifiers", d_featureIds.capacity() *
+		sizeof(size_t) + d_featureIdMap.size() * HASH_NODE_BYTES);
+	addMemory(&usage, "feature expectations", d_nFeatures * sizeof(double));
+	
+	return usage;
+}
+
+// The contexts of an out-of-core data set are decoded one shard at a
+// time, so only the largest shard is counted.
+MemoryUsage DataSet::shardedMemoryUsage() const
+{
+	size_t shardBytes = 0;
+	for (size_t i = 0; i < d_shards->nShards(); ++i)
+	{
+		size_t nContexts = d_shards->shardBegin(i + 1) - d_shards->shardBegin(i);
+		size_t nEvents = d_shards->shardEvents(i);
+		size_t bytes = nContexts * sizeof(Context) + nEvents * SPARSE_ROW_BYTES +
+			d_shards->shardNonZeros(i) * (sizeof(StorageScalar) + sizeof(int)) +
+			2 * nEvents * sizeof(double);
+		shardBytes = max(shardBytes, bytes);
+	}
+	
+	MemoryUsage usage;
+	addMemory(&usage, "decoded shard", shardBytes);
+	addMemory(&usage, "context probabilities", d_nContexts * sizeof(double));
+	addMemory(&usage, "feature identifiers", d_featureIds.capacity() *
+		sizeof(size_t) + d_featureIdMap.size() * HASH_NODE_BYTES);
+	addMemory(&usage, "feature expectations", d_nFeatures * sizeof(double));
+	
+	return usage;
+}
+
 // Normalize context probabilities and context,event joint probabilities.
 // Each event has a weighting/frequency (e.g. a fluency quality estimation) -
 // we normalize over the sum of all weights. As a result, contexts that
@@ -176,23 +462,49 @@ void DataSet::normalize()
 
 void DataSet::normalizeContexts(double ctxSum)
 {
-	for (ContextVector::iterator ctxIter = d_contexts.begin();
-			ctxIter != d_contexts.end(); ++ctxIter)
-		ctxIter->prob(ctxIter->prob() / ctxSum);
+	ContextScheduler scheduler(d_contextNonZeros);
+	#pragma omp parallel
+	{
+		ContextRange range;
+		while (scheduler.next(&range))
+			for (size_t i = range.begin; i < range.end; ++i)
+				d_contexts[i].prob(d_contexts[i].prob() / ctxSum);
+	}
 }
 
 void DataSet::normalizeEvents(double ctxSum)
 {
-	for (ContextVector::iterator ctxIter = d_contexts.begin();
-		ctxIter != d_contexts.end(); ++ctxIter)
-	{	
-		EventProbs normEvtProbs(ctxIter->eventProbs());
-		for (int i = 0; i < normEvtProbs.size(); ++i)
-			normEvtProbs[i] /= ctxSum;		
-		ctxIter->eventProbs(normEvtProbs);
+	ContextScheduler scheduler(d_contextNonZeros);
+	#pragma omp parallel
+	{
+		ContextRange range;
+		while (scheduler.next(&range))
+			for (size_t i = range.begin; i < range.end; ++i)
+				d_contexts[i].normalizeEventProbs(ctxSum);
 	}
 }
 
+void DataSet::placeContexts()
+{
+	// Assigning to an empty context allocates new storage, so every context
+	// is first touched by the thread that copies it. Chunks are scheduled
+	// like in the selection loops, so contexts go to the thread that starts
+	// with them; only stolen chunks end up elsewhere.
+	ContextVector placed(d_contexts.size(),
+		Context(0.0, EventProbs(), FeatureValues()));
+
+	ContextScheduler scheduler(d_contextNonZeros);
+	#pragma omp parallel
+	{
+		ContextRange range;
+		while (scheduler.next(&range))
+			for (size_t i = range.begin; i < range.end; ++i)
+				placed[i] = d_contexts[i];
+	}
+
+	d_contexts.swap(placed);
+}
+
 // Read an event line. An event line consists of:
 //
 // - The event frequency/weight.
@@ -252,7 +564,121 @@ Context DataSet::readContext(istream &iss)
 			fVals.coeffRef(i, fIter.index()) = fIter.value();		
 	}
 	
-	return Context(0.0, evtProbs, fVals);
+	return Context(0.0, std::move(evtProbs), std::move(fVals));
+}
+
+// The conversion follows the constructor, but processes one context at a
+// time. The first pass finds the dynamic features and the sum of the
+// context probabilities. The second pass numbers and normalizes the
+// contexts, and writes them to the shard file. The arithmetic is the same
+// as for a data set in memory, so the selection does not change.
+void DataSet::convertTADMDataSet(istream &iss, string const &shardPath,
+	size_t bufferSize)
+{
+	size_t nFeatureIds = 0;
+	unordered_set<size_t> dynFs;
+	double ctxSum = 0.0;
+	while (iss)
+	{
+		if (iss.peek() == EOF)
+			break;
+
+		Context context = readContext(iss);
+
+		FeatureValues const &vals = context.featureValues();
+		for (int i = 0; i < vals.outerSize(); ++i)
+			for (FeatureValues::InnerIterator fIter(vals, i); fIter; ++fIter)
+				if (static_cast<size_t>(fIter.index()) >= nFeatureIds)
+					nFeatureIds = fIter.index() + 1;
+
+		addDynamicFeatures(context, &dynFs);
+		ctxSum += context.eventProbs().sum();
+	}
+
+	iss.clear();
+	iss.seekg(0);
+	if (!iss)
+		throw runtime_error("Could not rewind the data set");
+
+	FeatureIds featureIds(dynFs.begin(), dynFs.end());
+	sort(featureIds.begin(), featureIds.end());
+
+	FeatureIdMap featureIdMap;
+	for (size_t i = 0; i < featureIds.size(); ++i)
+		featureIdMap[featureIds[i]] = i;
+
+	int nFeatures = featureIds.size();
+
+	ContextShardWriter writer(shardPath, nFeatures);
+	VectorXd expVals(VectorXd::Zero(nFeatures));
+	ValueDictionary dictionary;
+	bool dictionaryFull = false;
+	while (iss)
+	{
+		if (iss.peek() == EOF)
+			break;
+
+		Context context = readContext(iss);
+		numberFeatures(featureIdMap, nFeatures, &context);
+		context.prob(context.eventProbs().sum() / ctxSum);
+		context.normalizeEventProbs(ctxSum);
+
+		FeatureValues const &vals = context.featureValues();
+		for (int j = 0; j < vals.outerSize(); ++j)
+			for (FeatureValues::InnerIterator fIter(vals, j); fIter; ++fIter)
+			{
+				expVals[fIter.index()] += context.eventProbs()[j] * fIter.value();
+				if (!dictionaryFull && fIter.value() != 0.0 &&
+						!dictionary.add(fIter.value()))
+					dictionaryFull = true;
+			}
+
+		writer.add(context);
+	}
+
+	writer.finish(featureIds, nFeatureIds, expVals, dictionary, bufferSize);
+}
+
+DataSet DataSet::openShardedDataSet(string const &shardPath)
+{
+	return DataSet(shared_ptr<ContextShards const>(new ContextShards(shardPath)));
+}
+
+DataSet DataSet::openShardedDataSet(int fd, string const &name)
+{
+	return DataSet(shared_ptr<ContextShards const>(new ContextShards(fd, name)));
+}
+
+DataSet DataSet::readShards(string const &shardPath, size_t firstShard,
+	size_t lastShard)
+{
+	DataSet dataSet(openShardedDataSet(shardPath));
+	ContextShards const &shards = *dataSet.d_shards;
+
+	if (firstShard > lastShard || lastShard > shards.nShards())
+		throw invalid_argument("Invalid shard range");
+
+	dataSet.d_contexts.reserve(shards.shardBegin(lastShard) -
+		shards.shardBegin(firstShard));
+
+	ContextVector shardContexts;
+	for (size_t i = firstShard; i < lastShard; ++i)
+	{
+		shards.readShard(i, &shardContexts);
+		for (ContextVector::iterator ctxIter = shardContexts.begin();
+				ctxIter != shardContexts.end(); ++ctxIter)
+			dataSet.d_contexts.push_back(std::move(*ctxIter));
+		shards.release(i);
+	}
+
+	countNonZeros(dataSet.d_contexts, &dataSet.d_contextNonZeros);
+
+	// The per-feature data stays, the contexts are now in memory.
+	dataSet.d_shards.reset();
+	dataSet.d_nContexts = 0;
+	dataSet.d_contextProbs = 0;
+
+	return dataSet;
 }
 
 DataSet DataSet::readTADMDataSet(istream &iss)
@@ -270,38 +696,66 @@ DataSet DataSet::readTADMDataSet(istream &iss)
 		contexts.push_back(readContext(iss));
 	}
 	
-	return DataSet(contexts);
+	return DataSet(std::move(contexts));
 }
 
-// Remove all features that are not dynamic.
+// Remove all features that are not dynamic, and number the dynamic features
+// densely. Vectors that are indexed by feature then scale with the number of
+// dynamic features, rather than with the largest feature identifier.
 void DataSet::removeStaticFeatures()
 {
 	unordered_set<size_t> dynFs = dynamicFeatures();
 
-	for (ContextVector::iterator ctxIter = d_contexts.begin();
-		ctxIter != d_contexts.end(); ++ctxIter)
+	d_featureIds.assign(dynFs.begin(), dynFs.end());
+	sort(d_featureIds.begin(), d_featureIds.end());
+	
+	d_featureIdMap.clear();
+	for (size_t i = 0; i < d_featureIds.size(); ++i)
+		d_featureIdMap[d_featureIds[i]] = i;
+	
+	d_nFeatures = d_featureIds.size();
+
+	ContextScheduler scheduler(d_contextNonZeros);
+	#pragma omp parallel
 	{
-		FeatureValues const &origFeatureVals = ctxIter->featureValues();
-		FeatureValues featureVals(origFeatureVals.rows(),
-			origFeatureVals.cols());
+		ContextRange range;
+		while (scheduler.next(&range))
+			for (size_t i = range.begin; i < range.end; ++i)
+				numberFeatures(d_featureIdMap, d_nFeatures, &d_contexts[i]);
+	}
+}
+
+// Replace feature identifiers by internal feature numbers, dropping the
+// features that are not in the map.
+void DataSet::numberFeatures(FeatureIdMap const &featureIdMap, int nFeatures,
+	Context *context)
+{
+	FeatureValues const &origFeatureVals = context->featureValues();
+	FeatureValues featureVals(origFeatureVals.rows(), nFeatures);
 
-		for (int i = 0; i < origFeatureVals.outerSize(); ++i)
+	for (int i = 0; i < origFeatureVals.outerSize(); ++i)
+	{
+		for (FeatureValues::InnerIterator fIter(origFeatureVals, i);
+			fIter; ++fIter)
 		{
-			for (FeatureValues::InnerIterator fIter(origFeatureVals, i);
-				fIter; ++fIter)
-			{
-				if (dynFs.find(fIter.index()) != dynFs.end())
-					featureVals.coeffRef(i, fIter.index()) = fIter.value();
-			}
+			FeatureIdMap::const_iterator idIter =
+				featureIdMap.find(fIter.index());
+			if (idIter != featureIdMap.end())
+				featureVals.coeffRef(i, idIter->second) = fIter.value();
 		}
-		
-		ctxIter->featureValues(featureVals);
 	}
+	
+	context->featureValues(std::move(featureVals));
 }
 
 void DataSet::sumContexts()
 {
-	for (ContextVector::iterator ctxIter = d_contexts.begin();
-			ctxIter != d_contexts.end(); ++ctxIter)
-		ctxIter->prob(ctxIter->eventProbs().sum());
+	ContextScheduler scheduler(d_contextNonZeros);
+	#pragma omp parallel
+	{
+		ContextRange range;
+		while (scheduler.next(&range))
+			for (size_t i = range.begin; i < range.end; ++i)
+				d_contexts[i].prob(d_contexts[i].eventProbs().sum());
+	}
 }
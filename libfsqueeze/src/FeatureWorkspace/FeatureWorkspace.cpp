@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+#include "FeatureWorkspace.ih"
+
+// The arithmetic of this class follows zf, calcGain, adjustModel and the
+// gradient functions of the selection algorithms, with exp(alpha * f)
+// replaced by the cached factors. Contexts in which the feature does not
+// occur contribute exactly zero to all sums, so they are skipped. The
+// other contexts are scheduled by their number of occurrences. Their
+// contributions to gains and gradients are stored per context, and summed
+// afterwards in context order, so that they do not depend on the threads.
+
+namespace {
+
+// Factors of the occurrences of a feature, by occurrence index.
+class OccurrenceFactors
+{
+public:
+	OccurrenceFactors(vector<double> const &factors) : d_factors(&factors) {}
+	double operator()(size_t k) const { return (*d_factors)[k]; }
+private:
+	vector<double> const *d_factors;
+};
+
+class DictionaryOccurrenceFactors
+{
+public:
+	DictionaryOccurrenceFactors(vector<double> const &valueFactors,
+			FeatureOccurrence const *occurrences) :
+		d_valueFactors(&valueFactors), d_occurrences(occurrences) {}
+	double operator()(size_t k) const
+		{ return (*d_valueFactors)[d_occurrences[k].valueIndex]; }
+private:
+	vector<double> const *d_valueFactors;
+	FeatureOccurrence const *d_occurrences;
+};
+
+class IndicatorOccurrenceFactors
+{
+public:
+	IndicatorOccurrenceFactors(vector<double> const &valueFactors) :
+		d_factor(valueFactors[0]) {}
+	double operator()(size_t) const { return d_factor; }
+private:
+	double d_factor;
+};
+
+}
+
+FeatureWorkspace::FeatureWorkspace(DataSet const &dataSet,
+	FeatureOccurrence const *begin, FeatureOccurrence const *end,
+	size_t feature)
+: d_dataSet(&dataSet), d_begin(begin), d_end(end), d_feature(feature),
+	d_alpha(0.0)
+{
+	ValueDictionary const &dictionary = dataSet.valueDictionary();
+	
+	if (dictionary.empty())
+		d_factors.resize(end - begin, 1.0);
+	else
+		d_valueFactors.resize(dictionary.size(), 1.0);
+	
+	for (OccurrenceIter iter = begin; iter != end; ++iter)
+		if (iter == begin || iter->context != (iter - 1)->context)
+			d_contextOffsets.push_back(iter - begin);
+	d_contextOffsets.push_back(end - begin);
+}
+
+void FeatureWorkspace::alpha(double alpha)
+{
+	d_alpha = alpha;
+	
+	ValueDictionary const &dictionary = d_dataSet->valueDictionary();
+	if (!dictionary.empty())
+	{
+		dictionary.factors(alpha, d_valueFactors.data());
+		return;
+	}
+	
+	for (size_t k = 0; k < d_factors.size(); ++k)
+		d_factors[k] = exp(alpha * d_begin[k].value);
+}
+
+void FeatureWorkspace::adjustModel(Sums *sums, Zs *zs) const
+{
+	ValueDictionary const &dictionary = d_dataSet->valueDictionary();
+	if (dictionary.indicator())
+		adjustModel(IndicatorOccurrenceFactors(d_valueFactors), sums, zs);
+	else if (!dictionary.empty())
+		adjustModel(DictionaryOccurrenceFactors(d_valueFactors, d_begin),
+			sums, zs);
+	else
+		adjustModel(OccurrenceFactors(d_factors), sums, zs);
+}
+
+template <typename Factors>
+void FeatureWorkspace::adjustModel(Factors const &factors, Sums *sums,
+	Zs *zs) const
+{
+	ContextScheduler scheduler(d_contextOffsets);
+	#pragma omp parallel
+	{
+		LogFactors logFactors;
+		ContextRange range;
+		while (scheduler.next(&range))
+			for (size_t k = range.begin; k < range.end; ++k)
+			{
+				OccurrenceIter iter = contextBegin(k);
+				OccurrenceIter end = contextEnd(k);
+				size_t i = iter->context;
+				
+				logFactors.clear();
+				bool large = false;
+				for (OccurrenceIter occIter = iter; occIter != end; ++occIter)
+				{
+					logFactors.push_back(make_pair(occIter->event,
+						d_alpha * occIter->value));
+					if (fabs(d_alpha * occIter->value) > MAX_LOG_FACTOR)
+						large = true;
+				}
+				
+				if (large)
+					adjustContextLog(logFactors, &(*sums)[i], &(*zs)[i]);
+				else
+				{
+					double oldZ = (*zs)[i];
+					
+					for (OccurrenceIter occIter = iter; occIter != end; ++occIter)
+					{
+						size_t j = occIter->event;
+						(*zs)[i] -= (*sums)[i][j];
+						(*sums)[i][j] *= factors(occIter - d_begin);
+						(*zs)[i] += (*sums)[i][j];
+					}
+					
+					normalizeContext(oldZ, &(*sums)[i], &(*zs)[i]);
+				}
+			}
+	}
+}
+
+void FeatureWorkspace::subtractContextValues(vector<double> const &values,
+	bool deterministic, double *sum) const
+{
+	if (!deterministic)
+	{
+		for (size_t k = 0; k < values.size(); ++k)
+			*sum = *sum - values[k];
+		return;
+	}
+	
+	vector<double> blockSums(reductionBlocks(d_dataSet->nContexts()));
+	for (size_t k = 0; k < values.size(); ++k)
+		blockSums[contextBegin(k)->context / REDUCTION_BLOCK_SIZE] -= values[k];
+	
+	*sum += sumBlocks(blockSums);
+}
+
+double FeatureWorkspace::gain(Sums const &sums, Zs const &zs,
+	bool deterministic) const
+{
+	ValueDictionary const &dictionary = d_dataSet->valueDictionary();
+	if (dictionary.indicator())
+		return gain(IndicatorOccurrenceFactors(d_valueFactors), sums, zs,
+			deterministic);
+	else if (!dictionary.empty())
+		return gain(DictionaryOccurrenceFactors(d_valueFactors, d_begin),
+			sums, zs, deterministic);
+	else
+		return gain(OccurrenceFactors(d_factors), sums, zs, deterministic);
+}
+
+template <typename Factors>
+double FeatureWorkspace::gain(Factors const &factors, Sums const &sums,
+	Zs const &zs, bool deterministic) const
+{
+	vector<double> ctxGains(d_contextOffsets.size() - 1);
+	
+	ContextScheduler scheduler(d_contextOffsets);
+	#pragma omp parallel
+	{
+		ContextRange range;
+		while (scheduler.next(&range))
+			for (size_t k = range.begin; k < range.end; ++k)
+			{
+				OccurrenceIter iter = contextBegin(k);
+				OccurrenceIter end = contextEnd(k);
+				size_t i = iter->context;
+				
+				double z = newZ(factors, iter, end, sums[i], zs[i]);
+				ctxGains[k] = d_dataSet->contextProb(i) * (regularZ(z, zs[i]) ?
+					log(z / zs[i]) : shiftedLogZRatio(iter, end, sums[i], zs[i], 0));
+			}
+	}
+	
+	double gainSum = 0.0;
+	subtractContextValues(ctxGains, deterministic, &gainSum);
+	
+	return gainSum + d_alpha * d_dataSet->expFeatureValues()[d_feature];
+}
+
+void FeatureWorkspace::gradient(Sums const &sums, Zs const &zs, double *gp,
+	double *gpp, bool deterministic) const
+{
+	ValueDictionary const &dictionary = d_dataSet->valueDictionary();
+	if (dictionary.indicator())
+		gradient(IndicatorOccurrenceFactors(d_valueFactors), sums, zs, gp, gpp,
+			deterministic);
+	else if (!dictionary.empty())
+		gradient(DictionaryOccurrenceFactors(d_valueFactors, d_begin),
+			sums, zs, gp, gpp, deterministic);
+	else
+		gradient(OccurrenceFactors(d_factors), sums, zs, gp, gpp, deterministic);
+}
+
+template <typename Factors>
+void FeatureWorkspace::gradient(Factors const &factors, Sums const &sums,
+	Zs const &zs, double *gp, double *gpp, bool deterministic) const
+{
+	vector<double> ctxGps(d_contextOffsets.size() - 1);
+	vector<double> ctxGpps(d_contextOffsets.size() - 1);
+	
+	ContextScheduler scheduler(d_contextOffsets);
+	#pragma omp parallel
+	{
+		ContextRange range;
+		while (scheduler.next(&range))
+			for (size_t k = range.begin; k < range.end; ++k)
+			{
+				OccurrenceIter iter = contextBegin(k);
+				OccurrenceIter end = contextEnd(k);
+				size_t i = iter->context;
+				Sum const &ctxSums = sums[i];
+				
+				double z = newZ(factors, iter, end, ctxSums, zs[i]);
+				
+				double p_fx = 0.0;
+				double gppSum = 0.0;
+				if (!regularZ(z, zs[i]))
+					shiftedMoments(iter, end, ctxSums, zs[i], &p_fx, &gppSum);
+				else
+				{
+					OccurrenceIter occIter = iter;
+					for (int j = 0; j < ctxSums.size(); ++j)
+					{
+						double fVal = 0.0;
+						double newSum = ctxSums[j];
+						if (occIter != end && occIter->event == static_cast<size_t>(j))
+						{
+							fVal = occIter->value;
+							newSum *= factors(occIter - d_begin);
+							++occIter;
+						}
+						
+						p_fx += p_yx(newSum, z) * fVal;
+					}
+					
+					occIter = iter;
+					for (int j = 0; j < ctxSums.size(); ++j)
+					{
+						double fVal = 0.0;
+						double newSum = ctxSums[j];
+						if (occIter != end && occIter->event == static_cast<size_t>(j))
+						{
+							fVal = occIter->value;
+							newSum *= factors(occIter - d_begin);
+							++occIter;
+						}
+						
+						gppSum += p_yx(newSum, z) *
+							(pow(fVal, 2) - 2 * fVal * p_fx + pow(p_fx, 2));
+					}
+				}
+				
+				ctxGps[k] = d_dataSet->contextProb(i) * p_fx;
+				ctxGpps[k] = d_dataSet->contextProb(i) * gppSum;
+			}
+	}
+	
+	subtractContextValues(ctxGps, deterministic, gp);
+	subtractContextValues(ctxGpps, deterministic, gpp);
+}
+
+template <typename Factors>
+double FeatureWorkspace::newZ(Factors const &factors, OccurrenceIter begin,
+	OccurrenceIter end, Sum const &ctxSums, double z) const
+{
+	for (OccurrenceIter iter = begin; iter != end; ++iter)
+		z = z - ctxSums[iter->event] + ctxSums[iter->event] *
+			factors(iter - d_begin);
+	
+	return z;
+}
+
+double FeatureWorkspace::shiftedLogZRatio(OccurrenceIter begin,
+	OccurrenceIter end, Sum const &ctxSums, double z,
+	Eigen::VectorXd *probs) const
+{
+	LogFactors logFactors;
+	for (OccurrenceIter iter = begin; iter != end; ++iter)
+		logFactors.push_back(make_pair(static_cast<size_t>(iter->event),
+			d_alpha * iter->value));
+	
+	return fsqueeze::shiftedLogZRatio(logFactors, ctxSums, z, probs);
+}
+
+void FeatureWorkspace::shiftedMoments(OccurrenceIter begin,
+	OccurrenceIter end, Sum const &ctxSums, double z, double *p_fx,
+	double *gppSum) const
+{
+	Eigen::VectorXd probs;
+	shiftedLogZRatio(begin, end, ctxSums, z, &probs);
+	
+	Eigen::VectorXd fVals = Eigen::VectorXd::Zero(ctxSums.size());
+	for (OccurrenceIter iter = begin; iter != end; ++iter)
+		fVals[iter->event] = iter->value;
+	
+	*p_fx = probs.dot(fVals);
+	
+	*gppSum = 0.0;
+	for (int j = 0; j < ctxSums.size(); ++j)
+		*gppSum += probs[j] *
+			(pow(fVals[j], 2) - 2 * fVals[j] * *p_fx + pow(*p_fx, 2));
+}
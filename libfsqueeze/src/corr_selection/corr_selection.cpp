@@ -99,6 +99,10 @@ VectorXd featureCorrelations(DataSet const &ds, VectorXd const &avgs, VectorXd c
 SelectedFeatureAlphas fsqueeze::corrFeatureSelection(DataSet const &ds, Logger logger,
 	double minCorrelation, size_t nFeatures)
 {
+	// Every correlation is a pass over the data.
+	if (ds.outOfCore())
+		throw runtime_error("Correlation selection is not supported for out-of-core data sets");
+
 	FeatureChangeFreqs changeFreqs = ds.dynamicFeatureFreqs();
 	VectorXd avgs = calcAverages(ds);
 	
@@ -128,7 +132,7 @@ SelectedFeatureAlphas fsqueeze::corrFeatureSelection(DataSet const &ds, Logger l
 		if (overlapping)
 			continue;
 
-		logger.message() << iter->first << "\t" << iter->second <<
+		logger.message() << ds.featureId(iter->first) << "\t" << iter->second <<
 			"\t" << iter->second << "\n";
 		selectedFeatures.insert(iter->first);
 
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+#include "execution.ih"
+
+namespace {
+
+// CPUs that this process may run on, ordered by NUMA node. Consecutive
+// threads get consecutive CPUs, so that the static partitions of adjacent
+// threads (which are adjacent ranges of contexts) are on the same node.
+vector<int> allowedCpus()
+{
+	vector<pair<int, int> > nodeCpus;
+
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		throw runtime_error("Could not retrieve the CPU affinity of the process");
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+	{
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+
+		int node = 0;
+#ifdef HAVE_NUMA_H
+		if (numa_available() >= 0)
+			node = numa_node_of_cpu(cpu);
+#endif
+		nodeCpus.push_back(make_pair(node, cpu));
+	}
+#endif
+
+	sort(nodeCpus.begin(), nodeCpus.end());
+
+	vector<int> cpus;
+	for (vector<pair<int, int> >::const_iterator iter = nodeCpus.begin();
+			iter != nodeCpus.end(); ++iter)
+		cpus.push_back(iter->second);
+
+	return cpus;
+}
+
+void pinThreads()
+{
+#if defined(__linux__) && defined(_OPENMP)
+	vector<int> cpus = allowedCpus();
+	if (cpus.size() == 0)
+		return;
+
+	#pragma omp parallel
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+#else
+	throw runtime_error("Thread pinning is not supported by this build");
+#endif
+}
+
+// The memory policy is a per-thread property, so it is set in the calling
+// thread and in every thread of the OpenMP team.
+void setMemoryPolicy(NumaPlacement placement)
+{
+#ifdef HAVE_NUMA_H
+	if (numa_available() < 0)
+	{
+		if (placement == NUMA_INTERLEAVE)
+			throw runtime_error("NUMA is not available on this system");
+		return;
+	}
+
+	if (placement == NUMA_INTERLEAVE)
+		numa_set_interleave_mask(numa_all_nodes_ptr);
+	else
+		numa_set_localalloc();
+
+	#pragma omp parallel
+	{
+		if (placement == NUMA_INTERLEAVE)
+			numa_set_interleave_mask(numa_all_nodes_ptr);
+		else
+			numa_set_localalloc();
+	}
+#else
+	// First-touch placement is the default policy of most operating systems.
+	if (placement == NUMA_INTERLEAVE)
+		throw runtime_error("NUMA interleaving is not supported by this build");
+#endif
+}
+
+}
+
+void fsqueeze::applyExecutionConfig(ExecutionConfig const &config)
+{
+#ifdef _OPENMP
+	if (config.nThreads != 0)
+		omp_set_num_threads(static_cast<int>(config.nThreads));
+#else
+	if (config.nThreads > 1)
+		throw runtime_error("This build does not support multiple threads");
+#endif
+
+	if (config.pinThreads)
+		pinThreads();
+
+	setHugePagePolicy(config.hugePages);
+
+	if (config.numaPlacement != NUMA_DEFAULT)
+		setMemoryPolicy(config.numaPlacement);
+}
+
+int fsqueeze::executionThreads()
+{
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+void fsqueeze::placeDataSet(ExecutionConfig const &config, DataSet *dataSet)
+{
+	if (config.numaPlacement == NUMA_PARTITION)
+		dataSet->placeContexts();
+}
+
+NumaPlacement fsqueeze::parseNumaPlacement(string const &placement)
+{
+	if (placement == "default")
+		return NUMA_DEFAULT;
+	else if (placement == "interleave")
+		return NUMA_INTERLEAVE;
+	else if (placement == "partition")
+		return NUMA_PARTITION;
+
+	throw invalid_argument("Unknown NUMA placement: " + placement);
+}
@@ -25,7 +25,7 @@ R_f r_f(int nFeatures,
   ExpectedValues const &expFeatureValues,
   ExpectedValues const &expModelFeatureValues)
 {
-  R_f r = R_f::Zero(nFeatures);
+  R_f r = hugePageZero<R_f>(nFeatures);
   
   for (FeatureSet::const_iterator iter = features.begin(); iter != features.end(); ++iter)
   	r[*iter] = expFeatureValues[*iter] <=
@@ -41,120 +41,371 @@ double r_f(size_t feature, ExpectedValues const &expFeatureValues,
   	1 : -1;
 }
 
+// Contribution of a context to G' and G'' of a feature, for a trial weight
+// whose factors take the sums out of range. The probabilities come from
+// shifted log-sums.
+void shiftedContextGradient(Context const &context,
+  Sum const &sums,
+  double z,
+  size_t feature,
+  double alpha,
+  double *gp,
+  double *gpp)
+{
+  FeatureValues const &featureVals = context.featureValues();
+  int nEvents = featureVals.outerSize();
+  
+  LogFactors logFactors;
+  featureLogFactors(featureVals, feature, alpha, &logFactors);
+  Eigen::VectorXd probs;
+  shiftedLogZRatio(logFactors, sums, z, &probs);
+  
+  double p_fx = 0.0;
+  for (int j = 0; j < nEvents; ++j)
+  	p_fx += probs[j] * featureVals.coeff(j, feature);
+  
+  double gppSum = 0.0;
+  for (int j = 0; j < nEvents; ++j)
+  {
+  	double fVal = featureVals.coeff(j, feature);
+  	gppSum += probs[j] * (pow(fVal, 2) - 2 * fVal * p_fx + pow(p_fx, 2));
+  }
+  
+  *gp = context.prob() * p_fx;
+  *gpp = context.prob() * gppSum;
+}
+
+// Contribution of a context with at most MaxEvents events to G' and G'' of
+// a feature, where factor(f) gives exp(alpha * f). The updated sums and
+// the feature values are kept on the stack, unless MaxEvents is dynamic.
+template <int MaxEvents, typename Factor>
+void contextGradientKernel(Context const &context,
+  Sum const &sums,
+  double z,
+  size_t feature,
+  double alpha,
+  Factor const &factor,
+  double *gp,
+  double *gpp)
+{
+  FeatureValues const &featureVals = context.featureValues();
+  int nEvents = featureVals.outerSize();
+  
+  EventVector<StorageScalar, MaxEvents> newSums(nEvents);
+  EventVector<double, MaxEvents> fVals(nEvents);
+  
+  // Z(x) is updated in the same order as zf().
+  double newZ = z;
+  for (int j = 0; j < nEvents; ++j)
+  {
+  	double fVal = featureVals.coeff(j, feature);
+  	fVals[j] = fVal;
+  	newSums[j] = sums[j];
+  	
+  	if (fVal != 0.0)
+  	{
+  		double f = factor(fVal);
+  		newZ = newZ - sums[j] + sums[j] * f;
+  		newSums[j] = sums[j] * f;
+  	}
+  }
+  
+  if (!regularZ(newZ, z))
+  {
+  	shiftedContextGradient(context, sums, z, feature, alpha, gp, gpp);
+  	return;
+  }
+  
+  double p_fx = 0.0;
+  for (int j = 0; j < nEvents; ++j)
+  	p_fx += p_yx(newSums[j], newZ) * fVals[j];
+  
+  double gppSum = 0.0;
+  for (int j = 0; j < nEvents; ++j)
+  	gppSum += p_yx(newSums[j], newZ) *
+  		(pow(fVals[j], 2) - 2 * fVals[j] * p_fx + pow(p_fx, 2));
+  
+  *gp = context.prob() * p_fx;
+  *gpp = context.prob() * gppSum;
+}
+
+// Contribution of a context to G' and G'' of a feature, where factor(f)
+// gives exp(alpha * f).
+template <typename Factor>
+void contextGradient(Context const &context,
+  Sum const &sums,
+  double z,
+  size_t feature,
+  double alpha,
+  Factor const &factor,
+  double *gp,
+  double *gpp)
+{
+  int nEvents = context.featureValues().outerSize();
+  
+  if (nEvents <= 4)
+  	contextGradientKernel<4>(context, sums, z, feature, alpha, factor, gp,
+  		gpp);
+  else if (nEvents <= 8)
+  	contextGradientKernel<8>(context, sums, z, feature, alpha, factor, gp,
+  		gpp);
+  else if (nEvents <= SMALL_CONTEXT_SIZE)
+  	contextGradientKernel<SMALL_CONTEXT_SIZE>(context, sums, z, feature,
+  		alpha, factor, gp, gpp);
+  else
+  	contextGradientKernel<Eigen::Dynamic>(context, sums, z, feature, alpha,
+  		factor, gp, gpp);
+}
+
+// Contribution of a context to G' and G'' of a feature. If the feature is
+// an indicator feature, factor points to exp(alpha).
+void contextGradient(Context const &context,
+  Sum const &sums,
+  double z,
+  size_t feature,
+  double alpha,
+  double const *factor,
+  double *gp,
+  double *gpp)
+{
+  if (factor != 0)
+  	contextGradient(context, sums, z, feature, alpha, IndicatorFactor(factor),
+  		gp, gpp);
+  else
+  	contextGradient(context, sums, z, feature, alpha, ExpFactor(alpha), gp,
+  		gpp);
+}
+
 void updateGradient(DataSet const &dataSet,
   size_t feature,
   Sums const &sums,
   Zs const &zs,
   double alpha,
   double *gp,
-  double *gpp)
+  double *gpp,
+  bool deterministic)
 {
-  ContextVector const &contexts = dataSet.contexts();
+  double factor = exp(alpha);
+  double const *indicator = dataSet.valueDictionary().indicator() ?
+  	&factor : 0;
+  
+  // Shards start at block boundaries, so the blocks of a shard are blocks
+  // of the data set.
+  size_t nBlocks = deterministic ? reductionBlocks(dataSet.nContexts()) : 0;
+  vector<double> blockGps(nBlocks);
+  vector<double> blockGpps(nBlocks);
   
-  #pragma omp parallel for
-  for (int i = 0; i < static_cast<int>(contexts.size()); ++i)
+  for (ShardCursor shard(dataSet); shard.next(); )
   {
-  	FeatureValues const &featureVals = contexts[i].featureValues();
-  	
-  	double newZ = zf(featureVals, sums[i], zs[i], feature, alpha);
-  	
-  	Sum newSums(sums[i]);
-  	double p_fx = 0.0;
-  	for (int j = 0; j < featureVals.outerSize(); ++j)
+  	ContextVector const &contexts = shard.contexts();
+  	size_t offset = shard.offset();
+  
+  	if (deterministic)
   	{
-  		double fVal = featureVals.coeff(j, feature);
-  		newSums[j] *= exp(alpha * fVal);
-  		p_fx += p_yx(newSums[j], newZ) * fVal;
+  		// The gradients of contexts are computed separately, so that large
+  		// contexts in one block can go to different threads, and are added
+  		// up per block in context order.
+  		vector<double> ctxGps(contexts.size());
+  		vector<double> ctxGpps(contexts.size());
+  		ContextScheduler scheduler(shard);
+  		#pragma omp parallel
+  		{
+  			ContextRange range;
+  			while (scheduler.next(&range))
+  				for (size_t k = range.begin; k < range.end; ++k)
+  					contextGradient(contexts[k], sums[offset + k], zs[offset + k],
+  						feature, alpha, indicator, &ctxGps[k], &ctxGpps[k]);
+  		}
+  
+  		size_t firstBlock = offset / REDUCTION_BLOCK_SIZE;
+  		for (size_t b = 0; b < reductionBlocks(contexts.size()); ++b)
+  		{
+  			double blockGp = 0.0;
+  			double blockGpp = 0.0;
+  			for (size_t k = reductionBlockBegin(b);
+  					k < reductionBlockEnd(b, contexts.size()); ++k)
+  			{
+  				blockGp -= ctxGps[k];
+  				blockGpp -= ctxGpps[k];
+  			}
+  			
+  			blockGps[firstBlock + b] = blockGp;
+  			blockGpps[firstBlock + b] = blockGpp;
+  		}
+  
+  		continue;
   	}
-  	
-  	double gppSum = 0.0;
-  	for (int j = 0; j < featureVals.outerSize(); ++j)
+  
+  	ContextScheduler scheduler(shard);
+  	#pragma omp parallel
   	{
-  		double fVal = featureVals.coeff(j, feature);
-  		gppSum += p_yx(newSums[j], newZ) * (pow(fVal, 2) - 2 * fVal * p_fx + pow(p_fx, 2));
+  		ContextRange range;
+  		while (scheduler.next(&range))
+  			for (size_t k = range.begin; k < range.end; ++k)
+  			{
+  				double ctxGp, ctxGpp;
+  				contextGradient(contexts[k], sums[offset + k], zs[offset + k],
+  					feature, alpha, indicator, &ctxGp, &ctxGpp);
+  
+  				#pragma omp critical
+  				{		
+  					*gp = *gp - ctxGp;
+  					*gpp = *gpp - ctxGpp;
+  				}
+  			}
   	}
+  }
+  
+  if (deterministic)
+  {
+  	*gp += sumBlocks(blockGps);
+  	*gpp += sumBlocks(blockGpps);
+  }
+}
 
-  	#pragma omp critical
-  	{		
-  		*gp = *gp - contexts[i].prob() * p_fx;
-  		*gpp = *gpp - contexts[i].prob() * gppSum;
+// The partial gradients of a block are a map, so a block is not split over
+// threads.
+vector<BlockGradients> fsqueeze::blockGradients(DataSet const &dataSet,
+  FeatureSet const &unconvergedFeatures,
+  ContextActiveFeatures const &contextActiveFeatures,
+  Sums const &sums,
+  Zs const &zs,
+  FeatureWeights const &alphas)
+{
+  IndicatorFactors factors = indicatorFactors(dataSet, alphas,
+  	unconvergedFeatures);
+  
+  vector<BlockGradients> blockGrads(reductionBlocks(dataSet.nContexts()));
+  
+  vector<FeatureSet> buffer;
+  for (ShardCursor shard(dataSet); shard.next(); )
+  {
+  	ContextVector const &contexts = shard.contexts();
+  	size_t offset = shard.offset();
+  	vector<FeatureSet> const &activeFeatures =
+  		contextActiveFeatures.shard(shard, &buffer);
+  	size_t firstBlock = offset / REDUCTION_BLOCK_SIZE;
+  
+  	ContextScheduler scheduler(shard, REDUCTION_BLOCK_SIZE);
+  	#pragma omp parallel
+  	{
+  		ContextRange range;
+  		while (scheduler.next(&range))
+  			for (size_t k = range.begin; k < range.end; ++k)
+  				for (FeatureSet::const_iterator fsIter = activeFeatures[k].begin();
+  					fsIter != activeFeatures[k].end(); ++fsIter)
+  				{
+  					if (unconvergedFeatures.find(*fsIter) == unconvergedFeatures.end())
+  						continue;
+  
+  					double ctxGp, ctxGpp;
+  					contextGradient(contexts[k], sums[offset + k], zs[offset + k],
+  						*fsIter, alphas[*fsIter], indicatorFactor(factors, *fsIter),
+  						&ctxGp, &ctxGpp);
+  
+  					pair<double, double> &blockGradient =
+  						blockGrads[firstBlock + k / REDUCTION_BLOCK_SIZE][*fsIter];
+  					blockGradient.first -= ctxGp;
+  					blockGradient.second -= ctxGpp;
+  				}
   	}
   }
+  
+  return blockGrads;
 }
 
-void updateGradients(DataSet const &dataSet,
+void fsqueeze::updateGradients(DataSet const &dataSet,
   FeatureSet const &unconvergedFeatures,
-  vector<FeatureSet> const &activeFeatures,
+  ContextActiveFeatures const &contextActiveFeatures,
   Sums const &sums,
   Zs const &zs,
   FeatureWeights const &alphas,
   Gp *gp,
-  Gpp *gpp)
+  Gpp *gpp,
+  bool deterministic)
 {
-  ContextVector const &contexts = dataSet.contexts();
-  
-  #pragma omp parallel for
-  for (int i = 0; i < static_cast<int>(contexts.size()); ++i)
+  if (deterministic)
   {
-  	for (FeatureSet::const_iterator fsIter = activeFeatures[i].begin();
-  		fsIter != activeFeatures[i].end(); ++fsIter)
-  	{
-  		if (unconvergedFeatures.find(*fsIter) == unconvergedFeatures.end())
-  			continue;
-
-  		FeatureValues const &featureVals = contexts[i].featureValues();
-
-  		double newZ = zf(featureVals, sums[i], zs[i], *fsIter,
-  			alphas[*fsIter]);
-  		
-  		Sum newSums(sums[i]);
-  		double p_fx = 0.0;
-  		for (int j = 0; j < featureVals.outerSize(); ++j)
-  		{
-  			double fVal = featureVals.coeff(j, *fsIter);
-  			
-  			if (fVal != 0.0)
-  				newSums[j] *= exp(alphas[*fsIter] * fVal);
-
-  			p_fx += p_yx(newSums[j], newZ) * fVal;
-  		}
-  		
-  		double gppSum = 0.0;	
-  		for (int j = 0; j < featureVals.outerSize(); ++j)
+  	vector<BlockGradients> blockGrads = blockGradients(dataSet,
+  		unconvergedFeatures, contextActiveFeatures, sums, zs, alphas);
+  	for (vector<BlockGradients>::const_iterator blockIter = blockGrads.begin();
+  			blockIter != blockGrads.end(); ++blockIter)
+  		for (BlockGradients::const_iterator iter = blockIter->begin();
+  				iter != blockIter->end(); ++iter)
   		{
-  			double fVal = featureVals.coeff(j, *fsIter);
-  			gppSum += p_yx(newSums[j], newZ) * (pow(fVal, 2) - 2 * fVal * p_fx + pow(p_fx, 2));
-  		}
-  		
-  		#pragma omp critical
-  		{
-  			(*gp)[*fsIter] = (*gp)[*fsIter] - contexts[i].prob() * p_fx;
-  			(*gpp)[*fsIter] = (*gpp)[*fsIter] - contexts[i].prob() * gppSum;
+  			(*gp)[iter->first] += iter->second.first;
+  			(*gpp)[iter->first] += iter->second.second;
   		}
+  
+  	return;
+  }
+  
+  IndicatorFactors factors = indicatorFactors(dataSet, alphas,
+  	unconvergedFeatures);
+  
+  vector<FeatureSet> buffer;
+  for (ShardCursor shard(dataSet); shard.next(); )
+  {
+  	ContextVector const &contexts = shard.contexts();
+  	size_t offset = shard.offset();
+  	vector<FeatureSet> const &activeFeatures =
+  		contextActiveFeatures.shard(shard, &buffer);
+  
+  	ContextScheduler scheduler(shard);
+  	#pragma omp parallel
+  	{
+  		ContextRange range;
+  		while (scheduler.next(&range))
+  			for (size_t k = range.begin; k < range.end; ++k)
+  				for (FeatureSet::const_iterator fsIter = activeFeatures[k].begin();
+  					fsIter != activeFeatures[k].end(); ++fsIter)
+  				{
+  					if (unconvergedFeatures.find(*fsIter) == unconvergedFeatures.end())
+  						continue;
+  
+  					double ctxGp, ctxGpp;
+  					contextGradient(contexts[k], sums[offset + k], zs[offset + k],
+  						*fsIter, alphas[*fsIter], indicatorFactor(factors, *fsIter),
+  						&ctxGp, &ctxGpp);
+  					
+  					#pragma omp critical
+  					{
+  						(*gp)[*fsIter] = (*gp)[*fsIter] - ctxGp;
+  						(*gpp)[*fsIter] = (*gpp)[*fsIter] - ctxGpp;
+  					}
+  				}
   	}
   }
 }
 
-// Calculate weight of a single feature for the current model, given G', G'' and R(f).
-// Returns true if the feature has converged.
-bool updateAlpha(double rF, double gp, double gpp, double *alpha,
-  double alphaThreshold)
+// Calculate weight of a single feature for the current model, given G', G'',
+// R(f) and the empirical expectation of the feature. Returns true if the
+// feature has converged, which it also has when G' vanished to its rounding
+// error. A step that is not finite is not taken.
+bool updateAlpha(double rF, double gp, double gpp, double expValue,
+  double *alpha, double alphaThreshold)
 {
   double newAlpha = *alpha + rF * log(1 - rF * (gp / gpp));
+  if (!isfinite(newAlpha))
+  	return true;
+
   double delta = fabs(*alpha - newAlpha);
   *alpha = newAlpha;
   
-  if (delta < alphaThreshold || isnan(delta))
+  if (delta < max(alphaThreshold, MIN_ALPHA_THRESHOLD) ||
+  		fabs(gp) <= MIN_RELATIVE_GRADIENT * fabs(expValue))
   	return true;
   else
   	return false;
 }
 
-// Calculate feature weights for the current model, given G', G'' and R(f).
+// Calculate feature weights for the current model, given G', G'', R(f) and
+// the empirical expectations of the features.
 FeatureSet updateAlphas(FeatureSet const &unconvergedFeatures,
   R_f const &r,
   Gp const &gp,
   Gpp const &gpp,
+  ExpectedValues const &expFeatureValues,
   FeatureWeights *alphas,
   double alphaThreshold)
 {
@@ -163,12 +414,8 @@ FeatureSet updateAlphas(FeatureSet const &unconvergedFeatures,
   	fIter != unconvergedFeatures.end(); ++fIter)
   {
   	int f = *fIter;
-  	double rF = r[f];
-  	double oldAlpha = (*alphas)[f];
-  	double newAlpha = oldAlpha + rF * log(1 - rF * (gp[f] / gpp[f]));
-  	double delta = fabs(oldAlpha - newAlpha);
-  	(*alphas)[f] = newAlpha;
-  	if (delta < alphaThreshold || isnan(delta))
+  	if (updateAlpha(r[f], gp[f], gpp[f], expFeatureValues[f], &(*alphas)[f],
+  			alphaThreshold))
   		newUnconvergedFs.erase(f);
   }
   
@@ -178,7 +425,7 @@ FeatureSet updateAlphas(FeatureSet const &unconvergedFeatures,
 // Initial feature weights (0.0).
 FeatureWeights a_f(size_t nFeatures)
 {
-  return FeatureWeights::Zero(nFeatures);		
+  return hugePageZero<FeatureWeights>(nFeatures);
 }
 
 // Hmpf...
@@ -257,67 +504,504 @@ OrderedGains findOverlappingFeatures(OrderedGains const &prevGains,
   return overlappingFs;
 }
 
-OrderedGains fullSelectionStage(DataSet const &dataSet,
-  double alphaThreshold,
+// Estimate the weight of a single feature, keeping the other weights fixed.
+double estimateAlpha(DataSet const &dataSet,
+  SelectionParameters const &param,
+  ExpectedValues const &expModelVals,
+  size_t feature,
+  Sums const &sums,
+  Zs const &zs)
+{
+  double a = 0.0;
+  double r = r_f(feature, dataSet.expFeatureValues(), expModelVals);
+
+  bool converged = false;
+  while (!converged)
+  {
+  	double gp = dataSet.expFeatureValues()[feature];
+  	double gpp = 0.0;
+  	
+  	updateGradient(dataSet, feature, sums, zs, a, &gp, &gpp,
+  		param.deterministic);
+  	converged = updateAlpha(r, gp, gpp, dataSet.expFeatureValues()[feature],
+  		&a, param.alphaThreshold);
+  }
+  
+  return a;
+}
+
+// Estimate the weight of a single feature, using a workspace. On return,
+// the workspace holds the factors for the estimated weight.
+double estimateAlpha(DataSet const &dataSet,
+  SelectionParameters const &param,
+  ExpectedValues const &expModelVals,
+  Sums const &sums,
+  Zs const &zs,
+  FeatureWorkspace *workspace)
+{
+  size_t feature = workspace->feature();
+  double a = 0.0;
+  double r = r_f(feature, dataSet.expFeatureValues(), expModelVals);
+
+  workspace->alpha(a);
+
+  bool converged = false;
+  while (!converged)
+  {
+  	double gp = dataSet.expFeatureValues()[feature];
+  	double gpp = 0.0;
+  	
+  	workspace->gradient(sums, zs, &gp, &gpp, param.deterministic);
+  	converged = updateAlpha(r, gp, gpp, dataSet.expFeatureValues()[feature],
+  		&a, param.alphaThreshold);
+  	workspace->alpha(a);
+  }
+  
+  return a;
+}
+
+// Internal numbers of the features that the user excludes. Static and
+// unknown features are never candidates, so they are skipped.
+FeatureSet excludedFeatures(DataSet const &dataSet,
+  SelectionParameters const &param)
+{
+  FeatureSet excludedFs;
+  for (vector<size_t>::const_iterator fIter = param.excludedFeatures.begin();
+  	fIter != param.excludedFeatures.end(); ++fIter)
+  {
+  	int feature = dataSet.internalFeature(*fIter);
+  	if (feature != -1)
+  		excludedFs.insert(feature);
+  }
+  
+  return excludedFs;
+}
+
+// Log a selected feature, using its identifier in the data.
+void logSelected(DataSet const &dataSet, Logger logger,
+  Triple<size_t, double, double> const &selected)
+{
+  logger.message() << dataSet.featureId(selected.first) << "\t" <<
+  	selected.second << "\t" << selected.third << "\n";
+}
+
+// Translate selected features to their identifiers in the data.
+SelectedFeatureAlphas featureIds(DataSet const &dataSet,
+  SelectedFeatureAlphas selectedFeatureAlphas)
+{
+  for (SelectedFeatureAlphas::iterator iter = selectedFeatureAlphas.begin();
+  	iter != selectedFeatureAlphas.end(); ++iter)
+  	iter->first = dataSet.featureId(iter->first);
+  
+  return selectedFeatureAlphas;
+}
+
+// Estimate the weights of the given features with Newton steps.
+void estimateAlphas(DataSet const &dataSet,
+  SelectionModel *model,
+  SelectionParameters const &param,
+  R_f const &r,
+  FeatureSet unconvergedFs,
+  FeatureWeights *a)
+{
+  while (unconvergedFs.size() != 0)
+  {
+  	Gp gp = hugePageCopy(dataSet.expFeatureValues());
+  	Gpp gpp = a_f(dataSet.nFeatures());
+  
+  	model->gradients(unconvergedFs, *a, param.deterministic, &gp, &gpp);
+  	unconvergedFs = updateAlphas(unconvergedFs, r, gp, gpp,
+  		dataSet.expFeatureValues(), a, param.alphaThreshold);
+  }
+}
+
+// Add the features that the user forces into the model.
+void forceFeatures(DataSet const &dataSet,
+  SelectionModel *model,
+  Logger logger,
+  SelectionParameters const &param,
+  FeatureSet *selectedFeatures,
+  SelectedFeatureAlphas *selectedFeatureAlphas)
+{
+  for (vector<size_t>::const_iterator fIter = param.forcedFeatures.begin();
+  	fIter != param.forcedFeatures.end(); ++fIter)
+  {
+  	int internal = dataSet.internalFeature(*fIter);
+  	if (internal == -1)
+  	{
+  		ostringstream msg;
+  		msg << "Cannot force a static or unknown feature: " << *fIter;
+  		throw runtime_error(msg.str());
+  	}
+  	
+  	size_t feature = internal;
+  	
+  	if (selectedFeatures->find(feature) != selectedFeatures->end())
+  		continue;
+
+  	ExpectedValues expModelVals =
+  		model->expModelFeatureValues(param.deterministic);
+  	model->startStage(*selectedFeatures);
+
+  	FeatureSet forcedFs;
+  	forcedFs.insert(feature);
+  	FeatureWeights a = a_f(dataSet.nFeatures());
+  	estimateAlphas(dataSet, model, param, r_f(dataSet.nFeatures(), forcedFs,
+  		dataSet.expFeatureValues(), expModelVals), forcedFs, &a);
+  	double gain = model->gains(a, &forcedFs,
+  		param.deterministic).begin()->second;
+  	
+  	model->adjust(feature, a[feature]);
+  	selectedFeatures->insert(feature);
+  	selectedFeatureAlphas->push_back(makeTriple(feature, a[feature], gain));
+  	
+  	logSelected(dataSet, logger, selectedFeatureAlphas->back());
+  }
+}
+
+// Add the next-best features of a stage, after the best feature was added.
+// A feature is only added when the fraction of its contexts that are shared
+// with features of the batch does not exceed the batch overlap. The weights
+// of features in disjoint contexts are independent, so their alphas and
+// gains stay exact. Features that share contexts with the batch are
+// re-estimated against the updated model before they are added.
+void addFeatureBatch(DataSet const &dataSet,
+  SelectionParameters const &param,
+  vector<FeatureSet> const &ctxActiveFs,
+  OrderedGains const &gains,
+  FeatureWeights const &alphas,
   Sums *sums,
   Zs *zs,
   FeatureSet *selectedFeatures,
   SelectedFeatureAlphas *selectedFeatureAlphas)
 {
-  ExpectedValues expModelVals = expModelFeatureValues(dataSet, *sums, *zs);
+  if (selectedFeatures->size() >= param.nFeatures)
+  	return;
+  
+  size_t batchSize = min(param.batchSize,
+  	param.nFeatures - selectedFeatures->size() + 1);
+  
+  // Contexts in which each feature is active.
+  vector<vector<size_t> > featureContexts(dataSet.nFeatures());
+  for (size_t i = 0; i < ctxActiveFs.size(); ++i)
+  	for (FeatureSet::const_iterator fIter = ctxActiveFs[i].begin();
+  			fIter != ctxActiveFs[i].end(); ++fIter)
+  		featureContexts[*fIter].push_back(i);
+  
+  vector<bool> usedContexts(ctxActiveFs.size(), false);
+  size_t maxF = gains.begin()->first;
+  for (vector<size_t>::const_iterator ctxIter = featureContexts[maxF].begin();
+  		ctxIter != featureContexts[maxF].end(); ++ctxIter)
+  	usedContexts[*ctxIter] = true;
+  
+  size_t nAdded = 1;
+  OrderedGains::const_iterator gainIter = gains.begin();
+  for (++gainIter; gainIter != gains.end() && nAdded < batchSize; ++gainIter)
+  {
+  	size_t f = gainIter->first;
+  	double gain = gainIter->second;
+  	
+  	if (isnan(gain) || gain < param.gainThreshold)
+  		break;
+  	
+  	vector<size_t> const &fContexts = featureContexts[f];
+  	if (fContexts.size() == 0)
+  		continue;
+  	
+  	size_t nOverlap = 0;
+  	for (vector<size_t>::const_iterator ctxIter = fContexts.begin();
+  			ctxIter != fContexts.end(); ++ctxIter)
+  		if (usedContexts[*ctxIter])
+  			++nOverlap;
+  	
+  	if (nOverlap > param.batchOverlap * fContexts.size())
+  		continue;
+  	
+  	double alpha = alphas[f];
+  	if (nOverlap != 0)
+  	{
+  		ExpectedValues expModelVals = expModelFeatureValues(dataSet, *sums, *zs,
+  			param.deterministic);
+  		alpha = estimateAlpha(dataSet, param, expModelVals, f, *sums, *zs);
+  		gain = calcGain(dataSet, *sums, *zs, f, alpha, param.deterministic);
+  		
+  		if (isnan(gain) || gain < param.gainThreshold)
+  			continue;
+  	}
+  	
+  	adjustModel(dataSet, f, alpha, sums, zs);
+  	selectedFeatures->insert(f);
+  	selectedFeatureAlphas->push_back(makeTriple(f, alpha, gain));
+  	
+  	for (vector<size_t>::const_iterator ctxIter = fContexts.begin();
+  			ctxIter != fContexts.end(); ++ctxIter)
+  		usedContexts[*ctxIter] = true;
+  	
+  	++nAdded;
+  }
+}
+
+// Check whether full optimization is due after the model grew from
+// prevCount to count features.
+bool optimizationDue(SelectionParameters const &param, size_t prevCount,
+  size_t count)
+{
+  for (size_t n = prevCount + 1; n <= count; ++n)
+  {
+    if (param.fullOptimizationExpBase != 0.0) {
+      double fl = log(static_cast<double>(n)) /
+        log(param.fullOptimizationExpBase);
+      if (round(fl) == fl)
+        return true;
+    } else if (param.fullOptimizationCycles != 0 &&
+    			n % param.fullOptimizationCycles == 0)
+      return true;
+  }
+  
+  return false;
+}
+
+// Candidates in index order, with their running occurrence counts, so
+// that the feature-parallel loops can be scheduled like context loops.
+void scheduleFeatures(FeatureOccurrences const &occurrences,
+  FeatureSet const &candidates, vector<size_t> *features,
+  NonZeroOffsets *offsets)
+{
+  features->assign(candidates.begin(), candidates.end());
+  sort(features->begin(), features->end());
+
+  offsets->assign(features->size() + 1, 0);
+  for (size_t k = 0; k < features->size(); ++k)
+    (*offsets)[k + 1] = (*offsets)[k] +
+      (occurrences.end((*features)[k]) - occurrences.begin((*features)[k]));
+}
+
+// Subtract the contributions to G' and G'' of the unconverged features,
+// like updateGradients, but per feature from its occurrences. Every feature
+// is handled by one thread, so G' and G'' are written without
+// synchronization.
+void featureGradients(DataSet const &dataSet,
+  FeatureOccurrences const &occurrences,
+  FeatureSet const &unconvergedFeatures,
+  Sums const &sums,
+  Zs const &zs,
+  FeatureWeights const &alphas,
+  Gp *gp,
+  Gpp *gpp)
+{
+  vector<size_t> features;
+  NonZeroOffsets offsets;
+  scheduleFeatures(occurrences, unconvergedFeatures, &features, &offsets);
+
+  ContextScheduler scheduler(offsets);
+  #pragma omp parallel
+  {
+  	ContextRange range;
+  	while (scheduler.next(&range))
+  		for (size_t k = range.begin; k < range.end; ++k)
+  		{
+  			size_t f = features[k];
+  			FeatureWorkspace workspace(dataSet, occurrences.begin(f),
+  				occurrences.end(f), f);
+  			workspace.alpha(alphas[f]);
+  			workspace.gradient(sums, zs, &(*gp)[f], &(*gpp)[f], false);
+  		}
+  }
+}
+
+// Calculate the gains of the candidates per feature, like calcGains. If
+// allFeatures is true, the other features are included with the gains
+// that calcGains gives features that are not active.
+OrderedGains featureGains(DataSet const &dataSet,
+  FeatureOccurrences const &occurrences,
+  FeatureSet const &candidates,
+  Sums const &sums,
+  Zs const &zs,
+  FeatureWeights const &alphas,
+  bool allFeatures)
+{
+  vector<size_t> features;
+  NonZeroOffsets offsets;
+  scheduleFeatures(occurrences, candidates, &features, &offsets);
+
+  vector<double> candidateGains(features.size());
+  ContextScheduler scheduler(offsets);
+  #pragma omp parallel
+  {
+  	ContextRange range;
+  	while (scheduler.next(&range))
+  		for (size_t k = range.begin; k < range.end; ++k)
+  		{
+  			size_t f = features[k];
+  			FeatureWorkspace workspace(dataSet, occurrences.begin(f),
+  				occurrences.end(f), f);
+  			workspace.alpha(alphas[f]);
+  			candidateGains[k] = workspace.gain(sums, zs, false);
+  		}
+  }
+
+  OrderedGains gains;
+  for (size_t k = 0; k < features.size(); ++k)
+  	gains.insert(make_pair(features[k], candidateGains[k]));
+
+  if (allFeatures)
+  {
+  	ExpectedValues const &expVals = dataSet.expFeatureValues();
+  	for (int f = 0; f < alphas.rows(); ++f)
+  		if (candidates.find(f) == candidates.end())
+  			gains.insert(make_pair(f, alphas[f] * expVals[f]));
+  }
+
+  return gains;
+}
+
+// Number of candidates with the highest gain bounds whose weights are
+// estimated in the first round of gain pruning.
+size_t const PRUNE_FIRST_ROUND_SIZE = 64;
+
+// Estimate the weights and gains of candidates in order of decreasing gain
+// bounds. The first round estimates the candidates with the highest bounds,
+// the second round the candidates whose bounds show that they could still
+// be one of the batchSize best features. Every round costs a pass over
+// the data per Newton iteration, so we do not use more rounds.
+OrderedGains boundedGains(DataSet const &dataSet,
+  SelectionModel *model,
+  SelectionParameters const &param,
+  ExpectedValues const &expModelVals,
+  R_f const &r,
+  FeatureWeights *a,
+  size_t *nPruned)
+{
+  OrderedGains bounds = model->gainBounds(expModelVals);
+  OrderedGains gains;
+  
+  size_t chunkSize = PRUNE_FIRST_ROUND_SIZE;
+  OrderedGains::const_iterator boundIter = bounds.begin();
+  while (boundIter != bounds.end())
+  {
+  	double minGain = -numeric_limits<double>::infinity();
+  	if (gains.size() >= param.batchSize)
+  	{
+  		OrderedGains::const_iterator lastIter = gains.begin();
+  		advance(lastIter, param.batchSize - 1);
+  		minGain = isnan(lastIter->second) ? 0.0 : lastIter->second;
+  	}
+  	
+  	FeatureSet chunk;
+  	for (; boundIter != bounds.end() && chunk.size() < chunkSize &&
+  			boundIter->second >= minGain; ++boundIter)
+  		chunk.insert(boundIter->first);
+  	
+  	if (chunk.size() == 0)
+  		break;
+  	
+  	estimateAlphas(dataSet, model, param, r, chunk, a);
+  	
+  	OrderedGains chunkGains = model->gains(*a, &chunk, param.deterministic);
+  	gains.insert(chunkGains.begin(), chunkGains.end());
+  	
+  	chunkSize = numeric_limits<size_t>::max();
+  }
+  
+  *nPruned = distance(boundIter, bounds.end());
+  
+  return gains;
+}
+
+// A stage of the full selection algorithm.
+OrderedGains fullSelectionStage(DataSet const &dataSet,
+  SelectionModel *model,
+  Logger logger,
+  SelectionParameters const &param,
+  FeatureSet *selectedFeatures,
+  SelectedFeatureAlphas *selectedFeatureAlphas)
+{
+  ExpectedValues expModelVals =
+  	model->expModelFeatureValues(param.deterministic);
+
+  FeatureSet excludedFs(excludedFeatures(dataSet, param));
+  excludedFs.insert(selectedFeatures->begin(), selectedFeatures->end());
 
-  vector<FeatureSet> ctxActiveFs = contextActiveFeatures(dataSet, *selectedFeatures, *sums, *zs);
-  FeatureSet unconvergedFs = activeFeatures(ctxActiveFs);
+  FeatureSet unconvergedFs = model->startStage(excludedFs);
 
   R_f r = r_f(dataSet.nFeatures(), unconvergedFs, dataSet.expFeatureValues(), expModelVals);
   
   FeatureWeights a = a_f(dataSet.nFeatures());
 
-  while (unconvergedFs.size() != 0)
+  OrderedGains gains;
+  if (param.pruneGains)
   {
-  	Gp gp = dataSet.expFeatureValues();
-  	Gpp gpp = a_f(dataSet.nFeatures());
-  
-  	updateGradients(dataSet, unconvergedFs, ctxActiveFs, *sums, *zs, a, &gp, &gpp);
-  	unconvergedFs = updateAlphas(unconvergedFs, r, gp, gpp, &a, alphaThreshold);
+  	size_t nPruned;
+  	gains = boundedGains(dataSet, model, param, expModelVals, r, &a, &nPruned);
+  	logger.error() << "Pruned: " << nPruned << "/" << unconvergedFs.size() <<
+  		endl;
+  }
+  else
+  {
+  	estimateAlphas(dataSet, model, param, r, unconvergedFs, &a);
+  	gains = model->gains(a, 0, param.deterministic);
   }
 
-  OrderedGains gains = calcGains(dataSet, ctxActiveFs, *sums, *zs, a);
+  // Pruned gains only contain active candidates.
+  if (gains.size() == 0)
+  	return gains;
 
   size_t maxF = gains.begin()->first;
   double maxGain = gains.begin()->second;
   double maxAlpha = a[maxF];
 
-  adjustModel(dataSet, maxF, maxAlpha, sums, zs);
+  model->adjust(maxF, maxAlpha);
   	
   selectedFeatures->insert(maxF);
   selectedFeatureAlphas->push_back(makeTriple(maxF, maxAlpha, maxGain));
+
+  if (param.batchSize > 1 && maxGain >= param.gainThreshold)
+  	model->addBatch(param, gains, a, selectedFeatures, selectedFeatureAlphas);
   
   return gains;
 }
 
 SelectedFeatureAlphas fsqueeze::featureSelection(DataSet const &dataSet,
   Logger logger,  SelectionParameters const &param)
+{
+  // Batches use the active features of all contexts.
+  if (dataSet.outOfCore() && param.batchSize > 1)
+    throw runtime_error("Batch selection is not supported for out-of-core data sets");
+
+  unique_ptr<FeatureOccurrences> occurrences;
+  if (param.featureParallel)
+    occurrences.reset(new FeatureOccurrences(dataSet));
+
+  DataSetModel model(dataSet, occurrences.get());
+
+  return featureSelection(dataSet, &model, logger, param);
+}
+
+SelectedFeatureAlphas fsqueeze::featureSelection(DataSet const &dataSet,
+  SelectionModel *model, Logger logger, SelectionParameters const &param)
 {
   FeatureSet selectedFeatures;
   SelectedFeatureAlphas selectedFeatureAlphas;
   
-  Zs zs = initialZs(dataSet);
-  Sums sums = initialSums(dataSet);
+  forceFeatures(dataSet, model, logger, param, &selectedFeatures,
+    &selectedFeatureAlphas);
   	
   OrderedGains prevGains;
   while(selectedFeatures.size() < param.nFeatures &&
-  	selectedFeatures.size() < dataSet.features().size())	
+  	selectedFeatures.size() < static_cast<size_t>(dataSet.nFeatures()))	
   {
+  	size_t nSelected = selectedFeatureAlphas.size();
+  	size_t prevCount = selectedFeatures.size();
+  	
   	OrderedGains gains;
   	if (param.detectOverlap)
-  		gains = fullSelectionStage(dataSet, param.alphaThreshold, &sums, &zs,
+  		gains = fullSelectionStage(dataSet, model, logger, param,
   			&selectedFeatures, &selectedFeatureAlphas);
   	else
-  		fullSelectionStage(dataSet, param.alphaThreshold, &sums, &zs,
-  			&selectedFeatures, &selectedFeatureAlphas);
+  		fullSelectionStage(dataSet, model, logger, param, &selectedFeatures,
+  			&selectedFeatureAlphas);
   	
-  	if (selectedFeatureAlphas.size() == 0)
+  	if (selectedFeatureAlphas.size() == nSelected)
   		break;
   		
   	if (param.detectOverlap)
@@ -326,76 +1010,110 @@ SelectedFeatureAlphas fsqueeze::featureSelection(DataSet const &dataSet,
   		{
   			OrderedGains overlappingFs = findOverlappingFeatures(prevGains, gains,
   				param.gainThreshold, true);
-  			copy(overlappingFs.begin(), overlappingFs.end(),
-  				ostream_iterator<pair<size_t, double> >(logger.message(), "\t"));
+  			for (OrderedGains::const_iterator iter = overlappingFs.begin();
+  					iter != overlappingFs.end(); ++iter)
+  				logger.message() << make_pair(dataSet.featureId(iter->first),
+  					iter->second) << "\t";
   			logger.message() << "\n";
   		}
 
   		prevGains = gains;
   	}
 
-  	Triple<size_t, double, double> selected = selectedFeatureAlphas.back();
-  	
-  	if (selected.third < param.gainThreshold)
+  	// Only the first feature of a stage can be below the gain threshold.
+  	if (selectedFeatureAlphas[nSelected].third < param.gainThreshold)
   	{
   		selectedFeatureAlphas.pop_back();
   		break;
   	}
   	
-  	logger.message() << selected.first << "\t" << selected.second <<
-  		"\t" << selected.third;
-  	
-  	logger.message() << "\n";
+  	for (size_t i = nSelected; i < selectedFeatureAlphas.size(); ++i)
+  	{
+  		logSelected(dataSet, logger, selectedFeatureAlphas[i]);
+  	}
 
-    bool optimize = false;
-    if (param.fullOptimizationExpBase != 0.0) {
-      double fl = log(static_cast<double>(selectedFeatures.size())) /
-        log(param.fullOptimizationExpBase);
-      if (round(fl) == fl)
-        optimize = true;
-    } else if (param.fullOptimizationCycles != 0 &&
-    			selectedFeatures.size() % param.fullOptimizationCycles == 0)
-      optimize = true;
-  	
-  	if (optimize) {
-  		Eigen::VectorXd lambdas = lbfgs_maxent(dataSet, selectedFeatures,
-  			selectedFeatureAlphas);
+    if (optimizationDue(param, prevCount, selectedFeatures.size()))
+  		model->optimize(selectedFeatures, selectedFeatureAlphas);
+  }
+  
+  return featureIds(dataSet, selectedFeatureAlphas);
+}
 
-  		// Recalculate Zs and sums
-  		adjustModelFull(dataSet, selectedFeatures, lambdas, &sums, &zs);
-  	}
+// Workspaces and gains of features, recalculated for the model of a stage.
+typedef unordered_map<size_t, pair<FeatureWorkspace, double> > StageGains;
+
+// Recalculate the alphas and gains of the head of the gains and of the next
+// stale candidates, up to speculativeBatch features. If there are at least
+// as many candidates as threads, every thread recalculates candidates by
+// itself. Otherwise, the candidates are recalculated one by one, with the
+// contexts of a candidate divided over the threads.
+void recalculateGains(DataSet const &dataSet,
+  SelectionParameters const &param,
+  FeatureOccurrences const &occurrences,
+  ExpectedValues const &expModelVals,
+  Sums const &sums,
+  Zs const &zs,
+  OrderedGains const &gains,
+  StageGains *stageGains)
+{
+  vector<FeatureWorkspace> workspaces;
+  for (OrderedGains::const_iterator gainIter = gains.begin();
+  		gainIter != gains.end() && workspaces.size() < param.speculativeBatch;
+  		++gainIter)
+  	if (stageGains->find(gainIter->first) == stageGains->end())
+  		workspaces.push_back(FeatureWorkspace(dataSet,
+  			occurrences.begin(gainIter->first), occurrences.end(gainIter->first),
+  			gainIter->first));
+  
+  vector<double> results(workspaces.size());
+  
+  bool candidateParallel =
+    workspaces.size() >= static_cast<size_t>(executionThreads());
+  // The workspaces schedule their loops on the threads of this region,
+  // which should record their busy times for this job.
+  BusyTimes *busyTimes = currentBusyTimes();
+  #pragma omp parallel for schedule(dynamic) if (candidateParallel)
+  for (int k = 0; k < static_cast<int>(workspaces.size()); ++k)
+  {
+  	BusyTimesScope busyScope(busyTimes);
+  	estimateAlpha(dataSet, param, expModelVals, sums, zs, &workspaces[k]);
+  	results[k] = workspaces[k].gain(sums, zs, param.deterministic);
   }
   
-  return selectedFeatureAlphas;
+  for (size_t k = 0; k < workspaces.size(); ++k)
+  	stageGains->insert(make_pair(workspaces[k].feature(),
+  		make_pair(workspaces[k], results[k])));
 }
 
 void fastSelectionStage(DataSet const &dataSet,
-  double alphaThreshold,
+  SelectionParameters const &param,
+  FeatureOccurrences const &occurrences,
   Sums *sums,
   Zs *zs,
   FeatureSet *selectedFeatures,
   SelectedFeatureAlphas *selectedFeatureAlphas,
   OrderedGains *gains)
 {
-  ExpectedValues expModelVals = expModelFeatureValues(dataSet, *sums, *zs);
+  ExpectedValues expModelVals = expModelFeatureValues(dataSet, *sums, *zs,
+    param.deterministic);
+
+  // The model does not change within a stage, so a feature that is
+  // recalculated again gets the same alpha and gain. This allows us to
+  // recalculate candidates speculatively, while only updating the gains
+  // of the candidates that the serial algorithm would recalculate.
+  StageGains stageGains;
 
   while (true)
   {
   	size_t feature = gains->begin()->first;
-  	double a = 0.0;
-  	double r = r_f(feature, dataSet.expFeatureValues(), expModelVals);
-
-  	bool converged = false;
-  	while (!converged)
-  	{
-  		double gp = dataSet.expFeatureValues()[feature];
-  		double gpp = 0.0;
-  		
-  		updateGradient(dataSet, feature, *sums, *zs, a, &gp, &gpp);
-  		converged = updateAlpha(r, gp, gpp, &a, alphaThreshold);
-  	}	
-
-  	double gain = calcGain(dataSet, *sums, *zs, feature, a);	
+  	if (stageGains.find(feature) == stageGains.end())
+  		recalculateGains(dataSet, param, occurrences, expModelVals, *sums, *zs,
+  			*gains, &stageGains);
+  	
+  	StageGains::const_iterator stageIter = stageGains.find(feature);
+  	FeatureWorkspace const &workspace = stageIter->second.first;
+  	double a = workspace.alpha();
+  	double gain = stageIter->second.second;
   	
   	OrderedGains::const_iterator gainIter = gains->begin();		
   	++gainIter;
@@ -408,7 +1126,7 @@ void fastSelectionStage(DataSet const &dataSet,
   		// The current feature has a higher recalculated gain than the
   		// second-highest feature. Select the current feature, and remove
   		// it for further analyses.
-  		adjustModel(dataSet, feature, a, sums, zs);
+  		workspace.adjustModel(sums, zs);
   		selectedFeatures->insert(feature);
   		selectedFeatureAlphas->push_back(makeTriple(feature, a, gain));
   		gains->erase(gains->begin(), gainIter);
@@ -429,24 +1147,39 @@ SelectedFeatureAlphas fsqueeze::fastFeatureSelection(DataSet const &dataSet,
   FeatureSet selectedFeatures;
   SelectedFeatureAlphas selectedFeatureAlphas;
   
-  Zs zs = initialZs(dataSet);
-  Sums sums = initialSums(dataSet);
+  FeatureOccurrences occurrences(dataSet);
+  DataSetModel model(dataSet, param.featureParallel ? &occurrences : 0);
+  Sums &sums = *model.sums();
+  Zs &zs = *model.zs();
+  
+  forceFeatures(dataSet, &model, logger, param, &selectedFeatures,
+    &selectedFeatureAlphas);
   
   // Start with a full selection stage to calculate the stage 2 model and gains.
-  OrderedGains gains = fullSelectionStage(dataSet, param.alphaThreshold, &sums,
-    &zs, &selectedFeatures, &selectedFeatureAlphas);
-  OrderedGains::const_iterator gainIter = gains.begin();
-  ++gainIter;
-  gains.erase(gains.begin(), gainIter);
+  // The gains of the stage are reused, so it should only add one feature
+  // and estimate the gains of all candidates.
+  SelectionParameters stageParam(param);
+  stageParam.batchSize = 1;
+  stageParam.pruneGains = false;
+  OrderedGains gains = fullSelectionStage(dataSet, &model, logger, stageParam,
+    &selectedFeatures, &selectedFeatureAlphas);
+  
+  // Selected (including forced) and excluded features are not candidates
+  // in the following stages.
+  FeatureSet excludedFs(excludedFeatures(dataSet, param));
+  for (OrderedGains::iterator gainIter = gains.begin(); gainIter != gains.end(); )
+    if (selectedFeatures.find(gainIter->first) != selectedFeatures.end() ||
+        excludedFs.find(gainIter->first) != excludedFs.end())
+      gains.erase(gainIter++);
+    else
+      ++gainIter;
   
-  Triple<size_t, double, double> selected = selectedFeatureAlphas.back();
-  logger.message() << selected.first << "\t" << selected.second <<
-  	"\t" << selected.third << "\n";
+  logSelected(dataSet, logger, selectedFeatureAlphas.back());
   
   while(selectedFeatures.size() < param.nFeatures &&
-  	selectedFeatures.size() < dataSet.features().size())	
+  	selectedFeatures.size() < static_cast<size_t>(dataSet.nFeatures()))	
   {
-  	fastSelectionStage(dataSet, param.alphaThreshold, &sums, &zs,
+  	fastSelectionStage(dataSet, param, occurrences, &sums, &zs,
   		&selectedFeatures, &selectedFeatureAlphas, &gains);
 
   	if (selectedFeatureAlphas.back().third < param.gainThreshold)
@@ -455,28 +1188,186 @@ SelectedFeatureAlphas fsqueeze::fastFeatureSelection(DataSet const &dataSet,
   		break;
   	}
   	
-  	Triple<size_t, double, double> selected = selectedFeatureAlphas.back();
-  	logger.message() << selected.first << "\t" << selected.second <<
-  		"\t" << selected.third << "\n";
-
-    bool optimize = false;
-    if (param.fullOptimizationExpBase != 0.0) {
-      double fl = log(static_cast<double>(selectedFeatures.size())) /
-        log(param.fullOptimizationExpBase);
-      if (round(fl) == fl)
-        optimize = true;
-    } else if (param.fullOptimizationCycles != 0 &&
-    			selectedFeatures.size() % param.fullOptimizationCycles == 0)
-      optimize = true;
+  	logSelected(dataSet, logger, selectedFeatureAlphas.back());
 
-    if (optimize) {
-  		Eigen::VectorXd lambdas = lbfgs_maxent(dataSet, selectedFeatures,
-  			selectedFeatureAlphas);
+    bool optimize = optimizationDue(param, selectedFeatures.size() - 1,
+      selectedFeatures.size());
 
-  		// Recalculate Zs and sums
-  		adjustModelFull(dataSet, selectedFeatures, lambdas, &sums, &zs);
-  	}
+    if (optimize)
+  		model.optimize(selectedFeatures, selectedFeatureAlphas);
   }
   
-  return selectedFeatureAlphas;
+  return featureIds(dataSet, selectedFeatureAlphas);
+}
+
+SelectionModel::~SelectionModel()
+{
+}
+
+OrderedGains SelectionModel::gainBounds(ExpectedValues const &)
+{
+  throw runtime_error("Gain bounds are not supported by this model");
+}
+
+void SelectionModel::addBatch(SelectionParameters const &,
+  OrderedGains const &, FeatureWeights const &, FeatureSet *,
+  SelectedFeatureAlphas *)
+{
+  throw runtime_error("Batches are not supported by this model");
+}
+
+void SelectionModel::optimize(FeatureSet const &,
+  SelectedFeatureAlphas const &)
+{
+  throw runtime_error("L-BFGS optimization is not supported by this model");
+}
+
+DataSetModel::DataSetModel(DataSet const &dataSet,
+  FeatureOccurrences const *occurrences) :
+  d_dataSet(&dataSet), d_occurrences(occurrences),
+  d_sums(initialSums(dataSet)), d_zs(initialZs(dataSet))
+{
+}
+
+void DataSetModel::adjust(size_t feature, double alpha)
+{
+  adjustModel(*d_dataSet, feature, alpha, &d_sums, &d_zs);
+}
+
+ExpectedValues DataSetModel::expModelFeatureValues(bool deterministic)
+{
+  return fsqueeze::expModelFeatureValues(*d_dataSet, d_sums, d_zs,
+    deterministic);
+}
+
+FeatureSet DataSetModel::startStage(FeatureSet const &excludedFeatures)
+{
+  d_activeFeatures.reset(new ContextActiveFeatures(*d_dataSet,
+    excludedFeatures, d_sums, d_zs));
+  d_stageFeatures = activeFeatures(*d_activeFeatures);
+
+  return d_stageFeatures;
+}
+
+void DataSetModel::gradients(FeatureSet const &unconvergedFeatures,
+  FeatureWeights const &alphas, bool deterministic, Gp *gp, Gpp *gpp)
+{
+  if (d_occurrences != 0)
+  	featureGradients(*d_dataSet, *d_occurrences, unconvergedFeatures, d_sums,
+  		d_zs, alphas, gp, gpp);
+  else
+  	updateGradients(*d_dataSet, unconvergedFeatures, *d_activeFeatures, d_sums,
+  		d_zs, alphas, gp, gpp, deterministic);
+}
+
+OrderedGains DataSetModel::gains(FeatureWeights const &alphas,
+  FeatureSet const *features, bool deterministic)
+{
+  if (d_occurrences != 0)
+  	return featureGains(*d_dataSet, *d_occurrences,
+  		features != 0 ? *features : d_stageFeatures, d_sums, d_zs, alphas,
+  		features == 0);
+  else if (features != 0)
+  	return calcGains(*d_dataSet, *d_activeFeatures, d_sums, d_zs, alphas,
+  		*features, deterministic);
+  else
+  	return calcGains(*d_dataSet, *d_activeFeatures, d_sums, d_zs, alphas,
+  		deterministic);
+}
+
+OrderedGains DataSetModel::gainBounds(ExpectedValues const &expModelValues)
+{
+  return fsqueeze::gainBounds(*d_dataSet, *d_activeFeatures, expModelValues,
+  	d_sums, d_zs);
+}
+
+void DataSetModel::addBatch(SelectionParameters const &param,
+  OrderedGains const &gains, FeatureWeights const &alphas,
+  FeatureSet *selectedFeatures, SelectedFeatureAlphas *selectedFeatureAlphas)
+{
+  addFeatureBatch(*d_dataSet, param, d_activeFeatures->contexts(), gains,
+  	alphas, &d_sums, &d_zs, selectedFeatures, selectedFeatureAlphas);
+}
+
+void DataSetModel::optimize(FeatureSet const &selectedFeatures,
+  SelectedFeatureAlphas const &selectedFeatureAlphas)
+{
+  Eigen::VectorXd lambdas = lbfgs_maxent(*d_dataSet, selectedFeatures,
+  	selectedFeatureAlphas);
+
+  // Recalculate Zs and sums
+  adjustModelFull(*d_dataSet, selectedFeatures, lambdas, &d_sums, &d_zs);
+}
+
+Sums *DataSetModel::sums()
+{
+  return &d_sums;
+}
+
+Zs *DataSetModel::zs()
+{
+  return &d_zs;
+}
+
+MemoryUsage fsqueeze::selectionMemoryUsage(DataSet const &dataSet,
+  SelectionParameters const &param, bool fast)
+{
+  size_t nContexts = dataSet.nContexts();
+  size_t nFeatures = dataSet.nFeatures();
+
+  // Count the features of each context once, these are the candidates
+  // that are active in a context before any feature is selected. The
+  // active features of an out-of-core data set are only kept for one
+  // shard at a time.
+  size_t nEvents = 0;
+  size_t nNonZeros = 0;
+  size_t nActive = 0;
+  size_t nActiveContexts = 0;
+  size_t nActiveFeatures = 0;
+  vector<size_t> lastContext(nFeatures, nContexts);
+  for (ShardCursor shard(dataSet); shard.next(); )
+  {
+    ContextVector const &contexts = shard.contexts();
+    size_t nShardActive = 0;
+    for (size_t k = 0; k < contexts.size(); ++k)
+    {
+      size_t i = shard.offset() + k;
+      FeatureValues const &featureVals = contexts[k].featureValues();
+      nEvents += featureVals.outerSize();
+      nNonZeros += featureVals.nonZeros();
+
+      for (int j = 0; j < featureVals.outerSize(); ++j)
+        for (FeatureValues::InnerIterator fIter(featureVals, j); fIter; ++fIter)
+          if (lastContext[fIter.index()] != i)
+          {
+            lastContext[fIter.index()] = i;
+            ++nShardActive;
+          }
+    }
+
+    nActive += nShardActive;
+    nActiveContexts = max(nActiveContexts, contexts.size());
+    nActiveFeatures = max(nActiveFeatures, nShardActive);
+  }
+
+  MemoryUsage usage;
+  addMemory(&usage, "model sums", nEvents * sizeof(StorageScalar) +
+    nContexts * (sizeof(Sum) + sizeof(double)));
+  addMemory(&usage, "active features", nActiveContexts * sizeof(FeatureSet) +
+    nActiveFeatures * HASH_NODE_BYTES);
+
+  // R(f), alphas, G', G'' and model expectations.
+  addMemory(&usage, "feature vectors", 5 * nFeatures * sizeof(double));
+  addMemory(&usage, "gains", nFeatures * (TREE_NODE_BYTES + HASH_NODE_BYTES));
+
+  // The occurrences of an out-of-core data set are mapped from its shard
+  // file.
+  if ((fast || param.featureParallel) && !dataSet.outOfCore())
+    addMemory(&usage, "feature occurrences", nNonZeros *
+      sizeof(FeatureOccurrence) + (nFeatures + 1) * sizeof(uint64_t));
+  if (!fast && param.pruneGains)
+    addMemory(&usage, "gain bounds", 2 * nActive * sizeof(pair<double, double>) +
+      nFeatures * HASH_NODE_BYTES);
+
+  return usage;
 }
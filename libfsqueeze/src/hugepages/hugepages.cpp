@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+#include "hugepages.ih"
+
+namespace {
+
+HugePagePolicy s_policy = HUGE_PAGES_TRANSPARENT;
+
+enum MappingKind {
+	MAPPING_PLAIN,
+	MAPPING_TRANSPARENT,
+	MAPPING_HUGETLB
+};
+
+// Separately mapped buffers. Large buffers are few, so a map under a lock
+// is cheap enough.
+mutex s_mutex;
+map<void *, MappingKind> s_mappings;
+HugePageUsage s_usage;
+
+size_t roundUp(size_t bytes)
+{
+	return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+#ifdef __linux__
+void *mapHugetlb(size_t size)
+{
+#ifdef MAP_HUGETLB
+	void *data = mmap(0, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (data != MAP_FAILED)
+		return data;
+#endif
+	return 0;
+}
+
+// Map size bytes at a huge page boundary, by mapping an extra huge page
+// and unmapping the unaligned head and tail.
+void *mapAligned(size_t size)
+{
+	void *data = mmap(0, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
+		return 0;
+
+	uintptr_t begin = reinterpret_cast<uintptr_t>(data);
+	uintptr_t aligned = (begin + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	if (aligned != begin)
+		munmap(data, aligned - begin);
+	munmap(reinterpret_cast<void *>(aligned + size),
+		begin + HUGE_PAGE_SIZE - aligned);
+
+	return reinterpret_cast<void *>(aligned);
+}
+#endif
+
+void addMapping(void *data, size_t size, MappingKind kind)
+{
+	lock_guard<mutex> lock(s_mutex);
+	s_mappings[data] = kind;
+
+	if (kind == MAPPING_HUGETLB)
+	{
+		s_usage.hugetlbBytes += size;
+		if (s_usage.hugetlbBytes > s_usage.peakHugetlbBytes)
+			s_usage.peakHugetlbBytes = s_usage.hugetlbBytes;
+	}
+	else if (kind == MAPPING_TRANSPARENT)
+	{
+		s_usage.transparentBytes += size;
+		if (s_usage.transparentBytes > s_usage.peakTransparentBytes)
+			s_usage.peakTransparentBytes = s_usage.transparentBytes;
+	}
+}
+
+// Remove a mapping from the bookkeeping.
+void removeMapping(void *data, size_t size)
+{
+	lock_guard<mutex> lock(s_mutex);
+	map<void *, MappingKind>::iterator iter = s_mappings.find(data);
+	if (iter == s_mappings.end())
+		return;
+
+	if (iter->second == MAPPING_HUGETLB)
+		s_usage.hugetlbBytes -= size;
+	else if (iter->second == MAPPING_TRANSPARENT)
+		s_usage.transparentBytes -= size;
+
+	s_mappings.erase(iter);
+}
+
+// Read the huge page counters (in kB) of /proc/self/smaps_rollup.
+void readKernelUsage(HugePageUsage *usage)
+{
+	ifstream smaps("/proc/self/smaps_rollup");
+	string line;
+	while (getline(smaps, line))
+	{
+		istringstream lineStream(line);
+		string key;
+		size_t kb = 0;
+		if (!(lineStream >> key >> kb))
+			continue;
+
+		if (key == "AnonHugePages:")
+			usage->anonHugeBytes += kb * 1024;
+		else if (key == "ShmemPmdMapped:" || key == "FilePmdMapped:")
+			usage->sharedHugeBytes += kb * 1024;
+		else if (key == "Shared_Hugetlb:" || key == "Private_Hugetlb:")
+			usage->hugetlbMappedBytes += kb * 1024;
+	}
+}
+
+}
+
+void fsqueeze::setHugePagePolicy(HugePagePolicy policy)
+{
+	s_policy = policy;
+}
+
+HugePagePolicy fsqueeze::hugePagePolicy()
+{
+	return s_policy;
+}
+
+HugePagePolicy fsqueeze::parseHugePagePolicy(string const &policy)
+{
+	if (policy == "none")
+		return HUGE_PAGES_NONE;
+	else if (policy == "transparent")
+		return HUGE_PAGES_TRANSPARENT;
+	else if (policy == "hugetlb")
+		return HUGE_PAGES_HUGETLB;
+
+	throw invalid_argument("Unknown huge page policy: " + policy);
+}
+
+void *fsqueeze::allocateHugePages(size_t bytes)
+{
+#ifdef __linux__
+	if (bytes >= HUGE_PAGE_SIZE)
+	{
+		size_t size = roundUp(bytes);
+		HugePagePolicy policy = s_policy;
+
+		if (policy == HUGE_PAGES_HUGETLB)
+		{
+			void *data = mapHugetlb(size);
+			if (data != 0)
+			{
+				addMapping(data, size, MAPPING_HUGETLB);
+				return data;
+			}
+		}
+
+		void *data = mapAligned(size);
+		if (data == 0)
+			throw bad_alloc();
+
+		MappingKind kind = MAPPING_PLAIN;
+#ifdef MADV_HUGEPAGE
+		if (policy != HUGE_PAGES_NONE && madvise(data, size, MADV_HUGEPAGE) == 0)
+			kind = MAPPING_TRANSPARENT;
+#endif
+		addMapping(data, size, kind);
+		return data;
+	}
+#endif
+
+	void *data = malloc(bytes == 0 ? 1 : bytes);
+	if (data == 0)
+		throw bad_alloc();
+
+	return data;
+}
+
+void fsqueeze::deallocateHugePages(void *data, size_t bytes)
+{
+	if (data == 0)
+		return;
+
+#ifdef __linux__
+	if (bytes >= HUGE_PAGE_SIZE)
+	{
+		size_t size = roundUp(bytes);
+		removeMapping(data, size);
+		munmap(data, size);
+		return;
+	}
+#endif
+
+	free(data);
+}
+
+void fsqueeze::adviseHugePages(void const *data, size_t bytes)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	if (s_policy == HUGE_PAGES_NONE)
+		return;
+
+	uintptr_t begin = reinterpret_cast<uintptr_t>(data);
+	uintptr_t alignedBegin = (begin + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	uintptr_t alignedEnd = (begin + bytes) & ~(HUGE_PAGE_SIZE - 1);
+	if (alignedEnd > alignedBegin)
+		madvise(reinterpret_cast<void *>(alignedBegin), alignedEnd - alignedBegin,
+			MADV_HUGEPAGE);
+#endif
+}
+
+HugePageUsage fsqueeze::hugePageUsage()
+{
+	HugePageUsage usage;
+	{
+		lock_guard<mutex> lock(s_mutex);
+		usage = s_usage;
+	}
+
+	readKernelUsage(&usage);
+
+	return usage;
+}
@@ -74,6 +74,8 @@ licence.
 #ifdef  _MSC_VER
 #define inline  __inline
 typedef unsigned int uint32_t;
+#else
+#include <stdint.h>
 #endif/*_MSC_VER*/
 
 #if     defined(USE_SSE) && defined(__SSE2__) && LBFGS_FLOAT == 64
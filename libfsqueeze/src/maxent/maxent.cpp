@@ -21,70 +21,201 @@
 
 // NOTE
 //
-// Currently, only one loop here has an OpenMP annotation. Most other
-// cases would require a critical section in an inner loop. So, let's
-// not do it without proper benchmarking.
+// All context loops here are scheduled with ContextScheduler. Loops that
+// only write per-context state need no synchronization. Loops that sum
+// over features are summed in context order, unless the deterministic
+// reduction is requested. Then they accumulate sparse sums per block of
+// REDUCTION_BLOCK_SIZE contexts over the threads, which are added in
+// block order afterwards. This keeps the expectations independent of the
+// number of threads, at the cost of about twice the single-threaded time
+// of a plain loop.
 
 // Active features in at least one context.
-FeatureSet fsqueeze::activeFeatures(vector<FeatureSet> const &contextActiveFeatures)
+FeatureSet fsqueeze::activeFeatures(
+  ContextActiveFeatures const &contextActiveFeatures)
 {
   FeatureSet active;
-  
-  for (vector<FeatureSet>::const_iterator ctxIter = contextActiveFeatures.begin();
-      ctxIter != contextActiveFeatures.end(); ++ctxIter)
-    active.insert(ctxIter->begin(), ctxIter->end());
+
+  vector<FeatureSet> buffer;
+  for (ShardCursor shard(contextActiveFeatures.dataSet()); shard.next(); )
+  {
+    vector<FeatureSet> const &ctxActive =
+      contextActiveFeatures.shard(shard, &buffer);
+    for (vector<FeatureSet>::const_iterator ctxIter = ctxActive.begin();
+        ctxIter != ctxActive.end(); ++ctxIter)
+      active.insert(ctxIter->begin(), ctxIter->end());
+  }
   
   return active;
 }
 
+void fsqueeze::adjustContextLog(LogFactors const &logFactors, Sum *ctxSums,
+  double *z)
+{
+  Eigen::VectorXd logSums(ctxSums->size());
+  for (int j = 0; j < ctxSums->size(); ++j)
+    logSums[j] = log((*ctxSums)[j]);
+
+  for (LogFactors::const_iterator iter = logFactors.begin();
+      iter != logFactors.end(); ++iter)
+    logSums[iter->first] += iter->second;
+
+  double shift = logSums.maxCoeff();
+
+  *z = 0.0;
+  for (int j = 0; j < ctxSums->size(); ++j)
+  {
+    (*ctxSums)[j] = exp(logSums[j] - shift);
+    *z += (*ctxSums)[j];
+  }
+}
+
+void fsqueeze::featureLogFactors(FeatureValues const &featureValues,
+  size_t feature, double alpha, LogFactors *logFactors)
+{
+  logFactors->clear();
+  for (int j = 0; j < featureValues.outerSize(); ++j)
+  {
+    double fVal = featureValues.coeff(j, feature);
+    if (fVal != 0.0)
+      logFactors->push_back(make_pair(static_cast<size_t>(j), alpha * fVal));
+  }
+}
+
+double fsqueeze::shiftedLogZRatio(LogFactors const &logFactors,
+  Sum const &ctxSums, double z, Eigen::VectorXd *probs)
+{
+  Eigen::VectorXd logSums(ctxSums.size());
+  for (int j = 0; j < ctxSums.size(); ++j)
+    logSums[j] = log(ctxSums[j]);
+
+  for (LogFactors::const_iterator iter = logFactors.begin();
+      iter != logFactors.end(); ++iter)
+    logSums[iter->first] += iter->second;
+
+  double shift = logSums.maxCoeff();
+
+  double newZ = 0.0;
+  for (int j = 0; j < logSums.size(); ++j)
+  {
+    logSums[j] = exp(logSums[j] - shift);
+    newZ += logSums[j];
+  }
+
+  if (probs != 0)
+    *probs = logSums / newZ;
+
+  return shift + log(newZ) - log(z);
+}
+
+// Contexts only change their own sums and normalizer, so the model updates
+// need no synchronization.
 void fsqueeze::adjustModel(DataSet const &dataSet, size_t feature,
   double alpha, Sums *sums, Zs *zs)
 {
-  ContextVector::const_iterator ctxIter = dataSet.contexts().begin();
-  size_t i = 0;
-  while (ctxIter != dataSet.contexts().end())
+  for (ShardCursor shard(dataSet); shard.next(); )
   {
-    FeatureValues const &featureVals = ctxIter->featureValues();
-    for (int j = 0; j < featureVals.outerSize(); ++j)
+    ContextVector const &contexts = shard.contexts();
+    size_t offset = shard.offset();
+
+    ContextScheduler scheduler(shard);
+    #pragma omp parallel
     {
-      double fVal = featureVals.coeff(j, feature);
-      if (fVal != 0.0)
-      {
-        (*zs)[i] -= (*sums)[i][j];
-        (*sums)[i][j] *= exp(alpha * fVal);
-        (*zs)[i] += (*sums)[i][j];
-      }      
+      LogFactors logFactors;
+      ContextRange range;
+      while (scheduler.next(&range))
+        for (size_t k = range.begin; k < range.end; ++k)
+        {
+          size_t i = offset + k;
+          FeatureValues const &featureVals = contexts[k].featureValues();
+
+          logFactors.clear();
+          bool large = false;
+          for (int j = 0; j < featureVals.outerSize(); ++j)
+          {
+            double fVal = featureVals.coeff(j, feature);
+            if (fVal != 0.0)
+            {
+              logFactors.push_back(make_pair(static_cast<size_t>(j), alpha * fVal));
+              if (fabs(alpha * fVal) > MAX_LOG_FACTOR)
+                large = true;
+            }
+          }
+
+          if (large)
+            adjustContextLog(logFactors, &(*sums)[i], &(*zs)[i]);
+          else if (logFactors.size() != 0)
+          {
+            double oldZ = (*zs)[i];
+
+            for (LogFactors::const_iterator iter = logFactors.begin();
+                iter != logFactors.end(); ++iter)
+            {
+              size_t j = iter->first;
+              (*zs)[i] -= (*sums)[i][j];
+              (*sums)[i][j] *= exp(iter->second);
+              (*zs)[i] += (*sums)[i][j];
+            }
+
+            normalizeContext(oldZ, &(*sums)[i], &(*zs)[i]);
+          }
+        }
     }
-    
-    ++ctxIter; ++i;
   }
 }
 
 void fsqueeze::adjustModelFull(DataSet const &dataSet, FeatureSet const &featureSet,
   Eigen::VectorXd const &lambdas, Sums *sums, Zs *zs)
 {
-  ContextVector::const_iterator ctxIter = dataSet.contexts().begin();
-  size_t i = 0;
-  while (ctxIter != dataSet.contexts().end())
+  for (ShardCursor shard(dataSet); shard.next(); )
   {
-    (*zs)[i] = 0.0;
-    
-    FeatureValues const &featureVals = ctxIter->featureValues();
-    for (int j = 0; j < featureVals.outerSize(); ++j)
+    ContextVector const &contexts = shard.contexts();
+    size_t offset = shard.offset();
+
+    ContextScheduler scheduler(shard);
+    #pragma omp parallel
     {
-      double sum = 0.0;
-      
-      for (FeatureValues::InnerIterator fIter(featureVals, j);
-          fIter; ++fIter)
-        if (featureSet.find(fIter.index()) != featureSet.end())
-          sum += fIter.value() * lambdas[fIter.index()];
-      
-      sum = exp(sum);
-      (*sums)[i][j] = sum;
-      (*zs)[i] += sum;
+      ContextRange range;
+      while (scheduler.next(&range))
+        for (size_t k = range.begin; k < range.end; ++k)
+        {
+          size_t i = offset + k;
+          ContextVector::const_iterator ctxIter = contexts.begin() + k;
+
+          (*zs)[i] = 0.0;
+        
+          FeatureValues const &featureVals = ctxIter->featureValues();
+          Sum &ctxSums = (*sums)[i];
+          Eigen::VectorXd logSums(featureVals.outerSize());
+          for (int j = 0; j < featureVals.outerSize(); ++j)
+          {
+            double sum = 0.0;
+          
+            for (FeatureValues::InnerIterator fIter(featureVals, j);
+                fIter; ++fIter)
+              if (featureSet.find(fIter.index()) != featureSet.end())
+                sum += fIter.value() * lambdas[fIter.index()];
+          
+            logSums[j] = sum;
+          }
+
+          // Shift the log-sums of the context if exponentiation could
+          // overflow or underflow. Otherwise, rescaling by a power of two
+          // gives the same probabilities as before.
+          double shift = logSums.size() == 0 ? 0.0 : logSums.maxCoeff();
+          if (fabs(shift) <= MAX_LOG_SUM)
+            shift = 0.0;
+
+          EventCounts const &counts = ctxIter->eventCounts();
+          for (int j = 0; j < ctxSums.size(); ++j)
+          {
+            ctxSums[j] = counts[j] * exp(logSums[j] - shift);
+            (*zs)[i] += ctxSums[j];
+          }
+
+          normalizeContext((*zs)[i], &ctxSums, &(*zs)[i]);
+        }
     }
-    
-    ++ctxIter; ++i;
   }
 }
 
@@ -92,53 +223,230 @@ double fsqueeze::calcGain(DataSet const &dataSet,
   Sums const &sums,
   Zs const &zs,
   size_t feature,
-  double alpha
+  double alpha,
+  bool deterministic
 )
 {
   double gainSum = 0.0;
-  ContextVector const &contexts = dataSet.contexts();
 
-  #pragma omp parallel for
-  for (int i = 0; i < static_cast<int>(dataSet.contexts().size()); ++i)
+  double factor = exp(alpha);
+  double const *indicator = dataSet.valueDictionary().indicator() ?
+    &factor : 0;
+
+  // Shards start at block boundaries, so the blocks of a shard are blocks
+  // of the data set.
+  vector<double> blockSums(deterministic ?
+    reductionBlocks(dataSet.nContexts()) : 0);
+
+  for (ShardCursor shard(dataSet); shard.next(); )
   {
-    double newZ = zf(contexts[i].featureValues(), sums[i], zs[i], feature, alpha);
-    double lg = contexts[i].prob() * log(newZ / zs[i]);
-    
-    #pragma omp atomic
-    gainSum -= lg;
+    ContextVector const &contexts = shard.contexts();
+    size_t offset = shard.offset();
+
+    if (deterministic)
+    {
+      // The gains of contexts are computed separately, so that large
+      // contexts in one block can go to different threads, and are added
+      // up per block in context order.
+      vector<double> ctxGains(contexts.size());
+      ContextScheduler scheduler(shard);
+      #pragma omp parallel
+      {
+        ContextRange range;
+        while (scheduler.next(&range))
+          for (size_t k = range.begin; k < range.end; ++k)
+          {
+            size_t i = offset + k;
+            ctxGains[k] = contexts[k].prob() *
+              logZRatio(contexts[k].featureValues(), sums[i], zs[i], feature,
+                alpha, indicator);
+          }
+      }
+
+      size_t firstBlock = offset / REDUCTION_BLOCK_SIZE;
+      for (size_t b = 0; b < reductionBlocks(contexts.size()); ++b)
+      {
+        double blockSum = 0.0;
+        for (size_t k = reductionBlockBegin(b);
+            k < reductionBlockEnd(b, contexts.size()); ++k)
+          blockSum -= ctxGains[k];
+        
+        blockSums[firstBlock + b] = blockSum;
+      }
+    }
+    else
+    {
+      ContextScheduler scheduler(shard);
+      #pragma omp parallel
+      {
+        ContextRange range;
+        while (scheduler.next(&range))
+        {
+          double rangeSum = 0.0;
+          for (size_t k = range.begin; k < range.end; ++k)
+          {
+            size_t i = offset + k;
+            rangeSum -= contexts[k].prob() *
+              logZRatio(contexts[k].featureValues(), sums[i], zs[i], feature,
+                alpha, indicator);
+          }
+          
+          #pragma omp atomic
+          gainSum += rangeSum;
+        }
+      }
+    }
   }
+
+  if (deterministic)
+    gainSum = sumBlocks(blockSums);
   
   return gainSum + alpha * dataSet.expFeatureValues()[feature];
 }
 
-// Calculate the gain of adding each feature.
-OrderedGains fsqueeze::calcGains(DataSet const &dataSet,
-  vector<FeatureSet> const &contextActiveFeatures,
+// Sum the gains of adding each active feature, or each of the given
+// features, over the contexts.
+GainMap contextGainSums(DataSet const &dataSet,
+  ContextActiveFeatures const &contextActiveFeatures,
   Sums const &sums,
   Zs const &zs,
-  FeatureWeights const &alphas
+  FeatureWeights const &alphas,
+  FeatureSet const *features,
+  bool deterministic
 )
 {
   GainMap gainSum;
+
+  if (deterministic)
+  {
+    vector<BlockVectorSums> blockSums = blockGainSums(dataSet,
+      contextActiveFeatures, sums, zs, alphas, features);
+    for (size_t b = 0; b < blockSums.size(); ++b)
+      for (BlockVectorSums::const_iterator iter = blockSums[b].begin();
+          iter != blockSums[b].end(); ++iter)
+        gainSum[iter->first] += iter->second;
+
+    return gainSum;
+  }
   
-  ContextVector const &contexts = dataSet.contexts();
+  IndicatorFactors factors = features == 0 ?
+    indicatorFactors(dataSet, alphas) :
+    indicatorFactors(dataSet, alphas, *features);
   
-  for (int i = 0; i < static_cast<int>(dataSet.contexts().size()); ++i)
+  vector<FeatureSet> buffer;
+  for (ShardCursor shard(dataSet); shard.next(); )
   {
-    for (FeatureSet::const_iterator fsIter = contextActiveFeatures[i].begin();
-      fsIter != contextActiveFeatures[i].end(); ++fsIter)
+    ContextVector const &contexts = shard.contexts();
+    vector<FeatureSet> const &ctxActive =
+      contextActiveFeatures.shard(shard, &buffer);
+
+    for (int k = 0; k < static_cast<int>(contexts.size()); ++k)
     {
-      int f = *fsIter;
+      size_t i = shard.offset() + k;
+      for (FeatureSet::const_iterator fsIter = ctxActive[k].begin();
+        fsIter != ctxActive[k].end(); ++fsIter)
+      {
+        int f = *fsIter;
+        if (features != 0 && features->find(f) == features->end())
+          continue;
 
-      double newZ = zf(contexts[i].featureValues(), sums[i], zs[i], f,
-        alphas[f]);
-      
-      double lg = contexts[i].prob() * log(newZ / zs[i]);
-      
-      gainSum[f] -= lg;
-    }    
+        double lg = contexts[k].prob() * logZRatio(contexts[k].featureValues(),
+          sums[i], zs[i], f, alphas[f], indicatorFactor(factors, f));
+        
+        gainSum[f] -= lg;
+      }    
+    }
+  }
+  
+  return gainSum;
+}
+
+GainMap fsqueeze::gainSums(DataSet const &dataSet,
+  ContextActiveFeatures const &contextActiveFeatures,
+  Sums const &sums,
+  Zs const &zs,
+  FeatureWeights const &alphas,
+  bool deterministic
+)
+{
+  return contextGainSums(dataSet, contextActiveFeatures, sums, zs, alphas, 0,
+    deterministic);
+}
+
+GainMap fsqueeze::gainSums(DataSet const &dataSet,
+  ContextActiveFeatures const &contextActiveFeatures,
+  Sums const &sums,
+  Zs const &zs,
+  FeatureWeights const &alphas,
+  FeatureSet const &features,
+  bool deterministic
+)
+{
+  return contextGainSums(dataSet, contextActiveFeatures, sums, zs, alphas,
+    &features, deterministic);
+}
+
+// The contexts are visited in order, so the blocks are finished in order.
+// Shards start at block boundaries.
+vector<BlockVectorSums> fsqueeze::blockGainSums(DataSet const &dataSet,
+  ContextActiveFeatures const &contextActiveFeatures,
+  Sums const &sums,
+  Zs const &zs,
+  FeatureWeights const &alphas,
+  FeatureSet const *features
+)
+{
+  vector<BlockVectorSums> blockSums(reductionBlocks(dataSet.nContexts()));
+  
+  IndicatorFactors factors = features == 0 ?
+    indicatorFactors(dataSet, alphas) :
+    indicatorFactors(dataSet, alphas, *features);
+  
+  BlockAccumulator &accumulator =
+    threadBlockAccumulator(dataSet.nFeatures());
+  vector<FeatureSet> buffer;
+  for (ShardCursor shard(dataSet); shard.next(); )
+  {
+    ContextVector const &contexts = shard.contexts();
+    vector<FeatureSet> const &ctxActive =
+      contextActiveFeatures.shard(shard, &buffer);
+
+    for (size_t k = 0; k < contexts.size(); ++k)
+    {
+      size_t i = shard.offset() + k;
+      for (FeatureSet::const_iterator fsIter = ctxActive[k].begin();
+        fsIter != ctxActive[k].end(); ++fsIter)
+      {
+        size_t f = *fsIter;
+        if (features != 0 && features->find(f) == features->end())
+          continue;
+
+        accumulator.add(f, -contexts[k].prob() *
+          logZRatio(contexts[k].featureValues(), sums[i], zs[i], f, alphas[f],
+            indicatorFactor(factors, f)));
+      }
+
+      size_t b = i / REDUCTION_BLOCK_SIZE;
+      if (i + 1 == reductionBlockEnd(b, dataSet.nContexts()))
+        accumulator.finish(&blockSums[b]);
+    }
   }
   
+  return blockSums;
+}
+
+// Calculate the gain of adding each feature.
+OrderedGains fsqueeze::calcGains(DataSet const &dataSet,
+  ContextActiveFeatures const &contextActiveFeatures,
+  Sums const &sums,
+  Zs const &zs,
+  FeatureWeights const &alphas,
+  bool deterministic
+)
+{
+  GainMap gainSum = gainSums(dataSet, contextActiveFeatures, sums, zs, alphas,
+    deterministic);
+  
   OrderedGains gains;
   for (int f = 0; f < alphas.rows(); ++f)
     gains.insert(make_pair(f, gainSum[f] + alphas[f] *
@@ -147,110 +455,609 @@ OrderedGains fsqueeze::calcGains(DataSet const &dataSet,
   return gains;
 }
 
-vector<FeatureSet> fsqueeze::contextActiveFeatures(DataSet const &dataSet,
-  FeatureSet const &excludedFeatures, Sums const &sums, Zs const &zs)
+// Calculate the gain of adding each of the given features.
+OrderedGains fsqueeze::calcGains(DataSet const &dataSet,
+  ContextActiveFeatures const &contextActiveFeatures,
+  Sums const &sums,
+  Zs const &zs,
+  FeatureWeights const &alphas,
+  FeatureSet const &features,
+  bool deterministic
+)
 {
-  vector<FeatureSet> ctxActive;
+  GainMap gainSum = gainSums(dataSet, contextActiveFeatures, sums, zs, alphas,
+    features, deterministic);
   
-  ContextVector::const_iterator ctxIter = dataSet.contexts().begin();
-  size_t i = 0;
-  while (ctxIter != dataSet.contexts().end())
+  OrderedGains gains;
+  for (FeatureSet::const_iterator fIter = features.begin();
+      fIter != features.end(); ++fIter)
+    gains.insert(make_pair(*fIter, gainSum[*fIter] + alphas[*fIter] *
+      dataSet.expFeatureValues()[*fIter]));
+  
+  return gains;
+}
+
+typedef vector<pair<double, double> > BoundSegments;
+
+// Maximum of a concave piecewise linear function with value 0 at alpha = 0
+// and the given initial slope. Every segment (alpha, slope) decreases the
+// slope of the function by slope from alpha onwards.
+double maxBoundedGain(double slope, BoundSegments segments)
+{
+  if (slope <= 0.0)
+    return 0.0;
+
+  sort(segments.begin(), segments.end());
+
+  double gain = 0.0;
+  double alpha = 0.0;
+  for (BoundSegments::const_iterator iter = segments.begin();
+      iter != segments.end(); ++iter)
   {
-    FeatureSet active;
+    gain += slope * (iter->first - alpha);
+    alpha = iter->first;
+    slope -= iter->second;
 
-    // This context can not have active features if its probability is zero.
-    if (ctxIter->prob() == 0.0)
-    {
-      ctxActive.push_back(active);
-      ++ctxIter; ++i;  
+    if (slope <= 0.0)
+      return gain;
+  }
+
+  return numeric_limits<double>::infinity();
+}
+
+// Add the segments of the gain bound of a context for weights >= 0.
+// values holds the distinct values of the feature in the context, in
+// increasing order, with their model probabilities. mean is the model
+// expectation of the feature.
+//
+// By Jensen's inequality, log E[exp(alpha f)|x] >= alpha mean, and by
+// Markov's inequality, log E[exp(alpha f)|x] >= alpha t + log p(f >= t|x)
+// for every t. The upper envelope of these lines is a lower bound on
+// log E[exp(alpha f)|x], so the contribution of the context to the gain,
+// p~(x) (alpha E~[f|x] - log E[exp(alpha f)|x]), is bounded by a concave
+// piecewise linear function. Its slope decreases by p~(x) (t2 - t1) at
+// every point where the envelope switches from line t1 to line t2.
+void addBoundSegments(vector<pair<double, double> > const &values,
+  double mean, double ctxProb, BoundSegments *segments)
+{
+  // Lines (slope, intercept) in order of increasing slope.
+  vector<pair<double, double> > lines;
+  double pUpper = 0.0;
+  for (vector<pair<double, double> >::const_reverse_iterator iter =
+      values.rbegin(); iter != values.rend() && iter->first > mean; ++iter)
+  {
+    pUpper += iter->second;
+    if (pUpper == 0.0)
       continue;
+
+    if (lines.size() != 0 && lines.back().first == iter->first)
+      lines.back().second = log(pUpper);
+    else
+      lines.push_back(make_pair(iter->first, log(pUpper)));
+  }
+  lines.push_back(make_pair(mean, 0.0));
+  reverse(lines.begin(), lines.end());
+
+  // Upper envelope of the lines for alpha >= 0, with the weights at which
+  // the envelope switches between lines.
+  vector<pair<double, double> > hull;
+  vector<double> switches;
+  for (vector<pair<double, double> >::const_iterator iter = lines.begin();
+      iter != lines.end(); ++iter)
+  {
+    while (hull.size() != 0)
+    {
+      pair<double, double> const &last = hull.back();
+      double alpha = (last.second - iter->second) / (iter->first - last.first);
+      if (switches.size() != 0 && alpha <= switches.back())
+      {
+        hull.pop_back();
+        switches.pop_back();
+        continue;
+      }
+
+      switches.push_back(alpha);
+      break;
     }
 
-    FeatureValues const &featureVals = ctxIter->featureValues();
-    for (int j = 0; j < featureVals.outerSize(); ++j)
+    hull.push_back(*iter);
+  }
+
+  for (size_t k = 0; k < switches.size(); ++k)
+    segments->push_back(make_pair(switches[k],
+      ctxProb * (hull[k + 1].first - hull[k].first)));
+}
+
+// A non-zero feature value of an event, with the model and empirical
+// probabilities of the event.
+struct BoundEvent
+{
+  size_t feature;
+  double value;
+  double prob;
+  double empProb;
+  bool operator<(BoundEvent const &other) const;
+};
+
+inline bool BoundEvent::operator<(BoundEvent const &other) const
+{
+  if (feature != other.feature)
+    return feature < other.feature;
+
+  return value < other.value;
+}
+
+// The gain of a feature as a function of its weight has the slope
+// E~[f] - E[f] at zero. Since the gain is concave, only weights with the
+// sign of that slope can give a positive gain. The gain is bounded by
+// summing the bounds of the contributions of contexts (see
+// addBoundSegments) and maximizing over the weight. Negative weights are
+// handled by negating the feature values.
+OrderedGains fsqueeze::gainBounds(DataSet const &dataSet,
+  ContextActiveFeatures const &contextActiveFeatures,
+  ExpectedValues const &expModelValues,
+  Sums const &sums,
+  Zs const &zs)
+{
+  ExpectedValues const &expValues = dataSet.expFeatureValues();
+  unordered_map<size_t, BoundSegments> segments;
+
+  vector<FeatureSet> buffer;
+  vector<BoundEvent> events;
+  vector<pair<double, double> > values;
+  for (ShardCursor shard(dataSet); shard.next(); )
+  {
+    vector<FeatureSet> const &ctxActive =
+      contextActiveFeatures.shard(shard, &buffer);
+
+    for (size_t k = 0; k < shard.contexts().size(); ++k)
     {
-      // This event can not have active features if its probability is zero.
-      if (p_yx(sums[i][j], zs[i]) == 0.0)
+      FeatureSet const &active = ctxActive[k];
+      if (active.size() == 0)
         continue;
 
-      for (FeatureValues::InnerIterator fIter(featureVals, j);
-          fIter; ++fIter)
-        if (excludedFeatures.find(fIter.index()) == excludedFeatures.end() &&
-            fIter.value() != 0.0)
-          active.insert(fIter.index());
+      size_t i = shard.offset() + k;
+      Context const &context = shard.contexts()[k];
+      FeatureValues const &featureVals = context.featureValues();
+      EventProbs const &eventProbs = context.eventProbs();
+      double ctxProb = context.prob();
+
+      events.clear();
+      for (int j = 0; j < featureVals.outerSize(); ++j)
+      {
+        double pyx = p_yx(sums[i][j], zs[i]);
+        for (FeatureValues::InnerIterator fIter(featureVals, j); fIter; ++fIter)
+        {
+          BoundEvent event = {static_cast<size_t>(fIter.index()),
+            fIter.value(), pyx, eventProbs[j]};
+          events.push_back(event);
+        }
+      }
+
+      sort(events.begin(), events.end());
+
+      vector<BoundEvent>::const_iterator iter = events.begin();
+      while (iter != events.end())
+      {
+        size_t f = iter->feature;
+        vector<BoundEvent>::const_iterator end = iter;
+        while (end != events.end() && end->feature == f)
+          ++end;
+
+        if (active.find(f) == active.end())
+        {
+          iter = end;
+          continue;
+        }
+
+        double sign = expValues[f] >= expModelValues[f] ? 1.0 : -1.0;
+
+        // Events in which the feature is zero are not stored.
+        double pZero = 1.0;
+        double mean = 0.0;
+        values.clear();
+        values.push_back(make_pair(0.0, 0.0));
+        for (; iter != end; ++iter)
+        {
+          pZero -= iter->prob;
+          mean += sign * iter->prob * iter->value;
+          values.push_back(make_pair(sign * iter->value, iter->prob));
+        }
+        values[0].second = max(pZero, 0.0);
+
+        sort(values.begin(), values.end());
+
+        addBoundSegments(values, mean, ctxProb, &segments[f]);
+      }
     }
-    
-    ctxActive.push_back(active);
-    
-    ++ctxIter; ++i;
   }
+
+  OrderedGains bounds;
+  for (unordered_map<size_t, BoundSegments>::const_iterator iter =
+      segments.begin(); iter != segments.end(); ++iter)
+  {
+    size_t f = iter->first;
+    bounds.insert(make_pair(f, maxBoundedGain(
+      fabs(expValues[f] - expModelValues[f]), iter->second)));
+  }
+
+  return bounds;
+}
+
+ContextActiveFeatures::ContextActiveFeatures(DataSet const &dataSet,
+  FeatureSet const &excludedFeatures, Sums const &sums, Zs const &zs) :
+  d_dataSet(&dataSet), d_excludedFeatures(excludedFeatures), d_sums(&sums),
+  d_zs(&zs)
+{
+  if (!dataSet.outOfCore())
+    determine(dataSet.contexts(), 0, dataSet.contextNonZeros(), &d_contexts);
+}
+
+// The sets of a context are filled by the thread that processes it.
+void ContextActiveFeatures::determine(ContextVector const &contexts,
+  size_t offset, NonZeroOffsets const &nonZeros,
+  vector<FeatureSet> *ctxActive) const
+{
+  Sums const &sums = *d_sums;
+  Zs const &zs = *d_zs;
+
+  ctxActive->clear();
+  ctxActive->resize(contexts.size());
   
-  return ctxActive;
+  ContextScheduler scheduler(nonZeros);
+  #pragma omp parallel
+  {
+    ContextRange range;
+    while (scheduler.next(&range))
+      for (size_t k = range.begin; k < range.end; ++k)
+      {
+        size_t i = offset + k;
+
+        // This context can not have active features if its probability is
+        // zero.
+        if (contexts[k].prob() == 0.0)
+          continue;
+
+        FeatureSet &active = (*ctxActive)[k];
+        FeatureValues const &featureVals = contexts[k].featureValues();
+        for (int j = 0; j < featureVals.outerSize(); ++j)
+        {
+          // This event can not have active features if its probability is
+          // zero.
+          if (p_yx(sums[i][j], zs[i]) == 0.0)
+            continue;
+
+          for (FeatureValues::InnerIterator fIter(featureVals, j);
+              fIter; ++fIter)
+            if (d_excludedFeatures.find(fIter.index()) == d_excludedFeatures.end() &&
+                fIter.value() != 0.0)
+              active.insert(fIter.index());
+        }
+      }
+  }
 }
 
-ExpectedValues fsqueeze::expFeatureValues(DsFeatureMap const &features, int nFeatures)
+vector<FeatureSet> const &ContextActiveFeatures::shard(
+  ShardCursor const &cursor, vector<FeatureSet> *buffer) const
 {
-  ExpectedValues expVals = ExpectedValues::Zero(nFeatures);
+  if (!d_dataSet->outOfCore())
+    return d_contexts;
+
+  determine(cursor.contexts(), cursor.offset(), cursor.nonZeroOffsets(),
+    buffer);
+  return *buffer;
+}
+
+void fsqueeze::normalizeContext(double oldZ, Sum *ctxSums, double *z)
+{
+  // Subtracting a dominant sum from Z(x) leaves its rounding error.
+  if (!(*z > oldZ * 1e-8))
+    *z = ctxSums->cast<double>().sum();
+
+  if (*z >= MIN_Z && *z <= MAX_Z)
+    return;
+
+  if (!(*z > 0.0) || isinf(*z))
+    return;
+
+  int exponent;
+  frexp(*z, &exponent);
+  double scale = ldexp(1.0, -exponent);
+
+  *ctxSums *= scale;
+  *z *= scale;
+}
+
+ExpectedValues fsqueeze::expFeatureValues(ContextVector const &contexts,
+  int nFeatures)
+{
+  ExpectedValues expVals = hugePageZero<ExpectedValues>(nFeatures);
   
-  for (DsFeatureMap::const_iterator fIter = features.begin();
-    fIter != features.end(); ++fIter)
+  for (ContextVector::const_iterator ctxIter = contexts.begin();
+      ctxIter != contexts.end(); ++ctxIter)
   {
-    double expVal = 0.0;
-    for (std::vector<std::pair<double, double> >::const_iterator occIter =
-        fIter->second.begin(); occIter != fIter->second.end();
-        ++occIter)
-      expVal += occIter->first * occIter->second;
-    expVals[fIter->first] = expVal;
+    FeatureValues const &featureVals = ctxIter->featureValues();
+    for (int j = 0; j < featureVals.outerSize(); ++j)
+      for (FeatureValues::InnerIterator fIter(featureVals, j); fIter; ++fIter)
+        expVals[fIter.index()] += ctxIter->eventProbs()[j] * fIter.value();
   }
   
   return expVals;
 }
 
+// Contributions of the blocks of the current shard of a cursor to the
+// model expectations.
+void shardExpModelBlockSums(ShardCursor const &shard, DataSet const &dataSet,
+  Sums const &sums, Zs const &zs, vector<BlockVectorSums> *blockSums)
+{
+  ContextVector const &contexts = shard.contexts();
+  size_t offset = shard.offset();
+
+  blockSums->assign(reductionBlocks(contexts.size()), BlockVectorSums());
+  ContextScheduler scheduler(shard, REDUCTION_BLOCK_SIZE);
+  #pragma omp parallel
+  {
+    BlockAccumulator &accumulator =
+      threadBlockAccumulator(dataSet.nFeatures());
+    ContextRange range;
+    while (scheduler.next(&range))
+      for (size_t b = range.begin / REDUCTION_BLOCK_SIZE;
+          b < reductionBlocks(range.end); ++b)
+      {
+        for (size_t k = reductionBlockBegin(b);
+            k < reductionBlockEnd(b, contexts.size()); ++k)
+        {
+          size_t i = offset + k;
+          FeatureValues const &featureVals = contexts[k].featureValues();
+          
+          for (int j = 0; j < featureVals.outerSize(); ++j)
+          {
+            double pyx = p_yx(sums[i][j], zs[i]);
+            
+            for (FeatureValues::InnerIterator fIter(featureVals, j);
+                fIter; ++fIter)
+              accumulator.add(fIter.index(),
+                contexts[k].prob() * pyx * fIter.value());
+          }
+        }
+
+        accumulator.finish(&(*blockSums)[b]);
+      }
+  }
+}
+
 ExpectedValues fsqueeze::expModelFeatureValues(
   DataSet const &dataSet,
-  Sums const &sums, Zs const &zs)
+  Sums const &sums, Zs const &zs,
+  bool deterministic)
 {
-  ExpectedValues expVals = ExpectedValues::Zero(dataSet.nFeatures());
+  ExpectedValues expVals =
+    hugePageZero<ExpectedValues>(dataSet.nFeatures());
 
-  ContextVector::const_iterator ctxIter = dataSet.contexts().begin();
-  size_t i = 0;
-  while (ctxIter != dataSet.contexts().end())
+  if (deterministic)
   {
-    FeatureValues const &featureVals = ctxIter->featureValues();
-    
-    for (int j = 0; j < featureVals.outerSize(); ++j)
+    // Shards start at block boundaries, so adding the blocks of every shard
+    // adds all blocks in order.
+    vector<BlockVectorSums> blockSums;
+    for (ShardCursor shard(dataSet); shard.next(); )
+    {
+      shardExpModelBlockSums(shard, dataSet, sums, zs, &blockSums);
+      for (size_t b = 0; b < blockSums.size(); ++b)
+        addBlockSums(blockSums[b], &expVals);
+    }
+
+    return expVals;
+  }
+
+  for (ShardCursor shard(dataSet); shard.next(); )
+  {
+    ContextVector::const_iterator ctxIter = shard.contexts().begin();
+    size_t i = shard.offset();
+    while (ctxIter != shard.contexts().end())
     {
-      double pyx = p_yx(sums[i][j], zs[i]);
+      FeatureValues const &featureVals = ctxIter->featureValues();
+      
+      for (int j = 0; j < featureVals.outerSize(); ++j)
+      {
+        double pyx = p_yx(sums[i][j], zs[i]);
+        
+        for (FeatureValues::InnerIterator fIter(featureVals, j);
+            fIter; ++fIter)
+          expVals[fIter.index()] += ctxIter->prob() * pyx * fIter.value();
+      }
       
-      for (FeatureValues::InnerIterator fIter(featureVals, j);
-          fIter; ++fIter)
-        expVals[fIter.index()] += ctxIter->prob() * pyx * fIter.value();
+      ++ctxIter; ++i;
     }
-    
-    ++ctxIter; ++i;
   }
   
   return expVals;
 }
 
+vector<BlockVectorSums> fsqueeze::expModelBlockSums(DataSet const &dataSet,
+  Sums const &sums, Zs const &zs)
+{
+  vector<BlockVectorSums> blockSums;
+  blockSums.reserve(reductionBlocks(dataSet.nContexts()));
+
+  vector<BlockVectorSums> shardSums;
+  for (ShardCursor shard(dataSet); shard.next(); )
+  {
+    shardExpModelBlockSums(shard, dataSet, sums, zs, &shardSums);
+    for (size_t b = 0; b < shardSums.size(); ++b)
+      blockSums.push_back(std::move(shardSums[b]));
+  }
+
+  return blockSums;
+}
+
+Sums::Sums() : d_data(0), d_capacity(0), d_nEvents(0) {}
+
+Sums::Sums(size_t nEvents) : d_data(0), d_capacity(nEvents), d_nEvents(0)
+{
+  if (nEvents > static_cast<size_t>(-1) / sizeof(StorageScalar))
+    throw bad_alloc();
+
+  if (nEvents != 0)
+    d_data = static_cast<StorageScalar *>(
+      allocateHugePages(nEvents * sizeof(StorageScalar)));
+}
+
+// The maps of the copy point into its own storage.
+Sums::Sums(Sums const &other) : Sums(other.d_capacity)
+{
+  copy(other.d_data, other.d_data + other.d_nEvents, d_data);
+  d_sums.reserve(other.d_sums.size());
+  for (size_t i = 0; i < other.d_sums.size(); ++i)
+    addContext(other.d_sums[i].size());
+}
+
+Sums::Sums(Sums &&other) noexcept : Sums()
+{
+  swap(other);
+}
+
+Sums::~Sums()
+{
+  if (d_data != 0)
+    deallocateHugePages(d_data, d_capacity * sizeof(StorageScalar));
+}
+
+Sums &Sums::operator=(Sums const &other)
+{
+  if (this != &other)
+  {
+    Sums tmp(other);
+    swap(tmp);
+  }
+
+  return *this;
+}
+
+Sums &Sums::operator=(Sums &&other) noexcept
+{
+  swap(other);
+  return *this;
+}
+
+void Sums::addContext(size_t nEvents)
+{
+  if (nEvents > d_capacity - d_nEvents)
+    throw logic_error("Sums::addContext: storage of the sums is exhausted");
+
+  d_sums.push_back(Sum(d_data + d_nEvents, nEvents));
+  d_nEvents += nEvents;
+}
+
+// The maps are swapped with the vectors, and keep pointing into the
+// storage that they were created for.
+void Sums::swap(Sums &other)
+{
+  std::swap(d_data, other.d_data);
+  std::swap(d_capacity, other.d_capacity);
+  std::swap(d_nEvents, other.d_nEvents);
+  d_sums.swap(other.d_sums);
+}
+
+FeatureOccurrences::FeatureOccurrences(DataSet const &dataSet)
+{
+  if (dataSet.outOfCore())
+  {
+    d_data = dataSet.shards()->occurrences();
+    d_dataOffsets = dataSet.shards()->occurrenceOffsets();
+    return;
+  }
+
+  ValueDictionary const &dictionary = dataSet.valueDictionary();
+  ContextVector const &contexts = dataSet.contexts();
+
+  // Count the occurrences of each feature, and then fill in the lists.
+  d_offsets.resize(dataSet.nFeatures() + 1);
+  for (size_t i = 0; i < contexts.size(); ++i)
+  {
+    FeatureValues const &featureVals = contexts[i].featureValues();
+    for (int j = 0; j < featureVals.outerSize(); ++j)
+      for (FeatureValues::InnerIterator fIter(featureVals, j); fIter; ++fIter)
+        if (fIter.value() != 0.0)
+          ++d_offsets[fIter.index() + 1];
+  }
+
+  for (size_t f = 1; f < d_offsets.size(); ++f)
+    d_offsets[f] += d_offsets[f - 1];
+
+  d_occurrences.resize(d_offsets.back());
+  vector<uint64_t> next(d_offsets.begin(), d_offsets.end() - 1);
+
+  for (size_t i = 0; i < contexts.size(); ++i)
+  {
+    FeatureValues const &featureVals = contexts[i].featureValues();
+    for (int j = 0; j < featureVals.outerSize(); ++j)
+      for (FeatureValues::InnerIterator fIter(featureVals, j); fIter; ++fIter)
+        if (fIter.value() != 0.0)
+        {
+          unsigned char valueIndex = dictionary.empty() ? 0 :
+            static_cast<unsigned char>(dictionary.index(fIter.value()));
+          FeatureOccurrence occurrence = {i, fIter.value(),
+            static_cast<unsigned int>(j), valueIndex};
+          d_occurrences[next[fIter.index()]++] = occurrence;
+        }
+  }
+
+  d_data = d_occurrences.data();
+  d_dataOffsets = d_offsets.data();
+}
+
 Zs fsqueeze::initialZs(DataSet const &ds)
 {
-  size_t nContexts = ds.contexts().size();
-  ContextVector const &contexts = ds.contexts();
-  
-  Zs zs(nContexts);
-  for (size_t i = 0; i < nContexts; ++i)
-    zs[i] = contexts[i].eventProbs().size();
+  Zs zs = hugePageZero<Zs>(ds.nContexts());
+
+  for (ShardCursor shard(ds); shard.next(); )
+  {
+    ContextVector const &contexts = shard.contexts();
+    size_t offset = shard.offset();
+
+    ContextScheduler scheduler(shard);
+    #pragma omp parallel
+    {
+      ContextRange range;
+      while (scheduler.next(&range))
+        for (size_t k = range.begin; k < range.end; ++k)
+          zs[offset + k] = contexts[k].eventCounts().sum();
+    }
+  }
   
   return zs;
 }
 
 Sums fsqueeze::initialSums(DataSet const &ds)
 {
-  Sums sums;
+  size_t nEvents = 0;
+  if (ds.outOfCore())
+    nEvents = ds.shards()->nEvents();
+  else
+    for (ContextVector::const_iterator iter = ds.contexts().begin();
+        iter != ds.contexts().end(); ++iter)
+      nEvents += iter->eventCounts().size();
+
+  Sums sums(nEvents);
 
-  transform(ds.contexts().begin(), ds.contexts().end(), back_inserter(sums),
-    makeSumVector());
+  for (ShardCursor shard(ds); shard.next(); )
+  {
+    ContextVector const &contexts = shard.contexts();
+    size_t offset = shard.offset();
+
+    for (size_t k = 0; k < contexts.size(); ++k)
+      sums.addContext(contexts[k].eventCounts().size());
+
+    // Touch the sums of a context in the thread that processes it.
+    ContextScheduler scheduler(shard);
+    #pragma omp parallel
+    {
+      ContextRange range;
+      while (scheduler.next(&range))
+        for (size_t k = range.begin; k < range.end; ++k)
+          sums[offset + k] = makeSumVector()(contexts[k]);
+    }
+  }
   
   return sums;
 }
@@ -300,6 +1107,65 @@ Eigen::VectorXd fsqueeze::lbfgs_maxent(DataSet const &dataSet,
   return weights;
 }
 
+// Log-likelihood of a context with at most MaxEvents events, adding its
+// contribution to the model expectations to grad. The sums are kept on the
+// stack, unless MaxEvents is dynamic.
+template <int MaxEvents>
+double contextLogLikelihood(Context const &context,
+  FeatureSet const &featureSet, lbfgsfloatval_t const *x,
+  Eigen::VectorXd *grad)
+{
+  double ctxLl = 0.0;
+
+  FeatureValues const &featureVals = context.featureValues();
+  int nEvents = context.eventProbs().size();
+  
+  EventVector<double, MaxEvents> sums =
+    EventVector<double, MaxEvents>::Zero(nEvents);
+  double z = 0.0;
+  
+  // Calculate unnormalized probabilities, and the normalizer (Z(x)).
+  for (int j = 0; j < featureVals.outerSize(); ++j)
+    for (FeatureValues::InnerIterator fIter(featureVals, j);
+        fIter; ++fIter)
+      if (featureSet.find(fIter.index()) != featureSet.end())
+        sums[j] += x[fIter.index()] * fIter.value();
+
+  // Shift the log-sums if exponentiation could overflow or underflow. The
+  // maximum is taken with a scalar loop, since the vectorized reductions of
+  // Eigen can read past the storage of fixed-capacity vectors.
+  double shift = nEvents == 0 ? 0.0 : sums[0];
+  for (int j = 1; j < nEvents; ++j)
+    shift = max(shift, sums[j]);
+  if (fabs(shift) <= MAX_LOG_SUM)
+    shift = 0.0;
+
+  EventCounts const &counts = context.eventCounts();
+  for (int j = 0; j < nEvents; ++j)
+  {
+    sums[j] = counts[j] * exp(sums[j] - shift);
+    z += sums[j];
+  }
+  
+  for (int j = 0; j < featureVals.outerSize(); ++j)
+  {
+    // Conditional probability of the event y, given the context x.
+    double pyx = p_yx(sums[j], z);
+    
+    // Update log-likelihood of the model. Each occurrence of a folded
+    // event has probability pyx / count.
+    ctxLl += context.eventProbs()[j] * log(pyx / counts[j]);
+    
+    // Contribution of this context to p(f).
+    for (FeatureValues::InnerIterator fIter(featureVals, j);
+        fIter; ++fIter)
+      if (featureSet.find(fIter.index()) != featureSet.end())
+        (*grad)[fIter.index()] += context.prob() * pyx * fIter.value();
+  }
+
+  return ctxLl;
+}
+
 lbfgsfloatval_t lbfgs_maxent_evaluate(void *instance, lbfgsfloatval_t const *x,
   lbfgsfloatval_t *g, int const n, lbfgsfloatval_t const step)
 {
@@ -310,58 +1176,43 @@ lbfgsfloatval_t lbfgs_maxent_evaluate(void *instance, lbfgsfloatval_t const *x,
   DataSet const *dataSet = evalData->dataSet;
   FeatureSet const *featureSet = evalData->featureSet;
 
+  // The log-likelihood and gradient are accumulated in double precision,
+  // also when L-BFGS uses single precision.
+  Eigen::VectorXd grad(n);
   Eigen::VectorXd const &expVals = dataSet->expFeatureValues();
   for (int i = 0; i < n; ++i)
     if (featureSet->find(i) != featureSet->end())
-      g[i] = -expVals[i];
-
-  lbfgsfloatval_t ll = 0.0;
+      grad[i] = -expVals[i];
 
-  ContextVector const &ctxs = dataSet->contexts();
+  double ll = 0.0;
 
-  for (int i = 0; i < ctxs.size(); ++i)
+  for (ShardCursor shard(*dataSet); shard.next(); )
   {
-    lbfgsfloatval_t ctxLl = 0.0;
+    ContextVector const &ctxs = shard.contexts();
 
-    // Skip contexts that have a probability of zero. If we allow such
-    // contexts, we can not calculate empirical p(y|x).
-    if (ctxs[i].prob() == 0.0)
-      continue;
-
-    FeatureValues const &featureVals = ctxs[i].featureValues();
-    int nEvents = ctxs[i].eventProbs().size();
-    
-    Eigen::VectorXd sums = Eigen::VectorXd::Zero(nEvents);
-    double z = 0.0;
-    
-    // Calculate unnormalized probabilities, and the normalizer (Z(x)).
-    for (int j = 0; j < featureVals.outerSize(); ++j)
+    for (int i = 0; i < ctxs.size(); ++i)
     {
-      for (FeatureValues::InnerIterator fIter(featureVals, j);
-          fIter; ++fIter)
-        if (featureSet->find(fIter.index()) != featureSet->end())
-          sums[j] += x[fIter.index()] * fIter.value();
+      double ctxLl = 0.0;
 
-      sums[j] = exp(sums[j]);
-      z += sums[j];
-    }
-    
-    for (int j = 0; j < featureVals.outerSize(); ++j)
-    {
-      // Conditional probability of the event y, given the context x.
-      double pyx = p_yx(sums[j], z);
-      
-      // Update log-likelihood of the model.
-      ctxLl += ctxs[i].eventProbs()[j] * log(pyx);
-      
-      // Contribution of this context to p(f).
-      for (FeatureValues::InnerIterator fIter(featureVals, j);
-          fIter; ++fIter)
-        if (featureSet->find(fIter.index()) != featureSet->end())
-          g[fIter.index()] += ctxs[i].prob() * pyx * fIter.value();
-    }
+      // Skip contexts that have a probability of zero. If we allow such
+      // contexts, we can not calculate empirical p(y|x).
+      if (ctxs[i].prob() == 0.0)
+        continue;
+
+      int nEvents = ctxs[i].eventProbs().size();
+      if (nEvents <= 4)
+        ctxLl = contextLogLikelihood<4>(ctxs[i], *featureSet, x, &grad);
+      else if (nEvents <= 8)
+        ctxLl = contextLogLikelihood<8>(ctxs[i], *featureSet, x, &grad);
+      else if (nEvents <= SMALL_CONTEXT_SIZE)
+        ctxLl = contextLogLikelihood<SMALL_CONTEXT_SIZE>(ctxs[i], *featureSet,
+          x, &grad);
+      else
+        ctxLl = contextLogLikelihood<Eigen::Dynamic>(ctxs[i], *featureSet, x,
+          &grad);
 
-    ll += ctxLl;
+      ll += ctxLl;
+    }
   }
 
   // Gaussian prior
@@ -374,11 +1225,15 @@ lbfgsfloatval_t lbfgs_maxent_evaluate(void *instance, lbfgsfloatval_t const *x,
       iter != featureSet->end(); ++iter)
     {
       fSqSum += pow(x[*iter], 2.0);
-      g[*iter] += x[*iter] * sMult;
+      grad[*iter] += x[*iter] * sMult;
     }
 
     ll -= fSqSum * 0.5 * sMult;
   }
+
+  for (FeatureSet::const_iterator iter = featureSet->begin();
+      iter != featureSet->end(); ++iter)
+    g[*iter] = grad[*iter];
   
   return -ll;
 }
@@ -396,12 +1251,47 @@ int lbfgs_maxent_progress(void *instance, const lbfgsfloatval_t *x, const lbfgsf
 double fsqueeze::zf(FeatureValues const &featureValues, Sum const &ctxSums,
   double z, size_t feature, double alpha)
 {
-  for (int i = 0; i < featureValues.outerSize(); ++i)
-  {
-    double fVal = featureValues.coeff(i, feature);
-    if (fVal != 0.0)
-      z = z - ctxSums[i] + ctxSums[i] * exp(alpha * fVal);
-  }
-  
-  return z;
+  return zf(featureValues, ctxSums, z, feature, ExpFactor(alpha));
+}
+
+double fsqueeze::logZRatio(FeatureValues const &featureValues,
+  Sum const &ctxSums, double z, size_t feature, double alpha,
+  double const *factor)
+{
+  double newZ = zf(featureValues, ctxSums, z, feature, alpha, factor);
+  if (regularZ(newZ, z))
+    return log(newZ / z);
+
+  LogFactors logFactors;
+  featureLogFactors(featureValues, feature, alpha, &logFactors);
+  return shiftedLogZRatio(logFactors, ctxSums, z, 0);
+}
+
+IndicatorFactors fsqueeze::indicatorFactors(DataSet const &dataSet,
+  FeatureWeights const &alphas, FeatureSet const &features)
+{
+  IndicatorFactors factors;
+  if (!dataSet.valueDictionary().indicator())
+    return factors;
+
+  factors.resize(alphas.size());
+  for (FeatureSet::const_iterator iter = features.begin();
+      iter != features.end(); ++iter)
+    factors[*iter] = exp(alphas[*iter]);
+
+  return factors;
+}
+
+IndicatorFactors fsqueeze::indicatorFactors(DataSet const &dataSet,
+  FeatureWeights const &alphas)
+{
+  IndicatorFactors factors;
+  if (!dataSet.valueDictionary().indicator())
+    return factors;
+
+  factors.resize(alphas.size());
+  for (int f = 0; f < alphas.size(); ++f)
+    factors[f] = exp(alphas[f]);
+
+  return factors;
 }
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+#include "scheduler.ih"
+
+namespace {
+
+thread_local BusyTimes *s_busyTimes = 0;
+
+double now()
+{
+	return chrono::duration<double>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int threadNumber()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+// Threads that can call next(). Within a parallel region, a nested region
+// may get fewer threads, so one thread owns all chunks and the others
+// steal.
+size_t schedulerThreads(size_t *nOwners)
+{
+#ifdef _OPENMP
+	size_t nThreads = omp_get_max_threads();
+	*nOwners = omp_in_parallel() ? 1 : nThreads;
+	return nThreads;
+#else
+	*nOwners = 1;
+	return 1;
+#endif
+}
+
+uint64_t packChunks(size_t begin, size_t end)
+{
+	return static_cast<uint64_t>(begin) | static_cast<uint64_t>(end) << 32;
+}
+
+// The weight of contexts 0..k-1: their non-zeros, plus one per context, so
+// that contexts without non-zeros are spread as well.
+uint64_t weight(NonZeroOffsets const &offsets, size_t k)
+{
+	return offsets[k] + k;
+}
+
+}
+
+void fsqueeze::countNonZeros(ContextVector const &contexts,
+	NonZeroOffsets *offsets)
+{
+	offsets->resize(contexts.size() + 1);
+	(*offsets)[0] = 0;
+	for (size_t k = 0; k < contexts.size(); ++k)
+		(*offsets)[k + 1] = (*offsets)[k] + contexts[k].featureValues().nonZeros();
+}
+
+void BusyTimes::add(size_t thread, double busy)
+{
+	lock_guard<mutex> lock(d_mutex);
+	if (d_times.size() <= thread)
+		d_times.resize(thread + 1);
+
+	d_times[thread] += busy;
+}
+
+vector<double> BusyTimes::times() const
+{
+	lock_guard<mutex> lock(d_mutex);
+	return d_times;
+}
+
+BusyTimesScope::BusyTimesScope(BusyTimes *busyTimes) :
+	d_previous(s_busyTimes)
+{
+	s_busyTimes = busyTimes;
+}
+
+BusyTimesScope::~BusyTimesScope()
+{
+	s_busyTimes = d_previous;
+}
+
+BusyTimes *fsqueeze::currentBusyTimes()
+{
+	return s_busyTimes;
+}
+
+ContextScheduler::ContextScheduler(ShardCursor const &shard,
+	size_t granularity) : d_busyTimes(s_busyTimes)
+{
+	partition(shard.nonZeroOffsets(), granularity);
+}
+
+ContextScheduler::ContextScheduler(NonZeroOffsets const &offsets,
+	size_t granularity) : d_busyTimes(s_busyTimes)
+{
+	partition(offsets, granularity);
+}
+
+ContextScheduler::~ContextScheduler()
+{
+	if (d_busyTimes == 0)
+		return;
+
+	for (size_t t = 0; t < d_nThreads; ++t)
+		d_busyTimes->add(t, d_threads[t].busy);
+}
+
+// Chunk boundaries are the granule boundaries that are closest to equal
+// shares of the total weight. Thread t owns chunks
+// [t * nChunks / nOwners, (t + 1) * nChunks / nOwners).
+void ContextScheduler::partition(NonZeroOffsets const &offsets,
+	size_t granularity)
+{
+	size_t nOwners;
+	d_nThreads = schedulerThreads(&nOwners);
+	d_threads.reset(new ThreadState[d_nThreads]);
+
+	size_t n = offsets.size() == 0 ? 0 : offsets.size() - 1;
+	size_t nGranules = (n + granularity - 1) / granularity;
+	size_t nChunks = min(nGranules, nOwners == 1 ? 1 : nOwners * CHUNKS_PER_THREAD);
+
+	d_chunkBegins.push_back(0);
+	uint64_t total = n == 0 ? 0 : weight(offsets, n);
+	for (size_t c = 1; c < nChunks; ++c)
+	{
+		uint64_t target = total / nChunks * c + total % nChunks * c / nChunks;
+
+		// First granule boundary with at least the target weight.
+		size_t lo = d_chunkBegins.back() / granularity + 1;
+		size_t hi = nGranules;
+		while (lo < hi)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			if (weight(offsets, mid * granularity) < target)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo < nGranules)
+			d_chunkBegins.push_back(lo * granularity);
+	}
+	if (n != 0)
+		d_chunkBegins.push_back(n);
+
+	nChunks = d_chunkBegins.size() - 1;
+	for (size_t t = 0; t < nOwners; ++t)
+		d_threads[t].chunks.store(packChunks(t * nChunks / nOwners,
+			(t + 1) * nChunks / nOwners));
+}
+
+bool ContextScheduler::next(ContextRange *range)
+{
+	size_t thread = threadNumber();
+	double time = now();
+
+	size_t chunk;
+	bool found;
+	if (thread < d_nThreads)
+	{
+		ThreadState &state = d_threads[thread];
+		if (state.start >= 0.0)
+			state.busy += time - state.start;
+
+		found = take(thread, &chunk) || steal(thread, &chunk);
+		state.start = found ? time : -1.0;
+	}
+	else
+		found = steal(thread, &chunk);
+
+	if (!found)
+		return false;
+
+	range->begin = d_chunkBegins[chunk];
+	range->end = d_chunkBegins[chunk + 1];
+
+	return true;
+}
+
+// Take the first chunk of the own range.
+bool ContextScheduler::take(size_t thread, size_t *chunk)
+{
+	atomic<uint64_t> &chunks = d_threads[thread].chunks;
+	uint64_t packed = chunks.load();
+	while (true)
+	{
+		size_t begin = packed & 0xffffffff;
+		size_t end = packed >> 32;
+		if (begin >= end)
+			return false;
+
+		if (chunks.compare_exchange_weak(packed, packChunks(begin + 1, end)))
+		{
+			*chunk = begin;
+			return true;
+		}
+	}
+}
+
+// Take the last chunk of the range of another thread.
+bool ContextScheduler::steal(size_t thread, size_t *chunk)
+{
+	for (size_t i = 1; i <= d_nThreads; ++i)
+	{
+		atomic<uint64_t> &chunks = d_threads[(thread + i) % d_nThreads].chunks;
+		uint64_t packed = chunks.load();
+		while (true)
+		{
+			size_t begin = packed & 0xffffffff;
+			size_t end = packed >> 32;
+			if (begin >= end)
+				break;
+
+			if (chunks.compare_exchange_weak(packed, packChunks(begin, end - 1)))
+			{
+				*chunk = end - 1;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
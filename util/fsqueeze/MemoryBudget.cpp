@@ -0,0 +1,95 @@
+#include "MemoryBudget.ih"
+
+size_t fsqueeze::parseMemorySize(string const &size)
+{
+	if (size.empty())
+		throw invalid_argument("Empty memory size");
+
+	size_t multiplier = 1;
+	string number = size;
+	switch (size[size.size() - 1])
+	{
+	case 'G':
+		multiplier <<= 10;
+		// Fall through.
+	case 'M':
+		multiplier <<= 10;
+		// Fall through.
+	case 'K':
+		multiplier <<= 10;
+		number = size.substr(0, size.size() - 1);
+	}
+
+	if (number.empty() ||
+			number.find_first_not_of("0123456789") != string::npos)
+		throw invalid_argument("Invalid memory size: " + size);
+
+	// parseString fails on numbers that do not fit in size_t.
+	size_t value;
+	try {
+		value = parseString<size_t>(number);
+	} catch (invalid_argument const &) {
+		throw invalid_argument("Memory size too large: " + size);
+	}
+
+	if (value > numeric_limits<size_t>::max() / multiplier)
+		throw invalid_argument("Memory size too large: " + size);
+
+	return value * multiplier;
+}
+
+MemoryUsage fsqueeze::jobMemoryUsage(vector<DataSet const *> const &dataSets,
+	SelectionJob const &job, size_t nSelections)
+{
+	MemoryUsage usage;
+	for (vector<DataSet const *>::const_iterator iter = dataSets.begin();
+			iter != dataSets.end(); ++iter)
+		addMemoryUsage(&usage, (*iter)->memoryUsage());
+
+	// Correlation selection only uses a few vectors per feature.
+	if (nSelections != 0 && job.algorithm != ALGORITHM_CORRELATION)
+		addMemoryUsage(&usage, selectionMemoryUsage(*dataSets[job.dataSet],
+			job.param, job.algorithm == ALGORITHM_FAST), nSelections);
+
+	return usage;
+}
+
+void fsqueeze::logMemoryUsage(Logger logger, MemoryUsage const &usage)
+{
+	ostream &out = logger.error();
+	ios::fmtflags flags = out.flags();
+	streamsize precision = out.precision();
+
+	out << "Estimated memory use (MB):" << endl << fixed << setprecision(1);
+	for (MemoryUsage::const_iterator iter = usage.begin(); iter != usage.end();
+			++iter)
+		out << "  " << left << setw(32) << iter->first << right << setw(10) <<
+			iter->second / 1048576.0 << endl;
+	out << "  " << left << setw(32) << "total" << right << setw(10) <<
+		memoryTotal(usage) / 1048576.0 << endl;
+
+	out.flags(flags);
+	out.precision(precision);
+}
+
+void fsqueeze::logHugePageUsage(Logger logger, HugePageUsage const &usage)
+{
+	ostream &out = logger.error();
+	ios::fmtflags flags = out.flags();
+	streamsize precision = out.precision();
+
+	out << "Huge pages (MB):" << endl << fixed << setprecision(1) << left <<
+		"  " << setw(32) << "hugetlb buffers (peak)" << right << setw(10) <<
+			usage.peakHugetlbBytes / 1048576.0 << endl << left <<
+		"  " << setw(32) << "transparent buffers (peak)" << right << setw(10) <<
+			usage.peakTransparentBytes / 1048576.0 << endl << left <<
+		"  " << setw(32) << "anonymous huge pages" << right << setw(10) <<
+			usage.anonHugeBytes / 1048576.0 << endl << left <<
+		"  " << setw(32) << "shared huge pages" << right << setw(10) <<
+			usage.sharedHugeBytes / 1048576.0 << endl << left <<
+		"  " << setw(32) << "hugetlb pages" << right << setw(10) <<
+			usage.hugetlbMappedBytes / 1048576.0 << endl;
+
+	out.flags(flags);
+	out.precision(precision);
+}
@@ -0,0 +1,44 @@
+#ifndef MEMORYBUDGET_HH
+#define MEMORYBUDGET_HH
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "FeatureSqueeze/DataSet.hh"
+#include "FeatureSqueeze/Logger.hh"
+#include "FeatureSqueeze/hugepages.hh"
+#include "FeatureSqueeze/memory.hh"
+
+#include "SelectionJob.hh"
+
+namespace fsqueeze
+{
+
+/**
+ * Parse a memory size: a number of bytes, optionally followed by K, M or
+ * G for kibibytes, mebibytes or gibibytes.
+ */
+size_t parseMemorySize(std::string const &size);
+
+/**
+ * Estimate the memory use of running nSelections instances of a job
+ * concurrently on the data sets.
+ */
+MemoryUsage jobMemoryUsage(std::vector<DataSet const *> const &dataSets,
+	SelectionJob const &job, size_t nSelections);
+
+/**
+ * Write a memory usage breakdown to the error stream of the logger.
+ */
+void logMemoryUsage(Logger logger, MemoryUsage const &usage);
+
+/**
+ * Write the huge page usage of the allocator and the process to the error
+ * stream of the logger.
+ */
+void logHugePageUsage(Logger logger, HugePageUsage const &usage);
+
+}
+
+#endif // MEMORYBUDGET_HH
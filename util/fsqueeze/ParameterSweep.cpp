@@ -0,0 +1,181 @@
+#include "ParameterSweep.ih"
+
+namespace {
+
+typedef vector<pair<string, vector<string> > > Grid;
+
+Grid parseGrid(string const &gridStr)
+{
+	Grid grid;
+
+	vector<string> entries = stringSplit(gridStr);
+	for (vector<string>::const_iterator iter = entries.begin();
+			iter != entries.end(); ++iter)
+	{
+		size_t sep = iter->find('=');
+		if (sep == string::npos)
+			throw invalid_argument("Expected key=value,...: " + *iter);
+
+		string key = iter->substr(0, sep);
+		if (key == "excludedFeatures" || key == "forcedFeatures")
+			throw invalid_argument("Feature lists cannot be varied in a sweep: " +
+				key);
+
+		vector<string> values;
+		istringstream iss(iter->substr(sep + 1));
+		string value;
+		while (getline(iss, value, ','))
+			values.push_back(value);
+
+		if (values.size() == 0)
+			throw invalid_argument("No values for: " + key);
+
+		grid.push_back(make_pair(key, values));
+	}
+
+	return grid;
+}
+
+struct SweepState
+{
+	SweepJobs const *jobs;
+	DataSet const *dataSet;
+	string prefix;
+	size_t nThreads;
+	Logger *logger;
+	size_t next;
+	pthread_mutex_t mutex;
+};
+
+void runSweepJob(pair<string, SelectionJob> const &namedJob,
+	SweepState *state, BusyTimes *busyTimes)
+{
+	string filename = state->prefix + "." + namedJob.first;
+	ofstream out(filename.c_str());
+	if (!out)
+		throw runtime_error("Could not open " + filename);
+
+	SelectionJob job(namedJob.second);
+	job.nThreads = state->nThreads;
+
+	BusyTimesScope busyScope(busyTimes);
+	runSelectionJob(job, *state->dataSet, Logger(out, state->logger->error()));
+}
+
+void *sweepWorker(void *data)
+{
+	SweepState *state = reinterpret_cast<SweepState *>(data);
+
+	while (true)
+	{
+		pthread_mutex_lock(&state->mutex);
+		size_t i = state->next++;
+		pthread_mutex_unlock(&state->mutex);
+
+		if (i >= state->jobs->size())
+			break;
+
+		pair<string, SelectionJob> const &namedJob = (*state->jobs)[i];
+
+		BusyTimes busyTimes;
+		string error;
+		try {
+			runSweepJob(namedJob, state, &busyTimes);
+		} catch (exception const &e) {
+			error = e.what();
+		}
+
+		pthread_mutex_lock(&state->mutex);
+		if (error.empty())
+		{
+			state->logger->error() << "Finished: " << namedJob.first << endl;
+			logBusyTimes(*state->logger, busyTimes);
+		}
+		else
+			state->logger->error() << "Failed: " << namedJob.first << ": " <<
+				error << endl;
+		pthread_mutex_unlock(&state->mutex);
+	}
+
+	return 0;
+}
+
+}
+
+SweepJobs fsqueeze::expandSweepGrid(string const &gridStr,
+	SelectionJob const &base)
+{
+	Grid grid = parseGrid(gridStr);
+
+	// Enumerate all combinations, the last key varies fastest.
+	SweepJobs jobs;
+	vector<size_t> idx(grid.size(), 0);
+	while (true)
+	{
+		string description;
+		string name;
+		for (size_t i = 0; i < grid.size(); ++i)
+		{
+			string setting = grid[i].first + "=" + grid[i].second[idx[i]];
+			description += setting + " ";
+			name += (i == 0 ? "" : "_") + setting;
+		}
+
+		SelectionJob job = parseSelectionJob(description, base);
+		jobs.push_back(make_pair(name.empty() ? string("default") : name, job));
+
+		size_t i = grid.size();
+		while (i > 0 && ++idx[i - 1] == grid[i - 1].second.size())
+		{
+			idx[i - 1] = 0;
+			--i;
+		}
+
+		if (i == 0)
+			break;
+	}
+
+	return jobs;
+}
+
+void fsqueeze::runSweep(SweepJobs const &jobs, DataSet const &dataSet,
+	string const &prefix, size_t concurrency, Logger logger)
+{
+	if (jobs.size() == 0)
+		return;
+
+	concurrency = min(max(concurrency, static_cast<size_t>(1)), jobs.size());
+
+	SweepState state;
+	state.jobs = &jobs;
+	state.dataSet = &dataSet;
+	state.prefix = prefix;
+	state.nThreads = max(static_cast<size_t>(executionThreads()) / concurrency,
+		static_cast<size_t>(1));
+	state.logger = &logger;
+	state.next = 0;
+	pthread_mutex_init(&state.mutex, 0);
+
+	logger.error() << "Sweep: " << jobs.size() << " configurations, " <<
+		concurrency << " concurrently, " << state.nThreads <<
+		" thread(s) each" << endl;
+
+	vector<pthread_t> workers;
+	for (size_t i = 0; i < concurrency; ++i)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, 0, sweepWorker, &state) != 0)
+			break;
+		workers.push_back(thread);
+	}
+
+	// Fall back to running in this thread if no worker could be created.
+	if (workers.size() == 0)
+		sweepWorker(&state);
+
+	for (vector<pthread_t>::const_iterator iter = workers.begin();
+			iter != workers.end(); ++iter)
+		pthread_join(*iter, 0);
+
+	pthread_mutex_destroy(&state.mutex);
+}
@@ -0,0 +1,37 @@
+#ifndef PARAMETERSWEEP_HH
+#define PARAMETERSWEEP_HH
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "FeatureSqueeze/DataSet.hh"
+#include "FeatureSqueeze/Logger.hh"
+
+#include "SelectionJob.hh"
+
+namespace fsqueeze
+{
+
+typedef std::vector<std::pair<std::string, SelectionJob> > SweepJobs;
+
+/**
+ * Expand a parameter grid into selection jobs. The grid consists of
+ * whitespace-separated key=value,value,... entries, using the keys of job
+ * descriptions (see parseSelectionJob). A job is created for every
+ * combination of values, parameters that are not in the grid are taken
+ * from base. Each job is paired with a name that describes its parameters.
+ */
+SweepJobs expandSweepGrid(std::string const &grid, SelectionJob const &base);
+
+/**
+ * Run selection jobs concurrently on one data set. The output of a job is
+ * written to the file prefix.name. At most concurrency jobs run at the same
+ * time, the available threads are divided between them.
+ */
+void runSweep(SweepJobs const &jobs, DataSet const &dataSet,
+	std::string const &prefix, size_t concurrency, Logger logger);
+
+}
+
+#endif // PARAMETERSWEEP_HH
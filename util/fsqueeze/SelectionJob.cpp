@@ -0,0 +1,198 @@
+#include "SelectionJob.ih"
+
+namespace {
+
+SelectionAlgorithm parseAlgorithm(string const &algorithm)
+{
+	if (algorithm == "full")
+		return ALGORITHM_FULL;
+	else if (algorithm == "fast")
+		return ALGORITHM_FAST;
+	else if (algorithm == "correlation")
+		return ALGORITHM_CORRELATION;
+
+	throw invalid_argument("Unknown algorithm: " + algorithm);
+}
+
+}
+
+vector<size_t> fsqueeze::parseFeatureList(string const &features)
+{
+	vector<size_t> featureList;
+
+	istringstream iss(features);
+	string feature;
+	while (getline(iss, feature, ','))
+		featureList.push_back(parseString<size_t>(feature));
+
+	return featureList;
+}
+
+SelectionJob fsqueeze::parseSelectionJob(string const &description)
+{
+	return parseSelectionJob(description, SelectionJob());
+}
+
+SelectionJob fsqueeze::parseSelectionJob(string const &description,
+	SelectionJob const &base)
+{
+	SelectionJob job(base);
+
+	vector<string> pairs = stringSplit(description);
+	for (vector<string>::const_iterator iter = pairs.begin();
+			iter != pairs.end(); ++iter)
+	{
+		size_t sep = iter->find('=');
+		if (sep == string::npos)
+			throw invalid_argument("Expected key=value: " + *iter);
+
+		string key = iter->substr(0, sep);
+		string value = iter->substr(sep + 1);
+
+		if (key == "dataSet")
+			job.dataSet = parseString<size_t>(value);
+		else if (key == "algorithm")
+			job.algorithm = parseAlgorithm(value);
+		else if (key == "alphaThreshold")
+			job.param.alphaThreshold = parseString<double>(value);
+		else if (key == "gainThreshold")
+			job.param.gainThreshold = parseString<double>(value);
+		else if (key == "nFeatures")
+			job.param.nFeatures = parseString<size_t>(value);
+		else if (key == "detectOverlap")
+			job.param.detectOverlap = parseString<bool>(value);
+		else if (key == "fullOptimizationCycles")
+			job.param.fullOptimizationCycles = parseString<size_t>(value);
+		else if (key == "fullOptimizationExpBase")
+			job.param.fullOptimizationExpBase = parseString<double>(value);
+		else if (key == "deterministic")
+			job.param.deterministic = parseString<bool>(value);
+		else if (key == "batchSize")
+			job.param.batchSize = parseString<size_t>(value);
+		else if (key == "batchOverlap")
+			job.param.batchOverlap = parseString<double>(value);
+		else if (key == "pruneGains")
+			job.param.pruneGains = parseString<bool>(value);
+		else if (key == "speculativeBatch")
+			job.param.speculativeBatch = parseString<size_t>(value);
+		else if (key == "featureParallel")
+			job.param.featureParallel = parseString<bool>(value);
+		else if (key == "excludedFeatures")
+			job.param.excludedFeatures = parseFeatureList(value);
+		else if (key == "forcedFeatures")
+			job.param.forcedFeatures = parseFeatureList(value);
+		else if (key == "minCorrelation")
+			job.minCorrelation = parseString<double>(value);
+		else if (key == "nThreads")
+			job.nThreads = parseString<size_t>(value);
+		else
+			throw invalid_argument("Unknown job parameter: " + key);
+	}
+
+	validateSelectionJob(job);
+
+	return job;
+}
+
+void fsqueeze::runSelectionJob(SelectionJob const &job, DataSet const &dataSet,
+	Logger logger)
+{
+	if (job.nThreads != 0)
+	{
+		ExecutionConfig config;
+		config.nThreads = job.nThreads;
+		applyExecutionConfig(config);
+	}
+
+	switch (job.algorithm)
+	{
+	case ALGORITHM_CORRELATION:
+		corrFeatureSelection(dataSet, logger, job.minCorrelation,
+			job.param.nFeatures);
+		break;
+	case ALGORITHM_FAST:
+		fastFeatureSelection(dataSet, logger, job.param);
+		break;
+	default:
+		featureSelection(dataSet, logger, job.param);
+	}
+}
+
+void fsqueeze::logBusyTimes(Logger logger, BusyTimes const &busyTimes)
+{
+	vector<double> times = busyTimes.times();
+	if (times.empty())
+		return;
+	
+	double total = 0.0;
+	double longest = 0.0;
+	logger.error() << "Thread busy time (s):";
+	for (size_t t = 0; t < times.size(); ++t)
+	{
+		logger.error() << " " << times[t];
+		total += times[t];
+		longest = max(longest, times[t]);
+	}
+	
+	if (total > 0.0)
+		logger.error() << ", imbalance: " <<
+			longest / (total / times.size());
+	logger.error() << endl;
+}
+
+void fsqueeze::validateSelectionJob(SelectionJob const &job)
+{
+	if (job.param.detectOverlap && job.algorithm == ALGORITHM_FAST)
+		throw invalid_argument("Overlap detection and fast selection cannot be "
+			"used simultaneously");
+
+	if (job.algorithm == ALGORITHM_CORRELATION &&
+			(job.param.fullOptimizationCycles != 0 ||
+			job.param.fullOptimizationExpBase != 0.0))
+		throw invalid_argument("L-BFGS optimization cannot be used with "
+			"correlation-based selection");
+
+	if (job.algorithm == ALGORITHM_CORRELATION &&
+			(job.param.excludedFeatures.size() != 0 ||
+			job.param.forcedFeatures.size() != 0))
+		throw invalid_argument("Excluded and forced features cannot be used "
+			"with correlation-based selection");
+
+	if (job.param.batchSize == 0)
+		throw invalid_argument("The batch size should be at least 1");
+
+	if (job.param.batchSize > 1 && job.algorithm != ALGORITHM_FULL)
+		throw invalid_argument("Batch selection can only be used with full "
+			"selection");
+
+	if (job.param.pruneGains && job.algorithm != ALGORITHM_FULL)
+		throw invalid_argument("Gain pruning can only be used with full "
+			"selection");
+
+	if (job.param.pruneGains && job.param.detectOverlap)
+		throw invalid_argument("Gain pruning and overlap detection cannot be "
+			"used simultaneously");
+
+	if (job.param.featureParallel && job.algorithm == ALGORITHM_CORRELATION)
+		throw invalid_argument("Feature-parallel stages cannot be used with "
+			"correlation-based selection");
+
+	if (job.param.speculativeBatch == 0)
+		throw invalid_argument("The speculative batch size should be at least 1");
+
+	if (job.param.batchOverlap < 0.0 || job.param.batchOverlap > 1.0)
+		throw invalid_argument("The batch overlap should be between 0 and 1");
+
+	if (job.param.alphaThreshold < MIN_ALPHA_THRESHOLD)
+	{
+		ostringstream msg;
+		msg << "The alpha threshold should be at least " << MIN_ALPHA_THRESHOLD <<
+			" with single-precision storage";
+		throw invalid_argument(msg.str());
+	}
+
+	if (job.param.fullOptimizationCycles != 0 &&
+			job.param.fullOptimizationExpBase != 0.0)
+		throw invalid_argument("fullOptimizationCycles and "
+			"fullOptimizationExpBase cannot be used simultaneously");
+}
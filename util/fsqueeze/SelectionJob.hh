@@ -0,0 +1,74 @@
+#ifndef SELECTIONJOB_HH
+#define SELECTIONJOB_HH
+
+#include <string>
+#include <vector>
+
+#include "FeatureSqueeze/DataSet.hh"
+#include "FeatureSqueeze/Logger.hh"
+#include "FeatureSqueeze/feature_selection.hh"
+#include "FeatureSqueeze/scheduler.hh"
+
+namespace fsqueeze
+{
+
+enum SelectionAlgorithm {
+	ALGORITHM_FULL,
+	ALGORITHM_FAST,
+	ALGORITHM_CORRELATION
+};
+
+/**
+ * A feature selection job: the algorithm and its parameters.
+ */
+struct SelectionJob
+{
+	SelectionJob() : dataSet(0), algorithm(ALGORITHM_FULL),
+		minCorrelation(0.9), nThreads(0) {}
+	size_t dataSet;
+	SelectionAlgorithm algorithm;
+	SelectionParameters param;
+	double minCorrelation;
+	size_t nThreads;
+};
+
+/**
+ * Parse a job description. A description consists of whitespace-separated
+ * key=value pairs, where the keys are the names of SelectionJob and
+ * SelectionParameters fields. Feature lists are comma-separated.
+ */
+SelectionJob parseSelectionJob(std::string const &description);
+
+/**
+ * Parse a job description, using base for parameters that are not
+ * in the description.
+ */
+SelectionJob parseSelectionJob(std::string const &description,
+	SelectionJob const &base);
+
+/**
+ * Parse a comma-separated list of features.
+ */
+std::vector<size_t> parseFeatureList(std::string const &features);
+
+/**
+ * Run a selection job, the selected features are written to the logger.
+ */
+void runSelectionJob(SelectionJob const &job, DataSet const &dataSet,
+	Logger logger);
+
+/**
+ * Log the time that each thread spent in the scheduled loops, and the
+ * ratio of the longest time to the mean.
+ */
+void logBusyTimes(Logger logger, BusyTimes const &busyTimes);
+
+/**
+ * Check whether the combination of job parameters is valid, throws an
+ * invalid_argument exception if not.
+ */
+void validateSelectionJob(SelectionJob const &job);
+
+}
+
+#endif // SELECTIONJOB_HH
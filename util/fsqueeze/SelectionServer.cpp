@@ -0,0 +1,239 @@
+#include "SelectionServer.ih"
+
+namespace {
+
+size_t const MAX_REQUEST_LENGTH = 1 << 20;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Stream buffer that writes to a socket. The buffer is flushed after
+// every write that contains a newline, so that clients receive selected
+// features as soon as they are found.
+class SocketStreamBuf : public streambuf
+{
+public:
+	SocketStreamBuf(int fd);
+	~SocketStreamBuf();
+protected:
+	int overflow(int c);
+	int sync();
+	streamsize xsputn(char const *s, streamsize n);
+private:
+	char d_buf[4096];
+	int d_fd;
+};
+
+SocketStreamBuf::SocketStreamBuf(int fd) : d_fd(fd)
+{
+	setp(d_buf, d_buf + sizeof(d_buf));
+}
+
+SocketStreamBuf::~SocketStreamBuf()
+{
+	sync();
+}
+
+int SocketStreamBuf::overflow(int c)
+{
+	if (sync() != 0)
+		return EOF;
+
+	if (c != EOF)
+	{
+		*pptr() = static_cast<char>(c);
+		pbump(1);
+	}
+
+	return c == EOF ? 0 : c;
+}
+
+int SocketStreamBuf::sync()
+{
+	char const *p = pbase();
+	while (p < pptr())
+	{
+		ssize_t n = send(d_fd, p, pptr() - p, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			setp(d_buf, d_buf + sizeof(d_buf));
+			return -1;
+		}
+		p += n;
+	}
+
+	setp(d_buf, d_buf + sizeof(d_buf));
+	return 0;
+}
+
+streamsize SocketStreamBuf::xsputn(char const *s, streamsize n)
+{
+	streamsize written = streambuf::xsputn(s, n);
+	if (memchr(s, '\n', n) != 0)
+		sync();
+	return written;
+}
+
+string readRequest(int fd)
+{
+	string request;
+
+	char c;
+	while (request.size() < MAX_REQUEST_LENGTH)
+	{
+		ssize_t n = recv(fd, &c, 1, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || c == '\n')
+			return request;
+		request += c;
+	}
+
+	throw runtime_error("Request too long");
+}
+
+struct Connection
+{
+	SelectionServer *server;
+	int fd;
+};
+
+// Remove a socket that was left behind by a previous server. Other files,
+// and sockets on which a server is still listening, are left alone.
+void removeStaleSocket(string const &socketPath, sockaddr_un const &addr)
+{
+	struct stat st;
+	if (lstat(socketPath.c_str(), &st) != 0)
+	{
+		if (errno == ENOENT)
+			return;
+		throw runtime_error("Could not stat " + socketPath + ": " +
+			strerror(errno));
+	}
+
+	if (!S_ISSOCK(st.st_mode))
+		throw runtime_error(socketPath + " exists and is not a socket");
+
+	int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe < 0)
+		throw runtime_error(string("Could not create socket: ") + strerror(errno));
+
+	int connected = connect(probe,
+		reinterpret_cast<sockaddr const *>(&addr), sizeof(addr));
+	int err = errno;
+	close(probe);
+
+	if (connected == 0)
+		throw runtime_error("Another server is listening on " + socketPath);
+	if (err != ECONNREFUSED)
+		throw runtime_error("Could not probe " + socketPath + ": " +
+			strerror(err));
+
+	unlink(socketPath.c_str());
+}
+
+}
+
+SelectionServer::SelectionServer(string const &socketPath,
+	vector<DataSet const *> const &dataSets, Logger logger)
+	: d_socketPath(socketPath), d_dataSets(dataSets), d_logger(logger)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (socketPath.size() >= sizeof(addr.sun_path))
+		throw runtime_error("Socket path too long: " + socketPath);
+	strcpy(addr.sun_path, socketPath.c_str());
+
+	removeStaleSocket(socketPath, addr);
+
+	d_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (d_socket < 0)
+		throw runtime_error(string("Could not create socket: ") + strerror(errno));
+
+	if (bind(d_socket, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+			listen(d_socket, SOMAXCONN) != 0)
+	{
+		int err = errno;
+		close(d_socket);
+		throw runtime_error("Could not listen on " + socketPath + ": " +
+			strerror(err));
+	}
+}
+
+SelectionServer::~SelectionServer()
+{
+	close(d_socket);
+	unlink(d_socketPath.c_str());
+}
+
+void SelectionServer::run()
+{
+	while (true)
+	{
+		int fd = accept(d_socket, 0, 0);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			throw runtime_error(string("Could not accept connection: ") +
+				strerror(errno));
+		}
+
+		Connection *connection = new Connection;
+		connection->server = this;
+		connection->fd = fd;
+
+		pthread_t thread;
+		if (pthread_create(&thread, 0, handleConnection, connection) != 0)
+		{
+			d_logger.error() << "Could not create a thread for a job" << endl;
+			close(fd);
+			delete connection;
+			continue;
+		}
+
+		pthread_detach(thread);
+	}
+}
+
+void *SelectionServer::handleConnection(void *connection)
+{
+	Connection *conn = reinterpret_cast<Connection *>(connection);
+	conn->server->handleJob(conn->fd);
+	close(conn->fd);
+	delete conn;
+
+	return 0;
+}
+
+void SelectionServer::handleJob(int fd)
+{
+	SocketStreamBuf buf(fd);
+	ostream out(&buf);
+	out.precision(d_logger.message().precision());
+
+	try {
+		string request = readRequest(fd);
+		SelectionJob job = parseSelectionJob(request);
+
+		if (job.dataSet >= d_dataSets.size())
+		{
+			ostringstream msg;
+			msg << "Unknown data set: " << job.dataSet;
+			throw invalid_argument(msg.str());
+		}
+
+		runSelectionJob(job, *d_dataSets[job.dataSet], Logger(out, out));
+
+		out << "OK\n";
+	} catch (exception const &e) {
+		out << "ERROR " << e.what() << "\n";
+	}
+
+	out.flush();
+}
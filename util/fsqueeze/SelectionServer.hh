@@ -0,0 +1,46 @@
+#ifndef SELECTIONSERVER_HH
+#define SELECTIONSERVER_HH
+
+#include <string>
+#include <vector>
+
+#include "FeatureSqueeze/DataSet.hh"
+#include "FeatureSqueeze/Logger.hh"
+
+namespace fsqueeze
+{
+
+/**
+ * A server that performs feature selection jobs on data sets that are
+ * loaded once. Clients connect to a Unix domain socket and send a single
+ * line with a job description (see parseSelectionJob). The selected
+ * features are streamed back as they are found, followed by a line that
+ * is either 'OK' or 'ERROR' plus a message. Every connection is handled in
+ * its own thread, jobs only read the data sets.
+ */
+class SelectionServer
+{
+public:
+	SelectionServer(std::string const &socketPath,
+		std::vector<DataSet const *> const &dataSets, Logger logger);
+	~SelectionServer();
+
+	/**
+	 * Accept and handle connections, this function does not return.
+	 */
+	void run();
+private:
+	SelectionServer(SelectionServer const &other);
+	SelectionServer &operator=(SelectionServer const &other);
+	static void *handleConnection(void *connection);
+	void handleJob(int fd);
+
+	std::string d_socketPath;
+	std::vector<DataSet const *> d_dataSets;
+	Logger d_logger;
+	int d_socket;
+};
+
+}
+
+#endif // SELECTIONSERVER_HH
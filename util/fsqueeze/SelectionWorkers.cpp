@@ -0,0 +1,698 @@
+#include "SelectionWorkers.ih"
+
+namespace {
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Workers run the program of the coordinator.
+char const * const WORKER_PROGRAM = "/proc/self/exe";
+
+enum WorkerCommand
+{
+	COMMAND_RESET,
+	COMMAND_EXPECTATIONS,
+	COMMAND_STAGE,
+	COMMAND_GRADIENTS,
+	COMMAND_GAINS,
+	COMMAND_ADJUST,
+	COMMAND_QUIT
+};
+
+// Typed messages over a socket. Values are sent in the representation of
+// the host, both ends run the same program. Writes are buffered until
+// flush(), reads are not buffered.
+class Channel
+{
+public:
+	Channel(int fd);
+	void flush();
+
+	template <typename T>
+	T get();
+
+	template <typename T>
+	void get(T *data, size_t n);
+
+	template <typename T>
+	void put(T const &value);
+
+	template <typename T>
+	void put(T const *data, size_t n);
+private:
+	int d_fd;
+	vector<char> d_buf;
+};
+
+Channel::Channel(int fd) : d_fd(fd)
+{
+}
+
+void Channel::flush()
+{
+	char const *p = d_buf.data();
+	char const *end = p + d_buf.size();
+	while (p < end)
+	{
+		ssize_t n = send(d_fd, p, end - p, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw runtime_error(string("Could not send a message: ") +
+				strerror(errno));
+		p += n;
+	}
+
+	d_buf.clear();
+}
+
+template <typename T>
+T Channel::get()
+{
+	T value;
+	get(&value, 1);
+	return value;
+}
+
+template <typename T>
+void Channel::get(T *data, size_t n)
+{
+	char *p = reinterpret_cast<char *>(data);
+	char *end = p + n * sizeof(T);
+	while (p < end)
+	{
+		ssize_t r = recv(d_fd, p, end - p, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r == 0)
+			throw runtime_error("The connection was closed");
+		if (r < 0)
+			throw runtime_error(string("Could not receive a message: ") +
+				strerror(errno));
+		p += r;
+	}
+}
+
+template <typename T>
+void Channel::put(T const &value)
+{
+	put(&value, 1);
+}
+
+template <typename T>
+void Channel::put(T const *data, size_t n)
+{
+	// The data of an empty vector can be null.
+	if (n == 0)
+		return;
+
+	char const *p = reinterpret_cast<char const *>(data);
+	d_buf.insert(d_buf.end(), p, p + n * sizeof(T));
+}
+
+void putFeatures(Channel *channel, vector<uint64_t> const &features)
+{
+	channel->put<uint64_t>(features.size());
+	channel->put(features.data(), features.size());
+}
+
+vector<uint64_t> getFeatures(Channel *channel)
+{
+	vector<uint64_t> features(channel->get<uint64_t>());
+	channel->get(features.data(), features.size());
+	return features;
+}
+
+vector<uint64_t> featureList(FeatureSet const &features)
+{
+	return vector<uint64_t>(features.begin(), features.end());
+}
+
+FeatureSet featureSet(vector<uint64_t> const &features)
+{
+	return FeatureSet(features.begin(), features.end());
+}
+
+// Send the partial sums of blocks, in block order.
+void putBlockSums(Channel *channel, vector<BlockVectorSums> const &blockSums)
+{
+	channel->put<uint64_t>(blockSums.size());
+	for (vector<BlockVectorSums>::const_iterator blockIter = blockSums.begin();
+			blockIter != blockSums.end(); ++blockIter)
+	{
+		channel->put<uint64_t>(blockIter->size());
+		for (BlockVectorSums::const_iterator iter = blockIter->begin();
+				iter != blockIter->end(); ++iter)
+		{
+			channel->put<uint64_t>(iter->first);
+			channel->put(iter->second);
+		}
+	}
+}
+
+// Receive the partial sums of the blocks of a worker, and add them to vec
+// in block order.
+template <typename Vector>
+void addWorkerBlockSums(Channel *channel, Vector *vec)
+{
+	size_t nBlocks = channel->get<uint64_t>();
+	for (size_t b = 0; b < nBlocks; ++b)
+	{
+		size_t n = channel->get<uint64_t>();
+		for (size_t i = 0; i < n; ++i)
+		{
+			size_t f = channel->get<uint64_t>();
+			(*vec)[f] += channel->get<double>();
+		}
+	}
+}
+
+// The worker side of the commands. The model of the worker covers the
+// contexts of its shards.
+class Worker
+{
+public:
+	Worker(Channel *channel, DataSet const &dataSet);
+	void run();
+private:
+	void adjust();
+	void expectations();
+	void gains();
+	void gradients();
+	void reset();
+	void stage();
+
+	Channel *d_channel;
+	DataSet const *d_dataSet;
+	Sums d_sums;
+	Zs d_zs;
+	unique_ptr<ContextActiveFeatures> d_activeFeatures;
+};
+
+Worker::Worker(Channel *channel, DataSet const &dataSet)
+	: d_channel(channel), d_dataSet(&dataSet)
+{
+	reset();
+}
+
+void Worker::run()
+{
+	while (true)
+	{
+		switch (d_channel->get<uint64_t>())
+		{
+		case COMMAND_RESET:
+			reset();
+			break;
+		case COMMAND_EXPECTATIONS:
+			expectations();
+			break;
+		case COMMAND_STAGE:
+			stage();
+			break;
+		case COMMAND_GRADIENTS:
+			gradients();
+			break;
+		case COMMAND_GAINS:
+			gains();
+			break;
+		case COMMAND_ADJUST:
+			adjust();
+			break;
+		case COMMAND_QUIT:
+			return;
+		default:
+			throw runtime_error("Unknown command");
+		}
+	}
+}
+
+void Worker::adjust()
+{
+	size_t feature = d_channel->get<uint64_t>();
+	double alpha = d_channel->get<double>();
+
+	d_activeFeatures.reset();
+	adjustModel(*d_dataSet, feature, alpha, &d_sums, &d_zs);
+}
+
+void Worker::expectations()
+{
+	bool deterministic = d_channel->get<uint64_t>() != 0;
+
+	if (deterministic)
+		putBlockSums(d_channel, expModelBlockSums(*d_dataSet, d_sums, d_zs));
+	else
+	{
+		ExpectedValues expVals = fsqueeze::expModelFeatureValues(*d_dataSet,
+			d_sums, d_zs);
+		d_channel->put(expVals.data(), expVals.size());
+	}
+
+	d_channel->flush();
+}
+
+void Worker::gains()
+{
+	bool deterministic = d_channel->get<uint64_t>() != 0;
+	bool all = d_channel->get<uint64_t>() != 0;
+	vector<uint64_t> features = getFeatures(d_channel);
+	FeatureWeights alphas(d_dataSet->nFeatures());
+	d_channel->get(alphas.data(), alphas.size());
+
+	if (deterministic)
+	{
+		FeatureSet fs = featureSet(features);
+		putBlockSums(d_channel, blockGainSums(*d_dataSet, *d_activeFeatures,
+			d_sums, d_zs, alphas, all ? 0 : &fs));
+		d_channel->flush();
+		return;
+	}
+
+	GainMap gainSum = all ?
+		fsqueeze::gainSums(*d_dataSet, *d_activeFeatures, d_sums, d_zs, alphas) :
+		fsqueeze::gainSums(*d_dataSet, *d_activeFeatures, d_sums, d_zs, alphas,
+			featureSet(features));
+
+	d_channel->put<uint64_t>(gainSum.size());
+	for (GainMap::const_iterator iter = gainSum.begin(); iter != gainSum.end();
+			++iter)
+	{
+		d_channel->put<uint64_t>(iter->first);
+		d_channel->put(iter->second);
+	}
+	d_channel->flush();
+}
+
+// G' starts at the empirical expectation in the first worker, so that a
+// single worker computes the same G' as a single process. Deterministic
+// gradients are sent per block.
+void Worker::gradients()
+{
+	bool deterministic = d_channel->get<uint64_t>() != 0;
+	bool first = d_channel->get<uint64_t>() != 0;
+	vector<uint64_t> features = getFeatures(d_channel);
+	FeatureWeights alphas(d_dataSet->nFeatures());
+	d_channel->get(alphas.data(), alphas.size());
+
+	if (deterministic)
+	{
+		vector<BlockGradients> blockGrads = blockGradients(*d_dataSet,
+			featureSet(features), *d_activeFeatures, d_sums, d_zs, alphas);
+
+		d_channel->put<uint64_t>(blockGrads.size());
+		for (vector<BlockGradients>::const_iterator blockIter =
+				blockGrads.begin(); blockIter != blockGrads.end(); ++blockIter)
+		{
+			d_channel->put<uint64_t>(blockIter->size());
+			for (BlockGradients::const_iterator iter = blockIter->begin();
+					iter != blockIter->end(); ++iter)
+			{
+				d_channel->put<uint64_t>(iter->first);
+				d_channel->put(iter->second.first);
+				d_channel->put(iter->second.second);
+			}
+		}
+		d_channel->flush();
+		return;
+	}
+
+	Gp gp = first ? hugePageCopy(d_dataSet->expFeatureValues()) :
+		hugePageZero<Gp>(d_dataSet->nFeatures());
+	Gpp gpp = hugePageZero<Gpp>(d_dataSet->nFeatures());
+	updateGradients(*d_dataSet, featureSet(features), *d_activeFeatures, d_sums,
+		d_zs, alphas, &gp, &gpp, false);
+
+	for (vector<uint64_t>::const_iterator iter = features.begin();
+			iter != features.end(); ++iter)
+	{
+		d_channel->put(gp[*iter]);
+		d_channel->put(gpp[*iter]);
+	}
+	d_channel->flush();
+}
+
+void Worker::reset()
+{
+	d_activeFeatures.reset();
+	d_sums = initialSums(*d_dataSet);
+	d_zs = initialZs(*d_dataSet);
+}
+
+void Worker::stage()
+{
+	FeatureSet excludedFs = featureSet(getFeatures(d_channel));
+
+	d_activeFeatures.reset(new ContextActiveFeatures(*d_dataSet, excludedFs,
+		d_sums, d_zs));
+
+	putFeatures(d_channel, featureList(activeFeatures(*d_activeFeatures)));
+	d_channel->flush();
+}
+
+}
+
+SelectionWorkers::SelectionWorkers(DataSet const &dataSet,
+	string const &shardPath, size_t nWorkers, size_t nThreads, Logger logger)
+	: d_dataSet(&dataSet)
+{
+	ContextShards const *shards = dataSet.shards();
+	if (shards == 0)
+		throw invalid_argument("Worker processes require a shard file");
+
+	size_t nShards = shards->nShards();
+	nWorkers = max<size_t>(1, min(nWorkers, nShards));
+
+	// Divide the shards by their non-zero values. A range is closed when it
+	// reaches its share, or when every remaining worker needs one of the
+	// remaining shards.
+	vector<size_t> begins(1, 0);
+	size_t nNonZeros = 0;
+	for (size_t i = 0; i < nShards && begins.size() < nWorkers; ++i)
+	{
+		nNonZeros += shards->shardNonZeros(i);
+		if (nNonZeros * nWorkers >= shards->nNonZeros() * begins.size() ||
+				nShards - (i + 1) == nWorkers - begins.size())
+			begins.push_back(i + 1);
+	}
+	begins.push_back(nShards);
+
+	try {
+		for (size_t w = 0; w + 1 < begins.size(); ++w)
+			start(shardPath, begins[w], begins[w + 1], nThreads);
+
+		for (size_t w = 0; w < d_sockets.size(); ++w)
+		{
+			Channel channel(d_sockets[w]);
+			size_t nContexts = channel.get<uint64_t>();
+			logger.error() << "Worker " << w << ": shards " << begins[w] << "-" <<
+				begins[w + 1] << ", " << nContexts << " contexts" << endl;
+		}
+	} catch (...) {
+		stop();
+		throw;
+	}
+}
+
+SelectionWorkers::~SelectionWorkers()
+{
+	stop();
+}
+
+void SelectionWorkers::adjust(size_t feature, double alpha)
+{
+	for (size_t w = 0; w < d_sockets.size(); ++w)
+	{
+		Channel channel(d_sockets[w]);
+		channel.put<uint64_t>(COMMAND_ADJUST);
+		channel.put<uint64_t>(feature);
+		channel.put(alpha);
+		channel.flush();
+	}
+}
+
+ExpectedValues SelectionWorkers::expModelFeatureValues(bool deterministic)
+{
+	for (size_t w = 0; w < d_sockets.size(); ++w)
+	{
+		Channel channel(d_sockets[w]);
+		channel.put<uint64_t>(COMMAND_EXPECTATIONS);
+		channel.put<uint64_t>(deterministic);
+		channel.flush();
+	}
+
+	if (deterministic)
+	{
+		ExpectedValues expVals = hugePageZero<ExpectedValues>(
+			d_dataSet->nFeatures());
+		for (size_t w = 0; w < d_sockets.size(); ++w)
+		{
+			Channel channel(d_sockets[w]);
+			addWorkerBlockSums(&channel, &expVals);
+		}
+
+		return expVals;
+	}
+
+	ExpectedValues expVals(d_dataSet->nFeatures());
+	ExpectedValues workerVals(d_dataSet->nFeatures());
+	for (size_t w = 0; w < d_sockets.size(); ++w)
+	{
+		Channel channel(d_sockets[w]);
+		if (w == 0)
+			channel.get(expVals.data(), expVals.size());
+		else
+		{
+			channel.get(workerVals.data(), workerVals.size());
+			expVals += workerVals;
+		}
+	}
+
+	return expVals;
+}
+
+// The gains are added up like in calcGains.
+OrderedGains SelectionWorkers::gains(FeatureWeights const &alphas,
+	FeatureSet const *features, bool deterministic)
+{
+	for (size_t w = 0; w < d_sockets.size(); ++w)
+	{
+		Channel channel(d_sockets[w]);
+		channel.put<uint64_t>(COMMAND_GAINS);
+		channel.put<uint64_t>(deterministic);
+		channel.put<uint64_t>(features == 0);
+		putFeatures(&channel, features == 0 ? vector<uint64_t>() :
+			featureList(*features));
+		channel.put(alphas.data(), alphas.size());
+		channel.flush();
+	}
+
+	GainMap gainSum;
+	for (size_t w = 0; w < d_sockets.size(); ++w)
+	{
+		Channel channel(d_sockets[w]);
+		if (deterministic)
+		{
+			addWorkerBlockSums(&channel, &gainSum);
+			continue;
+		}
+
+		size_t n = channel.get<uint64_t>();
+		for (size_t i = 0; i < n; ++i)
+		{
+			size_t f = channel.get<uint64_t>();
+			gainSum[f] += channel.get<double>();
+		}
+	}
+
+	ExpectedValues const &expVals = d_dataSet->expFeatureValues();
+
+	OrderedGains gains;
+	if (features == 0)
+		for (int f = 0; f < alphas.rows(); ++f)
+			gains.insert(make_pair(f, gainSum[f] + alphas[f] * expVals[f]));
+	else
+		for (FeatureSet::const_iterator fIter = features->begin();
+				fIter != features->end(); ++fIter)
+			gains.insert(make_pair(*fIter, gainSum[*fIter] + alphas[*fIter] *
+				expVals[*fIter]));
+
+	return gains;
+}
+
+void SelectionWorkers::gradients(FeatureSet const &unconvergedFeatures,
+	FeatureWeights const &alphas, bool deterministic, Gp *gp, Gpp *gpp)
+{
+	vector<uint64_t> features = featureList(unconvergedFeatures);
+
+	for (size_t w = 0; w < d_sockets.size(); ++w)
+	{
+		Channel channel(d_sockets[w]);
+		channel.put<uint64_t>(COMMAND_GRADIENTS);
+		channel.put<uint64_t>(deterministic);
+		channel.put<uint64_t>(w == 0);
+		putFeatures(&channel, features);
+		channel.put(alphas.data(), alphas.size());
+		channel.flush();
+	}
+
+	if (deterministic)
+	{
+		for (size_t w = 0; w < d_sockets.size(); ++w)
+		{
+			Channel channel(d_sockets[w]);
+			size_t nBlocks = channel.get<uint64_t>();
+			for (size_t b = 0; b < nBlocks; ++b)
+			{
+				size_t n = channel.get<uint64_t>();
+				for (size_t i = 0; i < n; ++i)
+				{
+					size_t f = channel.get<uint64_t>();
+					(*gp)[f] += channel.get<double>();
+					(*gpp)[f] += channel.get<double>();
+				}
+			}
+		}
+
+		return;
+	}
+
+	vector<double> workerGradients(2 * features.size());
+	for (size_t w = 0; w < d_sockets.size(); ++w)
+	{
+		Channel channel(d_sockets[w]);
+		channel.get(workerGradients.data(), workerGradients.size());
+		for (size_t i = 0; i < features.size(); ++i)
+		{
+			size_t f = features[i];
+			(*gp)[f] = w == 0 ? workerGradients[2 * i] :
+				(*gp)[f] + workerGradients[2 * i];
+			(*gpp)[f] = w == 0 ? workerGradients[2 * i + 1] :
+				(*gpp)[f] + workerGradients[2 * i + 1];
+		}
+	}
+}
+
+void SelectionWorkers::reset()
+{
+	for (size_t w = 0; w < d_sockets.size(); ++w)
+	{
+		Channel channel(d_sockets[w]);
+		channel.put<uint64_t>(COMMAND_RESET);
+		channel.flush();
+	}
+}
+
+// Start a worker. The worker reads its shard range and execution settings
+// from the socket, so that only the descriptor is passed on the command
+// line.
+void SelectionWorkers::start(string const &shardPath, size_t firstShard,
+	size_t lastShard, size_t nThreads)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+		throw runtime_error(string("Could not create a socket pair: ") +
+			strerror(errno));
+
+	// Arguments are prepared before the fork, the child only makes
+	// system calls.
+	ostringstream fdStr;
+	fdStr << fds[1];
+	string workerFd = fdStr.str();
+	char const *argv[] = {"squeeze", "-w", workerFd.c_str(), 0};
+
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		int err = errno;
+		close(fds[0]);
+		close(fds[1]);
+		throw runtime_error(string("Could not start a worker: ") + strerror(err));
+	}
+
+	if (pid == 0)
+	{
+		fcntl(fds[1], F_SETFD, 0);
+		execv(WORKER_PROGRAM, const_cast<char * const *>(argv));
+		_exit(127);
+	}
+
+	close(fds[1]);
+	d_sockets.push_back(fds[0]);
+	d_pids.push_back(pid);
+
+	Channel channel(fds[0]);
+	channel.put<uint64_t>(shardPath.size());
+	channel.put(shardPath.data(), shardPath.size());
+	channel.put<uint64_t>(firstShard);
+	channel.put<uint64_t>(lastShard);
+	channel.put<uint64_t>(nThreads);
+	channel.put<uint64_t>(hugePagePolicy());
+	channel.flush();
+}
+
+FeatureSet SelectionWorkers::startStage(FeatureSet const &excludedFeatures)
+{
+	for (size_t w = 0; w < d_sockets.size(); ++w)
+	{
+		Channel channel(d_sockets[w]);
+		channel.put<uint64_t>(COMMAND_STAGE);
+		putFeatures(&channel, featureList(excludedFeatures));
+		channel.flush();
+	}
+
+	FeatureSet activeFs;
+	for (size_t w = 0; w < d_sockets.size(); ++w)
+	{
+		Channel channel(d_sockets[w]);
+		vector<uint64_t> workerFs = getFeatures(&channel);
+		activeFs.insert(workerFs.begin(), workerFs.end());
+	}
+
+	return activeFs;
+}
+
+// Workers exit when they are asked to, or when the connection is closed.
+void SelectionWorkers::stop()
+{
+	for (size_t w = 0; w < d_sockets.size(); ++w)
+	{
+		uint64_t command = COMMAND_QUIT;
+		send(d_sockets[w], &command, sizeof(command), MSG_NOSIGNAL);
+		close(d_sockets[w]);
+	}
+
+	for (size_t w = 0; w < d_pids.size(); ++w)
+		while (waitpid(d_pids[w], 0, 0) < 0 && errno == EINTR)
+			;
+
+	d_sockets.clear();
+	d_pids.clear();
+}
+
+// The stages follow the full selection algorithm, except that the sums
+// over the contexts come from the workers.
+SelectedFeatureAlphas SelectionWorkers::featureSelection(Logger logger,
+	SelectionParameters const &param)
+{
+	if (param.batchSize > 1 || param.pruneGains || param.featureParallel ||
+			param.fullOptimizationCycles != 0 || param.fullOptimizationExpBase != 0.0)
+		throw invalid_argument("Batches, gain pruning, feature-parallel stages "
+			"and L-BFGS optimization are not supported with worker processes");
+
+	reset();
+
+	return fsqueeze::featureSelection(*d_dataSet, this, logger, param);
+}
+
+int fsqueeze::runSelectionWorker(int fd)
+{
+	try {
+		Channel channel(fd);
+
+		string shardPath(channel.get<uint64_t>(), '\0');
+		channel.get(&shardPath[0], shardPath.size());
+		size_t firstShard = channel.get<uint64_t>();
+		size_t lastShard = channel.get<uint64_t>();
+
+		ExecutionConfig config;
+		config.nThreads = channel.get<uint64_t>();
+		config.hugePages = static_cast<HugePagePolicy>(channel.get<uint64_t>());
+		applyExecutionConfig(config);
+
+		DataSet dataSet = DataSet::readShards(shardPath, firstShard, lastShard);
+		channel.put<uint64_t>(dataSet.nContexts());
+		channel.flush();
+
+		Worker worker(&channel, dataSet);
+		worker.run();
+	} catch (exception const &e) {
+		cerr << "Worker: " << e.what() << endl;
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+	return 0;
+}
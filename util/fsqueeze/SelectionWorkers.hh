@@ -0,0 +1,89 @@
+#ifndef SELECTIONWORKERS_HH
+#define SELECTIONWORKERS_HH
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "FeatureSqueeze/DataSet.hh"
+#include "FeatureSqueeze/Logger.hh"
+#include "FeatureSqueeze/feature_selection.hh"
+#include "FeatureSqueeze/maxent.hh"
+
+namespace fsqueeze
+{
+
+/**
+ * Full feature selection, distributed over worker processes on one host.
+ * Every worker reads a range of the shards of a shard file into memory,
+ * and computes the model expectations, G', G'' and gains over its
+ * contexts. The coordinator adds up these partial sums, estimates the
+ * weights, picks the best feature, and sends it to the workers, which
+ * adjust their part of the model.
+ *
+ * Workers are started as 'squeeze -w fd', and talk to the coordinator
+ * over a Unix domain socket pair. A new program is started rather than a
+ * forked copy, since OpenMP threads do not survive a fork.
+ *
+ * With deterministic reductions, workers send the partial sums of every
+ * block of REDUCTION_BLOCK_SIZE contexts, and the coordinator adds them in
+ * block order. Since shards start at block boundaries, the selection is
+ * then the same as a single-process selection for any number of workers.
+ * Otherwise, workers send the sums over all their contexts, and weights
+ * and gains can differ in the last digits.
+ */
+class SelectionWorkers : public SelectionModel
+{
+public:
+	/**
+	 * Start nWorkers workers for the shard file of an out-of-core data
+	 * set. The shards are divided such that the workers get about the
+	 * same number of non-zero feature values. Each worker uses nThreads
+	 * threads.
+	 */
+	SelectionWorkers(DataSet const &dataSet, std::string const &shardPath,
+		size_t nWorkers, size_t nThreads, Logger logger);
+
+	/**
+	 * Stop the workers.
+	 */
+	~SelectionWorkers();
+
+	/**
+	 * Select features like featureSelection. Batches, gain pruning,
+	 * feature-parallel stages and L-BFGS optimization are not supported.
+	 */
+	SelectedFeatureAlphas featureSelection(Logger logger,
+		SelectionParameters const &param);
+
+	// The model of the contexts of the workers.
+	void adjust(size_t feature, double alpha);
+	ExpectedValues expModelFeatureValues(bool deterministic);
+	FeatureSet startStage(FeatureSet const &excludedFeatures);
+	void gradients(FeatureSet const &unconvergedFeatures,
+		FeatureWeights const &alphas, bool deterministic, Gp *gp, Gpp *gpp);
+	OrderedGains gains(FeatureWeights const &alphas, FeatureSet const *features,
+		bool deterministic);
+private:
+	SelectionWorkers(SelectionWorkers const &other);
+	SelectionWorkers &operator=(SelectionWorkers const &other);
+	void reset();
+	void start(std::string const &shardPath, size_t firstShard,
+		size_t lastShard, size_t nThreads);
+	void stop();
+
+	DataSet const *d_dataSet;
+	std::vector<int> d_sockets;
+	std::vector<pid_t> d_pids;
+};
+
+/**
+ * Serve the coordinator of a multi-process selection on the socket fd,
+ * until it stops the worker. Returns the exit status of the worker.
+ */
+int runSelectionWorker(int fd);
+
+}
+
+#endif // SELECTIONWORKERS_HH
@@ -17,39 +17,168 @@
  * MA 02110-1301 USA
  */
 
+#include <algorithm>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
 
 #include "FeatureSqueeze/stringutil.hh"
+#include "FeatureSqueeze/ContextShards.hh"
 #include "FeatureSqueeze/DataSet.hh"
 #include "FeatureSqueeze/Logger.hh"
 #include "FeatureSqueeze/corr_selection.hh"
+#include "FeatureSqueeze/execution.hh"
 #include "FeatureSqueeze/feature_selection.hh"
+#include "FeatureSqueeze/scheduler.hh"
 
+#include "MemoryBudget.hh"
+#include "ParameterSweep.hh"
 #include "ProgramOptions.hh"
+#include "SelectionJob.hh"
+#include "SelectionServer.hh"
+#include "SelectionWorkers.hh"
 
 using namespace std;
 
+// Buffer for transposing the occurrence lists of a new shard file, when
+// there is no memory budget.
+size_t const SHARD_BUFFER_SIZE = 256 << 20;
+
+struct DataSetSize
+{
+	size_t nContexts;
+	size_t nEvents;
+	size_t nNonZeros;
+};
+
+DataSetSize dataSetSize(fsqueeze::DataSet const &dataSet)
+{
+	DataSetSize size = {dataSet.nContexts(), 0, 0};
+	for (fsqueeze::ShardCursor shard(dataSet); shard.next(); )
+		for (fsqueeze::ContextVector::const_iterator ctxIter =
+				shard.contexts().begin(); ctxIter != shard.contexts().end();
+				++ctxIter)
+		{
+			size.nEvents += ctxIter->eventProbs().size();
+			size.nNonZeros += ctxIter->featureValues().nonZeros();
+		}
+	
+	return size;
+}
+
+void foldDataSet(fsqueeze::DataSet *dataSet, fsqueeze::Logger logger)
+{
+	DataSetSize before = dataSetSize(*dataSet);
+	dataSet->foldDuplicates();
+	DataSetSize after = dataSetSize(*dataSet);
+	
+	logger.error() << "Folded contexts: " << before.nContexts << " -> " <<
+		after.nContexts << ", events: " << before.nEvents << " -> " <<
+		after.nEvents << ", non-zeros: " << before.nNonZeros << " -> " <<
+		after.nNonZeros << endl;
+}
+
+// Publish a data set into a new shared segment. A TADM data set is first
+// converted to a shard file: the file of -D, or a temporary file.
+void publishDataSet(fsqueeze::SharedShards *shared, string const &dataPath,
+	istream &dataStream, string shardPath, size_t bufferSize)
+{
+	if (shardPath.empty() && fsqueeze::isShardFile(dataPath))
+	{
+		shared->publish(dataPath);
+		return;
+	}
+
+	bool temporary = shardPath.empty();
+	if (temporary)
+	{
+		char const *tmpDir = getenv("TMPDIR");
+		string pathTemplate = string(tmpDir != 0 ? tmpDir : "/tmp") +
+			"/fsqueeze.XXXXXX";
+		vector<char> path(pathTemplate.begin(), pathTemplate.end());
+		path.push_back('\0');
+
+		int fd = mkstemp(&path[0]);
+		if (fd == -1)
+			throw runtime_error("Could not create a temporary shard file");
+		close(fd);
+
+		shardPath = &path[0];
+	}
+
+	try {
+		fsqueeze::DataSet::convertTADMDataSet(dataStream, shardPath, bufferSize);
+		shared->publish(shardPath);
+	} catch (...) {
+		if (temporary)
+			unlink(shardPath.c_str());
+		throw;
+	}
+
+	if (temporary)
+		unlink(shardPath.c_str());
+}
+
 void usage(string const &programName)
 {
-	cerr << "Usage: " << programName << " [OPTION] dataset" << endl << endl <<
+	cerr << "Usage: " << programName << " [OPTION] dataset" << endl <<
+		"       " << programName << " [OPTION] -S socket dataset..." << endl << endl <<
 		"  -a val\t Alpha convergence threshold (default: 1e-6)" << endl <<
+		"  -b\t\t Prune candidates using gain bounds" << endl <<
 		"  -c\t\t Correlation selection" << endl <<
+		"  -d\t\t Deterministic reductions (reproducible selections)" << endl <<
+		"  -D file\t Convert the data set to a shard file, and select" << endl <<
+		"\t\t out-of-core" << endl <<
     "  -e n\t\t Apply L-BFGS optimization every n^t cycles (default: disabled)" << endl <<
 		"  -f\t\t Fast maxent selection (do not recalculate all gains)" << endl <<
 		"  -g val\t Gain threshold (default: 1e-20)" << endl <<
+		"  -H name\t Share the data set with other processes in a shared" << endl <<
+		"\t\t memory segment or hugetlbfs file" << endl <<
+		"  -i\t\t Estimate the candidates of full selection stages per" << endl <<
+		"\t\t feature" << endl <<
+		"  -j n\t\t Concurrent selections in a sweep (default: threads)" << endl <<
+		"  -k n\t\t Add up to n features per full selection stage (default: 1)" << endl <<
 		"  -l n\t\t Apply L-BFGS optimization every n cycles (default: disabled)" << endl <<
 		"  -n val\t Maximum number of features" << endl <<
 		"  -o\t\t Find overlap (incompatible with -f)" << endl <<
-		"  -r val\t Correlation exclusion threshold (default: 0.9)" << endl << endl;
+		"  -p\t\t Pin threads to CPUs" << endl <<
+		"  -P n\t\t Select with n worker processes (requires a shard file)" << endl <<
+		"  -r val\t Correlation exclusion threshold (default: 0.9)" << endl <<
+		"  -s n\t\t Recalculate up to n candidates concurrently in fast" << endl <<
+		"\t\t selection (default: 1)" << endl <<
+		"  -t n\t\t Number of threads (default: OpenMP default)" << endl <<
+		"  -u\t\t Fold duplicate events and contexts" << endl <<
+		"  -x f,...\t Exclude features from selection" << endl <<
+		"  -F f,...\t Force features into the model" << endl <<
+		"  -K val\t Maximum context overlap within a batch (default: 0)" << endl <<
+		"  -L policy\t Huge pages for large buffers: none, transparent or" << endl <<
+		"\t\t hugetlb (default: transparent)" << endl <<
+		"  -M size\t Memory budget, e.g. 512M or 4G (default: unlimited)" << endl <<
+		"  -N policy\t NUMA placement: default, interleave or partition" << endl <<
+		"\t\t (default: default)" << endl <<
+		"  -O prefix\t Output prefix for sweeps (default: sweep)" << endl <<
+		"  -S socket\t Serve selection jobs on a Unix domain socket" << endl <<
+		"  -W grid\t Sweep over a parameter grid" << endl << endl;
 }
 
 int main(int argc, char *argv[])
 {
-	fsqueeze::ProgramOptions programOptions(argc, argv, "a:ce:fg:l:n:or:");
+	fsqueeze::ProgramOptions programOptions(argc, argv, "a:bcdD:e:fg:H:ij:k:l:n:opr:s:t:uw:x:F:K:L:M:N:O:P:S:W:");
+
+	// Workers of a multi-process selection (-P) are started with -w.
+	if (programOptions.option('w'))
+		return fsqueeze::runSelectionWorker(
+			fsqueeze::parseString<int>(programOptions.optionValue('w')));
 	
-	if (programOptions.arguments().size() != 1)
+	if ((!programOptions.option('S') && programOptions.arguments().size() != 1) ||
+		programOptions.arguments().size() == 0)
 	{
 		usage(programOptions.programName());
 		return 1;
@@ -77,18 +206,70 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (programOptions.option('c') && programOptions.option('u'))
+	{
+		cerr << "Duplicate folding (-u) cannot be used with correlation-based (-c)" <<
+			" selection" << endl;
+		return 1;
+	}
+
+	if (programOptions.option('D') && programOptions.arguments().size() != 1)
+	{
+		cerr << "A shard file (-D) can only be written for a single data set" <<
+			endl;
+		return 1;
+	}
+
+	if (programOptions.option('H') && (programOptions.arguments().size() != 1 ||
+			programOptions.option('P')))
+	{
+		cerr << "A shared data set (-H) can only be used for a single data set, " <<
+			"and not with -P" << endl;
+		return 1;
+	}
+
+  if (programOptions.option('S') && programOptions.option('W'))
+  {
+    cerr << "-S and -W cannot be used simultaneously" << endl;
+    return 1;
+  }
+
   if (programOptions.option('e') && programOptions.option('l'))
   {
     cerr << "-e and -l cannot be used simultaneously" << endl;
     return 1;
   }
 
-  fsqueeze::SelectionParameters param;
+	if (programOptions.option('P') && (programOptions.option('b') ||
+			programOptions.option('c') || programOptions.option('e') ||
+			programOptions.option('f') || programOptions.option('i') ||
+			programOptions.option('k') ||
+			programOptions.option('l') || programOptions.option('S') ||
+			programOptions.option('W')))
+	{
+		cerr << "Worker processes (-P) cannot be used with -b, -c, -e, -f, -i, -k, " <<
+			"-l, -S or -W" << endl;
+		return 1;
+	}
+
+  fsqueeze::SelectionJob job;
+  fsqueeze::SelectionParameters &param = job.param;
+
+	if (programOptions.option('c'))
+		job.algorithm = fsqueeze::ALGORITHM_CORRELATION;
+	else if (programOptions.option('f'))
+		job.algorithm = fsqueeze::ALGORITHM_FAST;
 	
 	if (programOptions.option('a'))
 		param.alphaThreshold =
       fsqueeze::parseString<double>(programOptions.optionValue('a'));
 
+	if (programOptions.option('b'))
+		param.pruneGains = true;
+
+	if (programOptions.option('d'))
+		param.deterministic = true;
+
 	if (programOptions.option('g'))
 		param.gainThreshold =
       fsqueeze::parseString<double>(programOptions.optionValue('g'));
@@ -97,39 +278,281 @@ int main(int argc, char *argv[])
     param.fullOptimizationExpBase =
       fsqueeze::parseString<size_t>(programOptions.optionValue('e'));
 	
+	if (programOptions.option('i'))
+		param.featureParallel = true;
+
+	if (programOptions.option('k'))
+		param.batchSize = fsqueeze::parseString<size_t>(programOptions.optionValue('k'));
+
+	if (programOptions.option('K'))
+		param.batchOverlap =
+			fsqueeze::parseString<double>(programOptions.optionValue('K'));
+	
 	if (programOptions.option('l'))
 		param.fullOptimizationCycles = fsqueeze::parseString<size_t>(programOptions.optionValue('l'));
 	
 	if (programOptions.option('n'))
 		param.nFeatures = fsqueeze::parseString<size_t>(programOptions.optionValue('n'));
+
+	if (programOptions.option('o'))
+		param.detectOverlap = true;
+
+	if (programOptions.option('s'))
+		param.speculativeBatch =
+			fsqueeze::parseString<size_t>(programOptions.optionValue('s'));
+
+	if (programOptions.option('x'))
+		param.excludedFeatures =
+			fsqueeze::parseFeatureList(programOptions.optionValue('x'));
+
+	if (programOptions.option('F'))
+		param.forcedFeatures =
+			fsqueeze::parseFeatureList(programOptions.optionValue('F'));
 	
-	double minCorrelation = 0.9;
 	if (programOptions.option('r'))
-		minCorrelation = fsqueeze::parseString<double>(programOptions.optionValue('r'));
-	
-	cerr << "Reading data... ";
+		job.minCorrelation = fsqueeze::parseString<double>(programOptions.optionValue('r'));
 
-	ifstream dataStream(programOptions.arguments()[0].c_str());
-	if (!dataStream)
-	{
-		cerr << "Error opening input file!" << endl;
+	try {
+		fsqueeze::validateSelectionJob(job);
+	} catch (invalid_argument const &e) {
+		cerr << e.what() << endl;
 		return 1;
 	}
 
-	fsqueeze::DataSet ds = fsqueeze::DataSet::readTADMDataSet(dataStream);
+	fsqueeze::ExecutionConfig execConfig;
+
+	if (programOptions.option('t'))
+		execConfig.nThreads = fsqueeze::parseString<size_t>(programOptions.optionValue('t'));
 
-	cerr << "done!" << endl;
+	if (programOptions.option('p'))
+		execConfig.pinThreads = true;
+
+	if (programOptions.option('N'))
+		execConfig.numaPlacement =
+			fsqueeze::parseNumaPlacement(programOptions.optionValue('N'));
+
+	if (programOptions.option('L'))
+	{
+		try {
+			execConfig.hugePages =
+				fsqueeze::parseHugePagePolicy(programOptions.optionValue('L'));
+		} catch (invalid_argument const &e) {
+			cerr << e.what() << endl;
+			return 1;
+		}
+	}
+
+	size_t memoryBudget = 0;
+	if (programOptions.option('M'))
+	{
+		try {
+			memoryBudget = fsqueeze::parseMemorySize(programOptions.optionValue('M'));
+		} catch (invalid_argument const &e) {
+			cerr << e.what() << endl;
+			return 1;
+		}
+	}
+
+	fsqueeze::applyExecutionConfig(execConfig);
 	
 	fsqueeze::Logger logger(cout, cerr);
-	logger.error() << "Dynamic features: "<< ds.features().size() << "/" <<
-		ds.nFeatures() << endl;
-	
-	if (programOptions.option('c'))
-		fsqueeze::corrFeatureSelection(ds, logger, minCorrelation, param.nFeatures);
-	else if (programOptions.option('f'))
-		fsqueeze::fastFeatureSelection(ds, logger, param);
+
+	// Busy times of the loops that this thread schedules, sweep jobs
+	// report their own instead.
+	fsqueeze::BusyTimes busyTimes;
+	fsqueeze::BusyTimesScope busyScope(&busyTimes);
+
+	vector<fsqueeze::DataSet *> dataSets;
+	string shardPath;
+	unique_ptr<fsqueeze::SharedShards> sharedShards;
+	for (vector<string>::const_iterator iter = programOptions.arguments().begin();
+			iter != programOptions.arguments().end(); ++iter)
+	{
+		cerr << "Reading data... ";
+
+		ifstream dataStream(iter->c_str());
+		if (!dataStream)
+		{
+			cerr << "Error opening input file!" << endl;
+			return 1;
+		}
+
+		fsqueeze::DataSet *ds;
+		try {
+			// Shard files are selected out-of-core. The occurrence lists of
+			// a new shard file are transposed in buffers of half the memory
+			// budget.
+			shardPath.clear();
+			if (programOptions.option('H'))
+			{
+				sharedShards.reset(
+					new fsqueeze::SharedShards(programOptions.optionValue('H'), *iter));
+				if (!sharedShards->published())
+				{
+					cerr << "publishing... ";
+					publishDataSet(sharedShards.get(), *iter, dataStream,
+						programOptions.option('D') ? programOptions.optionValue('D') : "",
+						memoryBudget != 0 ? memoryBudget / 2 : SHARD_BUFFER_SIZE);
+				}
+			}
+			else if (programOptions.option('D'))
+			{
+				shardPath = programOptions.optionValue('D');
+				fsqueeze::DataSet::convertTADMDataSet(dataStream, shardPath,
+					memoryBudget != 0 ? memoryBudget / 2 : SHARD_BUFFER_SIZE);
+			}
+			else if (fsqueeze::isShardFile(*iter))
+				shardPath = *iter;
+
+			if (sharedShards.get() != 0)
+				ds = new fsqueeze::DataSet(sharedShards->dataSet());
+			else if (shardPath.empty())
+				ds = new fsqueeze::DataSet(
+					fsqueeze::DataSet::readTADMDataSet(dataStream));
+			else
+				ds = new fsqueeze::DataSet(
+					fsqueeze::DataSet::openShardedDataSet(shardPath));
+		} catch (runtime_error const &e) {
+			cerr << e.what() << endl;
+			return 1;
+		}
+
+		cerr << "done!" << endl;
+
+		if (programOptions.option('P') && !ds->outOfCore())
+		{
+			cerr << "Worker processes (-P) require a shard file (-D or a shard " <<
+				"file as data set)" << endl;
+			return 1;
+		}
+
+		if (ds->outOfCore() && (programOptions.option('u') ||
+				programOptions.option('c') || param.batchSize > 1))
+		{
+			cerr << "Duplicate folding (-u), correlation selection (-c) and " <<
+				"batches (-k) cannot" << endl << "be used with out-of-core " <<
+				"data sets" << endl;
+			return 1;
+		}
+
+		if (programOptions.option('u'))
+			foldDataSet(ds, logger);
+		
+		dataSets.push_back(ds);
+		
+		logger.error() << "Dynamic features: "<< ds->nFeatures() << "/" <<
+			ds->nFeatureIds() << endl;
+		
+		fsqueeze::ValueDictionary const &dictionary = ds->valueDictionary();
+		if (dictionary.indicator())
+			logger.error() << "Feature values: indicators" << endl;
+		else if (!dictionary.empty())
+			logger.error() << "Feature values: " << dictionary.size() <<
+				" distinct" << endl;
+	}
+
+	size_t concurrency = fsqueeze::executionThreads();
+	if (programOptions.option('j'))
+		concurrency = fsqueeze::parseString<size_t>(programOptions.optionValue('j'));
+
+	// The selections of a server depend on its requests, so the estimate
+	// only covers its data sets.
+	size_t nSelections = 1;
+	if (programOptions.option('S'))
+		nSelections = 0;
+	else if (programOptions.option('W'))
+		nSelections = concurrency;
+
+	vector<fsqueeze::DataSet const *> constDataSets(dataSets.begin(),
+		dataSets.end());
+	fsqueeze::MemoryUsage memoryUsage =
+		fsqueeze::jobMemoryUsage(constDataSets, job, nSelections);
+	fsqueeze::logMemoryUsage(logger, memoryUsage);
+
+	// Folding duplicates does not change the model, so it is the first
+	// resort when the estimate exceeds the budget.
+	if (memoryBudget != 0 && fsqueeze::memoryTotal(memoryUsage) > memoryBudget &&
+		!programOptions.option('u') && !programOptions.option('S') &&
+		job.algorithm != fsqueeze::ALGORITHM_CORRELATION &&
+		!dataSets[0]->outOfCore())
+	{
+		logger.error() << "Folding duplicates to fit the memory budget" << endl;
+		for (vector<fsqueeze::DataSet *>::const_iterator iter = dataSets.begin();
+				iter != dataSets.end(); ++iter)
+			foldDataSet(*iter, logger);
+
+		memoryUsage = fsqueeze::jobMemoryUsage(constDataSets, job, nSelections);
+		fsqueeze::logMemoryUsage(logger, memoryUsage);
+	}
+
+	if (memoryBudget != 0 && fsqueeze::memoryTotal(memoryUsage) > memoryBudget)
+	{
+		cerr << "The estimated memory use (" <<
+			fsqueeze::memoryTotal(memoryUsage) / 1048576 << " MB) exceeds the " <<
+			"memory budget (" << memoryBudget / 1048576 << " MB)!" << endl;
+		return 1;
+	}
+
+	for (vector<fsqueeze::DataSet *>::const_iterator iter = dataSets.begin();
+			iter != dataSets.end(); ++iter)
+		fsqueeze::placeDataSet(execConfig, *iter);
+
+	logger.error() << "Threads: " << fsqueeze::executionThreads() << endl;
+
+	if (programOptions.option('S'))
+	{
+		try {
+			fsqueeze::SelectionServer server(programOptions.optionValue('S'),
+				constDataSets, logger);
+			logger.error() << "Listening on " << programOptions.optionValue('S') <<
+				endl;
+			server.run();
+		} catch (runtime_error const &e) {
+			cerr << e.what() << endl;
+			return 1;
+		}
+	}
+	else if (programOptions.option('W'))
+	{
+		string prefix = "sweep";
+		if (programOptions.option('O'))
+			prefix = programOptions.optionValue('O');
+
+		fsqueeze::SweepJobs jobs;
+		try {
+			jobs = fsqueeze::expandSweepGrid(programOptions.optionValue('W'), job);
+		} catch (invalid_argument const &e) {
+			cerr << e.what() << endl;
+			return 1;
+		}
+
+		fsqueeze::runSweep(jobs, *dataSets[0], prefix, concurrency, logger);
+	}
+	else if (programOptions.option('P'))
+	{
+		size_t nWorkers =
+			fsqueeze::parseString<size_t>(programOptions.optionValue('P'));
+		if (nWorkers == 0)
+		{
+			cerr << "The number of worker processes should be at least 1" << endl;
+			return 1;
+		}
+		size_t nThreads = max<size_t>(1, fsqueeze::executionThreads() / nWorkers);
+
+		fsqueeze::SelectionWorkers workers(*dataSets[0], shardPath, nWorkers,
+			nThreads, logger);
+		workers.featureSelection(logger, param);
+	}
 	else
-		fsqueeze::featureSelection(ds, logger, param);
+		fsqueeze::runSelectionJob(job, *dataSets[0], logger);
+
+	if (!programOptions.option('W'))
+		fsqueeze::logBusyTimes(logger, busyTimes);
+	fsqueeze::logHugePageUsage(logger, fsqueeze::hugePageUsage());
+	
+	for (vector<fsqueeze::DataSet *>::const_iterator iter = dataSets.begin();
+			iter != dataSets.end(); ++iter)
+		delete *iter;
 	
 	return 0;
 }
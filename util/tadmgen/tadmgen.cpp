@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2010 Daniël de Kok
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ */
+
+/*
+ * Generate synthetic datasets in TADM format. The output is written
+ * context by context, so the size of the generated data set is not
+ * bounded by the available memory.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "FeatureSqueeze/stringutil.hh"
+
+#include "../fsqueeze/ProgramOptions.hh"
+
+using namespace std;
+
+namespace {
+
+// SplitMix64, a small and fast generator that is good enough for
+// generating test data. We do not use rand(), since we want the same
+// output for a given seed on every platform.
+class Random
+{
+public:
+	Random(unsigned long long seed) : d_state(seed) {}
+	unsigned long long next();
+
+	/**
+	 * Draw a number from [0, 1).
+	 */
+	double uniform();
+private:
+	unsigned long long d_state;
+};
+
+inline unsigned long long Random::next()
+{
+	unsigned long long z = (d_state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+inline double Random::uniform()
+{
+	return (next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+enum ValueDistribution { BINARY, COUNT, REAL };
+
+struct GeneratorParameters
+{
+	GeneratorParameters() : nContexts(1000), minEvents(2), maxEvents(16),
+		nFeatures(10000), featuresPerEvent(20), zipfExponent(1.0),
+		staticFraction(0.1), valueDistribution(BINARY), seed(42) {}
+	size_t nContexts;
+	size_t minEvents;
+	size_t maxEvents;
+	size_t nFeatures;
+	size_t featuresPerEvent;
+	double zipfExponent;
+	double staticFraction;
+	ValueDistribution valueDistribution;
+	unsigned long long seed;
+};
+
+// Draws feature identifiers with Zipfian frequencies: the probability of
+// the feature with rank r is proportional to 1 / r^s.
+class ZipfSampler
+{
+public:
+	ZipfSampler(size_t n, double s);
+	size_t operator()(Random *random) const;
+private:
+	vector<double> d_cdf;
+};
+
+ZipfSampler::ZipfSampler(size_t n, double s) : d_cdf(n)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		sum += 1.0 / pow(static_cast<double>(i + 1), s);
+		d_cdf[i] = sum;
+	}
+
+	for (size_t i = 0; i < n; ++i)
+		d_cdf[i] /= sum;
+}
+
+inline size_t ZipfSampler::operator()(Random *random) const
+{
+	size_t rank = lower_bound(d_cdf.begin(), d_cdf.end(), random->uniform()) -
+		d_cdf.begin();
+	return min(rank, d_cdf.size() - 1);
+}
+
+// Decide whether a feature is static. This is a pure function of the
+// feature identifier and the seed, so that the same features are static
+// in every context.
+bool isStatic(size_t feature, GeneratorParameters const &param)
+{
+	Random hash((param.seed << 32) ^ feature);
+	return hash.uniform() < param.staticFraction;
+}
+
+double featureValue(ValueDistribution dist, Random *random)
+{
+	switch (dist)
+	{
+	case COUNT:
+	{
+		// Geometric distribution, p = 0.5.
+		double val = 1.0;
+		while (random->uniform() < 0.5)
+			val += 1.0;
+		return val;
+	}
+	case REAL:
+		return floor((random->uniform() * 2.0 - 1.0) * 10000.0 + 0.5) / 10000.0;
+	default:
+		return 1.0;
+	}
+}
+
+typedef map<size_t, double> EventFeatures;
+
+void writeContext(ostream &out, GeneratorParameters const &param,
+	ZipfSampler const &zipf, Random *random)
+{
+	size_t nEvents = param.minEvents +
+		static_cast<size_t>(random->uniform() * (param.maxEvents - param.minEvents + 1));
+
+	// Static features have the same value for every event in a context.
+	EventFeatures staticFeatures;
+	vector<EventFeatures> events(nEvents);
+	for (size_t i = 0; i < nEvents; ++i)
+		for (size_t j = 0; j < param.featuresPerEvent; ++j)
+		{
+			size_t f = zipf(random);
+			if (isStatic(f, param))
+			{
+				if (staticFeatures.find(f) == staticFeatures.end())
+					staticFeatures[f] = featureValue(param.valueDistribution, random);
+			}
+			else
+				events[i][f] = featureValue(param.valueDistribution, random);
+		}
+
+	// One realization is the best one, the others get a lower score.
+	size_t best = static_cast<size_t>(random->uniform() * nEvents);
+
+	out << nEvents << '\n';
+	for (size_t i = 0; i < nEvents; ++i)
+	{
+		events[i].insert(staticFeatures.begin(), staticFeatures.end());
+
+		double prob = i == best ? 1.0 :
+			floor(random->uniform() * 1000.0) / 1000.0;
+
+		out << prob << ' ' << events[i].size();
+		for (EventFeatures::const_iterator iter = events[i].begin();
+				iter != events[i].end(); ++iter)
+			out << ' ' << iter->first << ' ' << iter->second;
+		out << '\n';
+	}
+}
+
+void writeTADMDataSet(ostream &out, GeneratorParameters const &param)
+{
+	Random random(param.seed);
+	ZipfSampler zipf(param.nFeatures, param.zipfExponent);
+
+	for (size_t i = 0; i < param.nContexts; ++i)
+		writeContext(out, param, zipf, &random);
+
+	out.flush();
+}
+
+ValueDistribution parseValueDistribution(string const &dist)
+{
+	if (dist == "binary")
+		return BINARY;
+	else if (dist == "count")
+		return COUNT;
+	else if (dist == "real")
+		return REAL;
+
+	throw invalid_argument("Unknown value distribution: " + dist);
+}
+
+}
+
+void usage(string const &programName)
+{
+	cerr << "Usage: " << programName << " [OPTION]" << endl << endl <<
+		"  -a n\t\t Features drawn per event (default: 20)" << endl <<
+		"  -c n\t\t Number of contexts (default: 1000)" << endl <<
+		"  -e n\t\t Maximum number of events per context (default: 16)" << endl <<
+		"  -f n\t\t Number of features (default: 10000)" << endl <<
+		"  -m n\t\t Minimum number of events per context (default: 2)" << endl <<
+		"  -o file\t Output file (default: stdout)" << endl <<
+		"  -r n\t\t Random seed (default: 42)" << endl <<
+		"  -s val\t Fraction of static features (default: 0.1)" << endl <<
+		"  -v dist\t Value distribution: binary, count or real (default: binary)" << endl <<
+		"  -z val\t Zipf exponent of feature frequencies (default: 1.0)" << endl << endl;
+}
+
+int main(int argc, char *argv[])
+{
+	fsqueeze::ProgramOptions programOptions(argc, argv, "a:c:e:f:m:o:r:s:v:z:");
+
+	if (programOptions.arguments().size() != 0)
+	{
+		usage(programOptions.programName());
+		return 1;
+	}
+
+	GeneratorParameters param;
+
+	if (programOptions.option('a'))
+		param.featuresPerEvent =
+			fsqueeze::parseString<size_t>(programOptions.optionValue('a'));
+
+	if (programOptions.option('c'))
+		param.nContexts = fsqueeze::parseString<size_t>(programOptions.optionValue('c'));
+
+	if (programOptions.option('e'))
+		param.maxEvents = fsqueeze::parseString<size_t>(programOptions.optionValue('e'));
+
+	if (programOptions.option('f'))
+		param.nFeatures = fsqueeze::parseString<size_t>(programOptions.optionValue('f'));
+
+	if (programOptions.option('m'))
+		param.minEvents = fsqueeze::parseString<size_t>(programOptions.optionValue('m'));
+
+	if (programOptions.option('r'))
+		param.seed = fsqueeze::parseString<unsigned long long>(
+			programOptions.optionValue('r'));
+
+	if (programOptions.option('s'))
+		param.staticFraction =
+			fsqueeze::parseString<double>(programOptions.optionValue('s'));
+
+	if (programOptions.option('v'))
+	{
+		try {
+			param.valueDistribution =
+				parseValueDistribution(programOptions.optionValue('v'));
+		} catch (invalid_argument const &e) {
+			cerr << e.what() << endl << endl;
+			usage(programOptions.programName());
+			return 1;
+		}
+	}
+
+	if (programOptions.option('z'))
+		param.zipfExponent = fsqueeze::parseString<double>(programOptions.optionValue('z'));
+
+	if (param.minEvents < 1 || param.minEvents > param.maxEvents)
+	{
+		cerr << "The minimum number of events should be between 1 and the " <<
+			"maximum number of events!" << endl;
+		return 1;
+	}
+
+	if (param.nFeatures == 0)
+	{
+		cerr << "The number of features should be at least 1!" << endl;
+		return 1;
+	}
+
+	if (programOptions.option('o'))
+	{
+		ofstream out(programOptions.optionValue('o').c_str());
+		if (!out)
+		{
+			cerr << "Error opening output file!" << endl;
+			return 1;
+		}
+
+		writeTADMDataSet(out, param);
+	}
+	else
+	{
+		ios::sync_with_stdio(false);
+		writeTADMDataSet(cout, param);
+	}
+
+	return 0;
+}